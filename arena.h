@@ -0,0 +1,181 @@
+/**
+ * arena.h - per-request memory of serverM
+ *           a request_arena hands out memory by bumping a pointer through a few large blocks and takes
+ *           it all back at once with reset(); serverM builds each request_context and everything it
+ *           owns (username views, result strings, the reply) in the request's arena and resets the
+ *           arena when the reply is sent, so a request costs no malloc() once the arenas in the pool
+ *           have grown to the size of the usual request
+ *           arena_allocator lets std containers allocate from an arena, their deallocate() does nothing;
+ *           node_pool_allocator recycles the nodes of node-based containers (ie. pending_requests)
+ *           through a free list instead of returning them to the heap
+ *           neither is thread-safe, the arenas and pools belong to serverM's event loop
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define ARENA_BLOCK_SIZE 4096 // first block of an arena, later blocks are at least this large
+#define ARENA_KEEP_BYTES 262144 // block bytes an arena keeps across reset(), blocks beyond are freed
+
+class request_arena {
+public:
+    request_arena() = default;
+    request_arena(const request_arena &) = delete;
+    request_arena &operator=(const request_arena &) = delete;
+
+    ~request_arena(){
+        for (const arena_block &block : blocks) {
+            ::operator delete(block.data);
+        }
+    }
+
+    // size bytes aligned to align (a power of two), valid until reset()
+    void *allocate(size_t size, size_t align){
+        if (!blocks.empty()) {
+            size_t start = (used + align - 1) & ~(align - 1);
+            if (start + size <= blocks[current].size) {
+                used = start + size;
+                return blocks[current].data + start;
+            }
+        }
+        // the next kept block that is large enough, or a new one (blocks are aligned for any type)
+        size_t next = blocks.empty() ? 0 : current + 1;
+        while (next < blocks.size() && blocks[next].size < size) {
+            next++;
+        }
+        if (next == blocks.size()) {
+            size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+            if (!blocks.empty() && blocks.back().size * 2 > block_size) {
+                block_size = blocks.back().size * 2;
+            }
+            blocks.push_back(arena_block{(char *)::operator new(block_size), block_size});
+        }
+        current = next;
+        used = size;
+        return blocks[current].data;
+    }
+
+    // a copy of data that lives as long as the arena's current contents
+    std::string_view copy(const char *data, size_t length){
+        char *out = (char *)allocate(length, 1);
+        memcpy(out, data, length);
+        return std::string_view(out, length);
+    }
+
+    std::string_view copy(std::string_view text){
+        return copy(text.data(), text.size());
+    }
+
+    // take back everything allocated so far, keeping the first ARENA_KEEP_BYTES of blocks for reuse
+    void reset(){
+        size_t kept = 0, keep_bytes = 0;
+        while (kept < blocks.size() && keep_bytes + blocks[kept].size <= ARENA_KEEP_BYTES) {
+            keep_bytes += blocks[kept++].size;
+        }
+        for (size_t i = kept; i < blocks.size(); i++) {
+            ::operator delete(blocks[i].data);
+        }
+        blocks.resize(kept);
+        current = 0;
+        used = 0;
+    }
+
+private:
+    struct arena_block {
+        char *data;
+        size_t size;
+    };
+    std::vector<arena_block> blocks;
+    size_t current = 0; // block being filled
+    size_t used = 0; // bytes of blocks[current] handed out
+};
+
+/**
+ * std allocator that allocates from a request_arena and never frees
+*/
+template <class T>
+struct arena_allocator {
+    typedef T value_type;
+    request_arena *arena;
+
+    explicit arena_allocator(request_arena *arena) : arena(arena) {}
+    template <class U>
+    arena_allocator(const arena_allocator<U> &other) : arena(other.arena) {}
+
+    T *allocate(size_t n){
+        return (T *)arena->allocate(n * sizeof(T), alignof(T));
+    }
+
+    void deallocate(T *, size_t){} // taken back by the arena's reset()
+};
+
+template <class T, class U>
+bool operator==(const arena_allocator<T> &a, const arena_allocator<U> &b){
+    return a.arena == b.arena;
+}
+
+template <class T, class U>
+bool operator!=(const arena_allocator<T> &a, const arena_allocator<U> &b){
+    return a.arena != b.arena;
+}
+
+template <class T>
+using arena_vector = std::vector<T, arena_allocator<T>>;
+typedef std::basic_string<char, std::char_traits<char>, arena_allocator<char>> arena_string;
+
+/**
+ * std allocator that keeps freed single nodes in a free list of their type and hands them out again,
+ * for node-based containers whose size goes up and down with the load
+*/
+template <class T>
+struct node_pool_allocator {
+    typedef T value_type;
+
+    node_pool_allocator() = default;
+    template <class U>
+    node_pool_allocator(const node_pool_allocator<U> &) {}
+
+    T *allocate(size_t n){
+        std::vector<void *> &nodes = free_nodes();
+        if (n == 1 && !nodes.empty()) {
+            void *node = nodes.back();
+            nodes.pop_back();
+            return (T *)node;
+        }
+        return (T *)::operator new(n * sizeof(T));
+    }
+
+    void deallocate(T *p, size_t n){
+        if (n == 1) {
+            free_nodes().push_back(p);
+        } else {
+            ::operator delete(p);
+        }
+    }
+
+    // the freed nodes of type T, shared by every allocator of T
+    static std::vector<void *> &free_nodes(){
+        static std::vector<void *> nodes;
+        return nodes;
+    }
+};
+
+template <class T, class U>
+bool operator==(const node_pool_allocator<T> &, const node_pool_allocator<U> &){
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const node_pool_allocator<T> &, const node_pool_allocator<U> &){
+    return false;
+}
+
+#endif
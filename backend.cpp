@@ -0,0 +1,1117 @@
+/**
+ * backend.cpp - a backend server (one shard of the user base) that processes a database file which contains
+ *               username and timer interval in the format of "username;[[t1_start,t1_end],[t2_start,t2_end]...]"
+ *               check for any input errors as reading the file and print out the error messages
+ *               stores the time intervals as packed integer pairs in one contiguous pool, indexed by
+ *               a user table sorted by username (index.h), which a restart maps from a snapshot (snapshot.h)
+ *               when every time fits in a small domain, each user also gets an availability bitmap
+ *               and intersections are computed with word-wise ANDs
+ *               and send the list of usernames to serverM via UDP
+ *               the database file is watched with inotify: on a change the index is rebuilt in the background
+ *               and swapped in atomically while queries keep running, and serverM is sent only
+ *               the usernames that were added or removed
+ *               the shard name, port and database file are command line options, serverA and serverB
+ *               are this program built with the SHARD_* defaults of the two original servers
+ *               queries can be served by several worker threads, each with its own SO_REUSEPORT socket
+ *               on the shard port, all reading the same index
+ *               every worker takes a batch of queries with recvmmsg() and sends the results with sendmmsg(),
+ *               SIGUSR1 prints how many datagrams each call moved
+ *               a batch query carries many queries, they are all answered from one index snapshot with
+ *               every distinct username looked up once, and the results go back as one datagram train
+ *               a slot query only wants the first common intervals of some length inside a window, the
+ *               intersection enters every user's intervals there by binary search and stops once it has enough
+ *               a coverage query (for a quorum request) is answered with the changes in the number of free
+ *               requested users over time, which serverM adds up over the shards
+ *               counters and latency histograms are served in the Prometheus text format on --metrics-port,
+ *               see metrics.h; every worker records into its own block, the watcher thread answers the scrapes
+ *               a traced query (one with a trace id, see trace.h) has its spans recorded in the worker's ring,
+ *               /trace on the metrics port lists them
+ *               the on screen messages are queued for the background thread of log.h, so the workers never
+ *               wait for the terminal
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <linux/filter.h>
+#include <libgen.h>
+#include <poll.h>
+#include <time.h>
+#include <algorithm>
+#include <iostream>
+#include <list>
+#include <cstring>
+#include <sstream>
+#include <map>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "protocol.h"
+#include "interval.h"
+#include "bitmap.h"
+#include "loader.h"
+#include "snapshot.h"
+#include "index.h"
+#include "metrics.h"
+#include "trace.h"
+#include "log.h"
+
+
+using namespace std;
+
+/**
+ * constants definition
+*/
+#define LOCAL_HOST "127.0.0.1"
+#define SERVER_M_PORT "23984"
+#ifndef SHARD_NAME
+#define SHARD_NAME "A" // default shard name, used in the on screen messages
+#endif
+#ifndef SHARD_PORT
+#define SHARD_PORT "21984" // default UDP port
+#endif
+#ifndef SHARD_DATABASE
+#define SHARD_DATABASE "a.txt" // default database file
+#endif
+#ifndef SHARD_METRICS_PORT
+#define SHARD_METRICS_PORT "0" // default TCP port of the metrics endpoint, 0 disables it
+#endif
+#define METRICS_IO_TIMEOUT_MS 1000 // a scrape that sends or reads slower than this is dropped
+#define SNAPSHOT_SUFFIX ".snap" // the binary snapshot of the parsed database is kept next to it, see snapshot.h
+#define RELOAD_SETTLE_MS 100 // reload once the database file has had no inotify event for this long
+#define DELTA_RETRY_MS 200 // resend an unacknowledged username delta after this long
+#define BACKLOG 10
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51 // linux 4.5, missing from older libc headers
+#endif
+
+/**
+ * shard configuration, set from the command line
+*/
+const char *shard_name = SHARD_NAME; // --shard
+const char *shard_host = LOCAL_HOST; // --host, address the UDP socket is bound to
+const char *shard_port = SHARD_PORT; // --port
+const char *database_file = SHARD_DATABASE; // --data
+const char *metrics_port = SHARD_METRICS_PORT; // --metrics-port
+int log_level = LEVEL_INFO; // --log-level
+const char *main_host = LOCAL_HOST; // --main HOST:PORT, where serverM listens for the backends
+const char *main_port = SERVER_M_PORT;
+string snapshot_file; // database_file + SNAPSHOT_SUFFIX
+
+/**
+ * gobal variables
+*/
+// the index queries read, built by read_file() and replaced by reload_database(),
+// always accessed with atomic_load()/atomic_store() so a reload never blocks a query
+shared_ptr<const availability_index> current_index;
+bool use_bitmap = true; // bitmap storage mode, disabled with --intervals
+unsigned loader_threads = 0; // worker threads used by read_file(), 0 means one per core
+unsigned max_intervals = MAX_INTERVALS_PER_USER; // most time intervals of one user, --max-intervals, 0 for no limit
+bool use_snapshot = true; // start from snapshot_file when it is current, disabled with --no-snapshot
+unsigned worker_count = 1; // query worker threads, --workers
+vector<string> registration_chunks; // username list datagrams, kept so serverM can ask for lost chunks again
+mutex registration_mutex; // guards registration_chunks, rebuilt by the watcher thread on every reload
+atomic<uint32_t> acked_version(0); // latest data version serverM acknowledged, set by the main thread
+
+/**
+ * counters and latency histograms, see metrics.h; the names are in backend_counters and backend_histograms
+*/
+enum backend_counter {
+    COUNT_QUERIES, COUNT_SLOT_QUERIES, COUNT_COVERAGE_QUERIES, COUNT_BATCH_LINES, COUNT_BATCH_QUERIES,
+    COUNT_UNKNOWN_USERNAMES, COUNT_DROPPED_MALFORMED, COUNT_RELOADS, COUNT_RELOAD_FAILURES, BACKEND_COUNTERS
+};
+enum backend_histogram {
+    STAGE_COMPUTE, STAGE_BATCH, BACKEND_HISTOGRAMS
+};
+const metric_desc backend_counters[BACKEND_COUNTERS] = {
+    {"backend_queries_total", "type=\"query\"", "Queries answered, a batch query counts once per line."},
+    {"backend_queries_total", "type=\"slot\"", "Queries answered, a batch query counts once per line."},
+    {"backend_queries_total", "type=\"coverage\"", "Queries answered, a batch query counts once per line."},
+    {"backend_queries_total", "type=\"batch_line\"", "Queries answered, a batch query counts once per line."},
+    {"backend_batch_queries_total", "", "Batch queries answered."},
+    {"backend_unknown_usernames_total", "", "Queried usernames this shard does not store."},
+    {"backend_datagrams_dropped_total", "reason=\"malformed\"", "Datagrams from serverM dropped without being used."},
+    {"backend_reloads_total", "result=\"ok\"", "Reloads of the database file."},
+    {"backend_reloads_total", "result=\"failed\"", "Reloads of the database file."},
+};
+const metric_desc backend_histograms[BACKEND_HISTOGRAMS] = {
+    {"backend_stage_seconds", "stage=\"compute\"", "Time spent answering one query or one whole batch query."},
+    {"backend_stage_seconds", "stage=\"batch\"", "Time spent answering one query or one whole batch query."},
+};
+int sockfd_metrics = -1; // listening socket of the metrics endpoint, served by watch_database()
+
+/**
+ * watcher thread state
+*/
+shared_ptr<const availability_index> acked_index; // the index serverM's directory matches
+vector<string> delta_datagrams; // username delta from acked_index to the current index
+uint32_t delta_version = 0; // data version delta_datagrams lead to
+
+/**
+ * query worker state, one per worker thread and only ever touched by that thread
+*/
+struct query_worker {
+    int sockfd = -1; // SO_REUSEPORT socket bound to shard_port
+    datagram_batch batch; // datagrams of the last recvmmsg()
+    vector<outgoing_datagram> results; // result datagrams of the batch, sent by flush_results()
+    batch_counter receive_batches, send_batches; // datagrams per recvmmsg()/sendmmsg() call
+    list<string> request_user_list;
+    vector<const user_record *> request_users; // the index entry of every requested user, NULL if unknown
+    unordered_map<string, const user_record *> batch_users; // batch query: index entry of every username seen so far
+    vector<string> batch_results; // batch query: one result line per query
+    vector<interval> result_time_intervals;
+    vector<string> result_words; // result_time_intervals formatted as "[start, end]", reused by queue_result()
+    vector<interval> scratch_time_intervals; // reused by find_intersection() so a query does not allocate
+    vector<uint64_t> scratch_bitmap; // running AND of the requested users' bitmaps
+    vector<interval_list> sweep_lists; // the requested users' intervals, input of intersect_k_way()
+    vector<sweep_event> sweep_heap; // scratch heap of intersect_k_way()
+    uint32_t request_id = 0; // request id of the query being served, echoed in the result
+    uint64_t trace_id = 0; // trace id of the query being served, echoed in the result, 0 if it is not traced
+    vector<pair<uint64_t, uint32_t>> traced; // (trace id, request id) of the traced queries of the batch
+    bool slot_query = false; // the query being served is a slot query, see slots
+    slot_filter slots; // slot query: the window, minimum length and number of slots wanted
+    bool coverage_query = false; // the query being served is a coverage query, answered with coverage
+    vector<coverage_step> coverage; // coverage query: free-user count changes of the requested users
+};
+deque<query_worker> workers; // workers[0] runs on the main thread, a deque because batch_counter cannot be moved
+batch_counter list_send_batches; // sendmmsg() calls of the username list, its resends and the deltas
+
+/**
+ * socket variables
+*/
+int sockfd; // socket of workers[0], also used for the username list and the deltas
+struct addrinfo hints, *servinfo, *p;
+int rv;
+char s[INET_ADDRSTRLEN];
+struct sockaddr_storage serverM_addr; // resolved once by resolve_main_server()
+socklen_t serverM_addr_len;
+
+/**
+ * function prototypes
+*/
+void *get_in_addr(struct sockaddr *sa);
+void read_file();
+void print_data();
+void print_result_time_interval(const query_worker &worker);
+int create_socket();
+void create_worker_sockets();
+void resolve_main_server();
+bool accept_connection(query_worker &worker, int i);
+void send_username_list();
+void resend_username_chunks(query_worker &worker, int i, const struct message_header &header, const char *payload, int payload_len);
+void find_intersection(query_worker &worker);
+void compute_intersection(const availability_index &index, query_worker &worker, const slot_filter *filter = NULL);
+void compute_slots(const availability_index &index, query_worker &worker, const slot_filter &filter);
+void compute_coverage(const availability_index &index, query_worker &worker);
+void find_batch_intersections(query_worker &worker, const char *payload, int payload_len);
+void send_result(query_worker &worker);
+void queue_result(query_worker &worker, uint32_t request_id);
+void flush_results(query_worker &worker);
+void run_worker(query_worker &worker);
+void print_batch_counters();
+void serve_metrics();
+string format_metrics();
+void watch_database();
+void reload_database();
+void send_username_delta();
+
+/**
+ * got from Beej's Guide to Network Programming
+*/
+// get sockaddr, IPv4 or IPv6:
+void *get_in_addr(struct sockaddr *sa)
+{
+    if (sa->sa_family == AF_INET) {
+        return &(((struct sockaddr_in*)sa)->sin_addr);
+    }
+
+    return &(((struct sockaddr_in6*)sa)->sin6_addr);
+}
+
+// read database_file, check for any input errors
+// and store the username and time intervals in the list and map of a new index
+// if snapshot_file was built from the current database_file it is used instead of parsing the text,
+// otherwise the file is mmapped and parsed by loader_threads workers (see loader.h)
+// and a fresh snapshot is written for the next start
+// the first data version is the start time, so serverM can tell a restarted backend from a stale datagram
+void read_file(){
+    shared_ptr<availability_index> index = make_shared<availability_index>();
+    string error;
+    if (!build_index(database_file, snapshot_file.c_str(), use_snapshot, loader_threads, max_intervals, use_bitmap, *index, error)) {
+        log_printf(LEVEL_ERROR, "%s", error.c_str());
+        exit(1); // the logger writes out the error at exit
+    }
+    index->version = time(NULL);
+    atomic_store(&current_index, shared_ptr<const availability_index>(index));
+}
+
+// print the username list and time intervals for error checking
+void print_data() {
+    shared_ptr<const availability_index> index = atomic_load(&current_index);
+    {
+        log_line line(LEVEL_DEBUG);
+        line.printf("Username List: ");
+        for (string_view username : index->usernames()) {
+            line.printf("%.*s ", (int)username.size(), username.data());
+        }
+    }
+
+    log_printf(LEVEL_DEBUG, "\nTime Intervals:");
+    for (uint32_t i = 0; i < index->user_count; i++) {
+        const snapshot_user &user = index->users[i];
+        log_printf(LEVEL_DEBUG, "%.*s: %s", (int)user.name_len, index->names + user.name_offset,
+                   format_interval_list(&index->intervals[user.record.offset], user.record.count).c_str());
+    }
+}
+
+void print_result_time_interval(const query_worker &worker){
+    log_printf(LEVEL_DEBUG, "Result Time Interval: %s",
+               format_interval_list(worker.result_time_intervals.data(), worker.result_time_intervals.size()).c_str());
+}
+
+/**
+ * got from Beej's Guide to Network Programming
+*/
+// create a UDP socket and bind to the port, return the socket
+// with more than one worker the port is shared with SO_REUSEPORT
+int create_socket(){
+    int sockfd;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if((rv = getaddrinfo(shard_host, shard_port, &hints, &servinfo)) != 0){
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        exit(1);
+    }
+
+    // loop through all the results and bind to the first we can
+    for(p = servinfo; p != NULL; p = p->ai_next){
+        if((sockfd = socket(p->ai_family, p->ai_socktype,
+                p->ai_protocol)) == -1){
+            perror("backend: socket");
+            continue;
+        }
+        int yes = 1;
+        if (worker_count > 1 && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof yes) == -1) {
+            perror("backend: setsockopt SO_REUSEPORT");
+            exit(1);
+        }
+        enable_drop_count(sockfd); // reported by the metrics endpoint
+        if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1){
+            close(sockfd);
+            perror("backend: bind");
+            continue;
+        }
+        break;
+    }
+
+    if (p == NULL){
+        fprintf(stderr, "backend: failed to bind socket\n");
+        exit(2);
+    }
+
+    freeaddrinfo(servinfo);
+    return sockfd;
+}
+
+// create the socket of every worker
+// serverM sends every query from the same address and port, so the kernel's default SO_REUSEPORT
+// flow hash would hand all of them to one socket; instead a classic BPF program picks the socket
+// from the request id of the datagram (bytes 4-7 of the header, the program sees the UDP payload),
+// so a retransmitted query goes to the same worker, and anything shorter than a header goes to workers[0]
+void create_worker_sockets(){
+    for (unsigned i = 0; i < worker_count; i++) {
+        workers.emplace_back();
+        workers.back().sockfd = create_socket();
+    }
+    sockfd = workers[0].sockfd;
+    if (worker_count > 1) {
+        struct sock_filter code[] = {
+            BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct message_header, request_id)), // A = request id
+            BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, worker_count), // A = A % worker_count
+            BPF_STMT(BPF_RET | BPF_A, 0), // index of the socket in the group
+        };
+        struct sock_fprog program;
+        program.len = sizeof code / sizeof code[0];
+        program.filter = code;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof program) == -1) {
+            perror("backend: setsockopt SO_ATTACH_REUSEPORT_CBPF"); // queries are then spread by the flow hash
+        }
+    }
+}
+
+// resolve the address of serverM once, every datagram to serverM is sent there
+void resolve_main_server(){
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    if((rv = getaddrinfo(main_host, main_port, &hints, &servinfo)) != 0){
+        fprintf(stderr, "backend: resolve_main_server: getaddrinfo: %s\n", gai_strerror(rv));
+        exit(1);
+    }
+    memcpy(&serverM_addr, servinfo->ai_addr, servinfo->ai_addrlen);
+    serverM_addr_len = servinfo->ai_addrlen;
+    freeaddrinfo(servinfo);
+}
+
+/**
+ * got from Beej's Guide to Network Programming
+*/
+// accept the connection from serverM: datagram i of the batch worker received
+// store the username that serverM sent in worker.request_user_list,
+// and for a slot query the slot parameters in front of them in worker.slots
+// nacks and acks are handled by whichever worker receives them
+// return true if the datagram is a query
+bool accept_connection(query_worker &worker, int i){
+    uint64_t receive_start = metrics_now_ns();
+    worker.trace_id = 0; // only a query is traced
+    struct message_header header;
+    const char *payload;
+    int payload_len;
+    if (!parse_datagram(worker.batch.bufs[i], worker.batch.msgs[i].msg_len, &header, &payload, &payload_len)) {
+        metrics_add(COUNT_DROPPED_MALFORMED);
+        log_printf(LEVEL_ERROR, "backend: accept_connection: malformed datagram");
+        return false;
+    }
+    if (header.type == MSG_REGISTER_NACK) { // serverM is missing some username list chunks
+        resend_username_chunks(worker, i, header, payload, payload_len);
+        return false;
+    }
+    if (header.type == MSG_DELTA_ACK) { // serverM applied our usernames up to this data version
+        acked_version.store(header.request_id);
+        return false;
+    }
+    if (header.type == MSG_BATCH_QUERY) { // many queries, answered here with one datagram train
+        uint64_t batch_start = metrics_now_ns();
+        find_batch_intersections(worker, payload, payload_len);
+        metrics_observe_since(STAGE_BATCH, batch_start);
+        metrics_add(COUNT_BATCH_QUERIES);
+        return false;
+    }
+    if (header.type != MSG_QUERY && header.type != MSG_SLOT_QUERY && header.type != MSG_COVERAGE_QUERY) {
+        metrics_add(COUNT_DROPPED_MALFORMED);
+        log_printf(LEVEL_ERROR, "backend: accept_connection: unknown message type");
+        return false;
+    }
+    worker.request_id = header.request_id;
+    worker.trace_id = header.trace_id;
+    // store the username that serverM sent in request_user_list
+    // and print "Server <shard> received the usernames from Main Server using UDP
+    // over <port>".
+    string received_usernames(payload, payload_len);
+    istringstream iss(received_usernames); 
+    string username;
+    worker.slot_query = header.type == MSG_SLOT_QUERY;
+    worker.coverage_query = header.type == MSG_COVERAGE_QUERY;
+    if (worker.slot_query) {
+        worker.slots = slot_filter();
+        iss >> worker.slots.min_duration >> worker.slots.window_start >> worker.slots.window_end >> worker.slots.limit;
+        if (!iss) {
+            metrics_add(COUNT_DROPPED_MALFORMED);
+            log_printf(LEVEL_ERROR, "backend: accept_connection: malformed slot query");
+            return false;
+        }
+        iss.get(); // the space before the usernames
+    }
+    worker.request_user_list.clear(); // clear the list
+    while (getline(iss, username, ' ')) {
+        worker.request_user_list.push_back(username);
+    }
+
+    // every message is queued as one line so the lines of different workers do not mix
+    log_printf(LEVEL_INFO, "Server %s received the usernames from Main Server using UDP over port %s.", shard_name, shard_port);
+    trace_span_since(worker.trace_id, "receive", worker.request_id, receive_start);
+    return true;
+}
+
+/**
+ * got from Beej's Guide to Network Programming
+*/
+// send the usernames of the index to serverM using UDP
+// the list is split into MTU-sized chunks, format: header(seq) + username1 username2 username3 ...
+// and the chunks are handed to the kernel in batches with sendmmsg()
+// every chunk carries the data version of the index
+void send_username_list(){
+    shared_ptr<const availability_index> index = atomic_load(&current_index);
+    lock_guard<mutex> lock(registration_mutex);
+    registration_chunks.clear();
+    make_chunked_datagrams(MSG_USERNAME_LIST, index->version, index->usernames(), registration_chunks);
+    vector<int> all_chunks(registration_chunks.size());
+    for (size_t i = 0; i < all_chunks.size(); i++) {
+        all_chunks[i] = i;
+    }
+
+    if (send_datagrams(sockfd, registration_chunks, all_chunks, (struct sockaddr *)&serverM_addr, serverM_addr_len, &list_send_batches) == -1) {
+        perror("send_username_list: sendmmsg");
+        exit(1);
+    }
+
+    // Server <A or B> finished sending a list of usernames to Main Server
+    log_printf(LEVEL_INFO, "The server%s finished sending a list of usernames to Main Server.", shard_name);
+}
+
+// resend the username list chunks listed in a nack from serverM (payload "seq1 seq2 ...")
+// and, if the nack has MSG_FLAG_RESEND_TAIL, every chunk from header.seq to the last one
+void resend_username_chunks(query_worker &worker, int i, const struct message_header &header, const char *payload, int payload_len){
+    lock_guard<mutex> lock(registration_mutex);
+    vector<int> chunks;
+    string received_seqs(payload, payload_len);
+    istringstream iss(received_seqs);
+    int seq;
+    while (iss >> seq) {
+        if (seq >= 0 && seq < (int)registration_chunks.size()) {
+            chunks.push_back(seq);
+        }
+    }
+    if (header.flags & MSG_FLAG_RESEND_TAIL) {
+        for (int i = header.seq; i < (int)registration_chunks.size(); i++) {
+            chunks.push_back(i);
+        }
+    }
+    if (send_datagrams(worker.sockfd, registration_chunks, chunks, (struct sockaddr *)&worker.batch.addrs[i],
+                       worker.batch.msgs[i].msg_hdr.msg_namelen, &list_send_batches) == -1) {
+        log_printf(LEVEL_ERROR, "resend_username_chunks: sendmmsg: %s", strerror(errno));
+    }
+}
+
+// Find the intersection of the time intervals of all users in request_user_list
+// and print it, see compute_intersection(), or for a coverage query their coverage, see compute_coverage()
+// the whole query reads the index that was current when it started
+void find_intersection(query_worker &worker) {
+    shared_ptr<const availability_index> index = atomic_load(&current_index);
+    const list<string> &request_user_list = worker.request_user_list;
+    const vector<interval> &result_time_intervals = worker.result_time_intervals;
+    worker.request_users.clear();
+    for (const string &user : request_user_list) {
+        const user_record *entry = index->find(user);
+        worker.request_users.push_back(entry);
+        if (entry == NULL) {
+            metrics_add(COUNT_UNKNOWN_USERNAMES);
+        }
+    }
+    metrics_add(worker.coverage_query ? COUNT_COVERAGE_QUERIES : worker.slot_query ? COUNT_SLOT_QUERIES : COUNT_QUERIES);
+    if (worker.coverage_query) {
+        compute_coverage(*index, worker);
+        log_line line(LEVEL_INFO);
+        line.printf("Found the coverage of <");
+        for (const string& user : request_user_list) {
+            line.printf("%s, ", user.c_str());
+        }
+        line.chop(2);
+        line.printf(">: %zu changes in the number of free users", worker.coverage.size());
+        return;
+    }
+    compute_intersection(*index, worker, worker.slot_query ? &worker.slots : NULL);
+
+    // If there is only one user in the request_user_list, the result is their time intervals
+    if (request_user_list.size() == 1) {
+        return;
+    }
+    if (!log_enabled(LEVEL_INFO)) {
+        return;
+    }
+    log_line line(LEVEL_INFO);
+    line.printf("Found the intersection result: [");
+    for (const interval &iv : result_time_intervals) {
+        line.printf("[%lld, %lld], ", (long long)iv.start, (long long)iv.end);
+    }
+    line.chop(result_time_intervals.empty() ? 0 : 2);
+    line.printf("] for <");
+    for (const string& user : request_user_list) {
+        line.printf("%s, ", user.c_str());
+    }
+    line.chop(2);
+    line.printf(">");
+}
+
+// intersect the time intervals of the users in worker.request_users into worker.result_time_intervals,
+// an unknown user (NULL) makes the result empty
+// for a slot query (filter is not NULL) see compute_slots()
+// in bitmap mode the users' bitmaps are ANDed together and the result converted back to intervals,
+// otherwise two users are merged with intersect_intervals() and more are swept together in one pass
+// with intersect_k_way()
+void compute_intersection(const availability_index &index, query_worker &worker, const slot_filter *filter) {
+    const interval *interval_pool = index.intervals;
+    const uint64_t *bitmap_pool = index.bitmaps;
+    size_t bitmap_words = index.bitmap_words;
+    const vector<const user_record *> &request_users = worker.request_users;
+    vector<interval> &result_time_intervals = worker.result_time_intervals;
+    vector<uint64_t> &scratch_bitmap = worker.scratch_bitmap;
+    vector<interval_list> &sweep_lists = worker.sweep_lists;
+    result_time_intervals.clear(); // Clear any previous results
+
+    const user_record *first = request_users.empty() ? NULL : request_users.front();
+    if (filter != NULL) {
+        compute_slots(index, worker, *filter);
+        return;
+    }
+
+    // If there is only one user, the result is their time intervals
+    if (request_users.size() <= 1) {
+        if (first != NULL) {
+            const interval *intervals = &interval_pool[first->offset];
+            result_time_intervals.assign(intervals, intervals + first->count);
+        }
+        return;
+    }
+
+    if (bitmap_words > 0 && first != NULL) {
+        // AND the bitmaps of every user into scratch_bitmap, stopping once it is empty
+        const uint64_t *first_bitmap = &bitmap_pool[first->bitmap_offset];
+        scratch_bitmap.assign(first_bitmap, first_bitmap + bitmap_words);
+        for (size_t i = 1; i < request_users.size(); i++) {
+            if (request_users[i] == NULL) {
+                scratch_bitmap.assign(bitmap_words, 0);
+                break;
+            }
+            bitmap_and(scratch_bitmap.data(), &bitmap_pool[request_users[i]->bitmap_offset], bitmap_words);
+            if (bitmap_empty(scratch_bitmap.data(), bitmap_words)) {
+                break;
+            }
+        }
+        bitmap_to_intervals(scratch_bitmap.data(), bitmap_words, result_time_intervals);
+        return;
+    }
+    sweep_lists.clear();
+    for (const user_record *user : request_users) {
+        if (user == NULL) { // an unknown user is never free
+            return;
+        }
+        sweep_lists.push_back(interval_list{&interval_pool[user->offset], user->count});
+    }
+    if (sweep_lists.size() == 2) {
+        intersect_intervals(sweep_lists[0].intervals, sweep_lists[0].count, sweep_lists[1].intervals, sweep_lists[1].count,
+                            result_time_intervals);
+    } else {
+        intersect_k_way(sweep_lists.data(), sweep_lists.size(), worker.sweep_heap, result_time_intervals);
+    }
+}
+
+// slot query: fold the users' intervals with intersect_slots(), which enters both lists at the window
+// by binary search; a common interval shorter than min_duration cannot contain a long enough slot, so
+// every fold drops those, and only the last fold stops once filter.limit slots were found
+// the bitmaps are not used, their AND would cover the whole time domain whatever the window
+void compute_slots(const availability_index &index, query_worker &worker, const slot_filter &filter){
+    const interval *interval_pool = index.intervals;
+    const vector<const user_record *> &request_users = worker.request_users;
+    vector<interval> &result_time_intervals = worker.result_time_intervals;
+    vector<interval> &scratch_time_intervals = worker.scratch_time_intervals;
+    if (request_users.empty() || find(request_users.begin(), request_users.end(), (const user_record *)NULL) != request_users.end()) {
+        return; // an unknown user is never free
+    }
+    const interval *common = &interval_pool[request_users[0]->offset];
+    size_t common_count = request_users[0]->count;
+    if (request_users.size() == 1) {
+        filter_slots(common, common_count, filter, filter.limit, result_time_intervals);
+        return;
+    }
+    for (size_t i = 1; i < request_users.size(); i++) {
+        scratch_time_intervals.clear();
+        uint32_t limit = (i + 1 == request_users.size()) ? filter.limit : 0;
+        intersect_slots(common, common_count, &interval_pool[request_users[i]->offset], request_users[i]->count,
+                        filter, limit, scratch_time_intervals);
+        result_time_intervals.swap(scratch_time_intervals);
+        common = result_time_intervals.data();
+        common_count = result_time_intervals.size();
+        if (common_count == 0) {
+            break;
+        }
+    }
+}
+
+// coverage query: sweep every requested user's intervals into worker.coverage, the times at which
+// the number of free users changes and by how much; an unknown user is never free, a repeated one counts once
+void compute_coverage(const availability_index &index, query_worker &worker){
+    vector<interval_list> &sweep_lists = worker.sweep_lists;
+    sweep_lists.clear();
+    for (auto user_it = worker.request_users.begin(); user_it != worker.request_users.end(); user_it++) {
+        const user_record *user = *user_it;
+        if (user != NULL && find(worker.request_users.begin(), user_it, user) == user_it) {
+            sweep_lists.push_back(interval_list{&index.intervals[user->offset], user->count});
+        }
+    }
+    worker.coverage.clear();
+    coverage_steps(sweep_lists.data(), sweep_lists.size(), worker.sweep_heap, worker.coverage);
+}
+
+// answer every line "request_id username1 username2 ..." of a batch query with a line
+// "request_id [t1_start, t1_end] [t2_start, t2_end] ..." and queue the lines for flush_results()
+// as MSG_BATCH_RESULT datagrams; the whole batch reads one index snapshot and looks up every distinct
+// username once, however many of its queries name it
+void find_batch_intersections(query_worker &worker, const char *payload, int payload_len){
+    shared_ptr<const availability_index> index = atomic_load(&current_index);
+    worker.batch_users.clear();
+    worker.batch_results.clear();
+    size_t query_count = 0;
+    const char *line = payload, *payload_end = payload + payload_len;
+    while (line < payload_end) {
+        query_count++;
+        const char *line_end = (const char *)memchr(line, '\n', payload_end - line);
+        if (line_end == NULL) {
+            line_end = payload_end;
+        }
+        const char *id_end = (const char *)memchr(line, ' ', line_end - line);
+        if (id_end == NULL) {
+            id_end = line_end;
+        }
+        string request_id(line, id_end - line);
+        worker.request_users.clear();
+        for (const char *user = id_end; user < line_end; ) {
+            user++; // skip the space
+            const char *user_end = (const char *)memchr(user, ' ', line_end - user);
+            if (user_end == NULL) {
+                user_end = line_end;
+            }
+            string username(user, user_end - user);
+            auto known = worker.batch_users.find(username);
+            if (known == worker.batch_users.end()) {
+                known = worker.batch_users.emplace(username, index->find(username)).first;
+            }
+            worker.request_users.push_back(known->second);
+            if (known->second == NULL) {
+                metrics_add(COUNT_UNKNOWN_USERNAMES);
+            }
+            user = user_end;
+        }
+        metrics_add(COUNT_BATCH_LINES);
+        compute_intersection(*index, worker);
+        string result_line = request_id + " " + format_interval_list(worker.result_time_intervals.data(), worker.result_time_intervals.size());
+        if (result_line.size() > (size_t)MAX_PAYLOAD_LEN) { // does not fit in one datagram, sent as its own result
+            queue_result(worker, strtoul(request_id.c_str(), NULL, 10));
+        } else {
+            worker.batch_results.push_back(result_line);
+        }
+        line = line_end + 1;
+    }
+
+    vector<string> datagrams;
+    if (!worker.batch_results.empty()) { // unless every result went out on its own
+        make_chunked_datagrams(MSG_BATCH_RESULT, 0, worker.batch_results, datagrams, "", '\n');
+    }
+    for (const string &datagram : datagrams) {
+        outgoing_datagram result;
+        result.data = datagram;
+        result.addr = (struct sockaddr *)&serverM_addr;
+        result.addr_len = serverM_addr_len;
+        worker.results.push_back(result);
+    }
+    log_printf(LEVEL_INFO, "Server %s received a batch of %zu queries from Main Server using UDP over port %s, %zu distinct usernames.",
+               shard_name, query_count, shard_port, worker.batch_users.size());
+}
+
+/**
+ * got from Beej's Guide to Network Programming
+*/
+// Send worker.result_time_intervals to serverM using UDP
+// the result is queued and sent with the rest of the batch by flush_results()
+// a coverage query is answered with worker.coverage as "time:+n time:-n ..." words, chunked the same way
+void send_result(query_worker &worker){
+    if (!worker.coverage_query) {
+        queue_result(worker, worker.request_id); // echo the request id of the query
+        return;
+    }
+    vector<string> &result_words = worker.result_words;
+    result_words.resize(worker.coverage.size());
+    for (size_t i = 0; i < worker.coverage.size(); i++) {
+        const coverage_step &step = worker.coverage[i];
+        result_words[i] = to_string(step.time) + (step.delta > 0 ? ":+" : ":") + to_string(step.delta);
+    }
+    vector<string> datagrams;
+    make_chunked_datagrams(MSG_COVERAGE_RESULT, worker.request_id, result_words, datagrams, "", ' ', worker.trace_id);
+    for (const string &datagram : datagrams) {
+        outgoing_datagram result;
+        result.data = datagram;
+        result.addr = (struct sockaddr *)&serverM_addr;
+        result.addr_len = serverM_addr_len;
+        worker.results.push_back(result);
+    }
+}
+
+// queue worker.result_time_intervals as the result of request_id, split into MTU-sized datagrams
+// numbered by seq (the last one flagged MSG_FLAG_LAST_CHUNK) however many intervals there are,
+// carrying worker.trace_id
+void queue_result(query_worker &worker, uint32_t request_id){
+    // Convert result_time_intervals to "[start, end]" words
+    const vector<interval> &result_time_intervals = worker.result_time_intervals;
+    vector<string> &result_words = worker.result_words;
+    result_words.resize(result_time_intervals.size());
+    for (size_t i = 0; i < result_time_intervals.size(); i++) {
+        result_words[i].clear();
+        format_interval(result_time_intervals[i], result_words[i]);
+    }
+    vector<string> datagrams;
+    make_chunked_datagrams(MSG_RESULT, request_id, result_words, datagrams, "", ' ', worker.trace_id);
+    for (const string &datagram : datagrams) {
+        outgoing_datagram result;
+        result.data = datagram;
+        result.addr = (struct sockaddr *)&serverM_addr;
+        result.addr_len = serverM_addr_len;
+        worker.results.push_back(result);
+    }
+}
+
+// send the results of a batch to serverM, SEND_BATCH per sendmmsg() call
+void flush_results(query_worker &worker){
+    size_t count = worker.results.size();
+    if (count == 0) {
+        return;
+    }
+    if (flush_datagrams(worker.sockfd, worker.results, &worker.send_batches) == -1) {
+        log_printf(LEVEL_ERROR, "flush_results: sendmmsg: %s", strerror(errno)); // serverM retransmits the queries whose result is lost
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        log_printf(LEVEL_INFO, "Server %s finished sending the response to Main Server.", shard_name);
+    }
+}
+
+// serve queries on the socket of worker forever
+// recvmmsg() blocks for the first datagram and then takes whatever else is already queued,
+// every query of the batch is answered before the results are sent together
+void run_worker(query_worker &worker){
+    while(1){
+        int n = receive_datagrams(worker.sockfd, worker.batch, MSG_WAITFORONE, &worker.receive_batches);
+        if (n == -1) {
+            if (errno != EINTR) {
+                log_printf(LEVEL_ERROR, "backend: run_worker: recvmmsg: %s", strerror(errno));
+            }
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            if(accept_connection(worker, i)){
+                uint64_t compute_start = metrics_now_ns();
+                find_intersection(worker);
+                uint64_t send_start = metrics_now_ns();
+                send_result(worker);
+                metrics_observe_since(STAGE_COMPUTE, compute_start);
+                trace_span(worker.trace_id, "find_intersection", worker.request_id, compute_start, send_start);
+                trace_span_since(worker.trace_id, "send_result", worker.request_id, send_start);
+                if (worker.trace_id != 0) {
+                    worker.traced.push_back(make_pair(worker.trace_id, worker.request_id));
+                }
+            }
+        }
+        uint64_t flush_start = metrics_now_ns();
+        flush_results(worker);
+        for (const pair<uint64_t, uint32_t> &query : worker.traced) { // the results left together
+            trace_span_since(query.first, "flush_results", query.second, flush_start);
+        }
+        worker.traced.clear();
+    }
+}
+
+// print the number of datagrams moved per recvmmsg() and sendmmsg() call so far, summed over the workers
+void print_batch_counters(){
+    batch_counter receive_batches, send_batches;
+    for (const query_worker &worker : workers) {
+        receive_batches.calls += worker.receive_batches.calls.load();
+        receive_batches.datagrams += worker.receive_batches.datagrams.load();
+        receive_batches.max_batch = max(receive_batches.max_batch.load(), worker.receive_batches.max_batch.load());
+        send_batches.calls += worker.send_batches.calls.load();
+        send_batches.datagrams += worker.send_batches.datagrams.load();
+        send_batches.max_batch = max(send_batches.max_batch.load(), worker.send_batches.max_batch.load());
+    }
+    log_printf(LEVEL_INFO, "Server %s received %s of recvmmsg().", shard_name, format_batch_counter(receive_batches).c_str());
+    log_printf(LEVEL_INFO, "Server %s sent %s of sendmmsg() for results and %s for username lists.", shard_name,
+               format_batch_counter(send_batches).c_str(), format_batch_counter(list_send_batches).c_str());
+}
+
+// answer one scrape of the metrics endpoint: accept it, read the HTTP request and send every metric,
+// or for /trace the trace spans recorded by every thread
+// runs on the watcher thread, so a slow scraper can hold it up for METRICS_IO_TIMEOUT_MS but never a worker
+void serve_metrics(){
+    int fd = accept(sockfd_metrics, NULL, NULL);
+    if (fd == -1) {
+        log_printf(LEVEL_ERROR, "backend: serve_metrics: accept: %s", strerror(errno));
+        return;
+    }
+    struct timeval timeout;
+    timeout.tv_sec = METRICS_IO_TIMEOUT_MS / 1000;
+    timeout.tv_usec = METRICS_IO_TIMEOUT_MS % 1000 * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+    string input;
+    char buf[1024];
+    while (!metrics_request_complete(input)) {
+        ssize_t n = recv(fd, buf, sizeof buf, 0);
+        if (n <= 0) { // closed, failed or timed out, answer whatever was asked
+            break;
+        }
+        input.append(buf, n);
+    }
+    string body = metrics_request_path(input) == "/trace" ? trace_dump(string("server ") + shard_name) : format_metrics();
+    string response = metrics_http_response(body);
+    // a /trace answer can be hundreds of kilobytes, keep sending until all of it is out or the scraper
+    // stops taking it for METRICS_IO_TIMEOUT_MS
+    size_t sent = 0;
+    while (sent < response.size()) {
+        ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            log_printf(LEVEL_WARNING, "backend: serve_metrics: could not send the metrics");
+            break;
+        }
+        sent += n;
+    }
+    close(fd);
+}
+
+// every counter and histogram summed over the threads, plus the index and socket statistics,
+// every series labelled with the shard name
+string format_metrics(){
+    string labels = string("shard=\"") + shard_name + "\"";
+    string out;
+    metrics_format_counters(backend_counters, BACKEND_COUNTERS, labels, out);
+    metrics_format_histograms(backend_histograms, BACKEND_HISTOGRAMS, labels, out);
+    shared_ptr<const availability_index> index = atomic_load(&current_index);
+    uint64_t received = 0, sent = 0, failed = 0, kernel_drops = 0;
+    for (const query_worker &worker : workers) {
+        received += worker.receive_batches.datagrams.load();
+        sent += worker.send_batches.datagrams.load();
+        failed += worker.send_batches.failed.load();
+        kernel_drops += worker.batch.kernel_drops.load();
+    }
+    metrics_format_value("backend_users", "gauge", "Usernames in the current index.", index->user_count, labels, out);
+    metrics_format_value("backend_data_version", "gauge", "Data version of the current index.", index->version, labels, out);
+    metrics_format_value("backend_workers", "gauge", "Query worker threads.", workers.size(), labels, out);
+    metrics_format_value("backend_udp_datagrams_received_total", "counter", "Datagrams received by the workers.", received, labels, out);
+    metrics_format_value("backend_udp_datagrams_sent_total", "counter", "Result datagrams sent by the workers.", sent, labels, out);
+    metrics_format_value("backend_udp_send_failures_total", "counter", "Result datagrams the kernel refused to send.", failed, labels, out);
+    metrics_format_value("backend_udp_receive_drops_total", "counter", "Datagrams the kernel dropped for a full receive buffer.",
+                         kernel_drops, labels, out);
+    metrics_format_value("backend_log_dropped_lines_total", "counter", "Log lines dropped because the log queue was full.",
+                         log_dropped_lines(), labels, out);
+    return out;
+}
+
+// watch the directory of database_file with inotify (editors often replace the file by renaming over it)
+// and call reload_database() once the file has been quiet for RELOAD_SETTLE_MS,
+// between events keep resending the username delta every DELTA_RETRY_MS until serverM acknowledges it
+// SIGUSR1 arrives on signal_fd and prints the batch counters, scrapes of the metrics endpoint arrive on sockfd_metrics
+// runs on its own thread, the worker threads keep serving queries from the current index
+void watch_database(){
+    // dirname() and basename() may modify their argument
+    string dir_copy = database_file, name_copy = database_file;
+    string watch_dir = dirname(&dir_copy[0]), watch_name = basename(&name_copy[0]);
+    int inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd == -1 || inotify_add_watch(inotify_fd, watch_dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+        perror("backend: watch_database: inotify");
+        return;
+    }
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC); // main() blocked SIGUSR1 in every thread
+    if (signal_fd == -1) {
+        perror("backend: watch_database: signalfd");
+    }
+    acked_index = atomic_load(&current_index);
+    char events_buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    while (1) {
+        struct pollfd pfds[3];
+        pfds[0].fd = inotify_fd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = signal_fd; // ignored by poll() while it is -1
+        pfds[1].events = POLLIN;
+        pfds[2].fd = sockfd_metrics;
+        pfds[2].events = POLLIN;
+        int timeout = changed ? RELOAD_SETTLE_MS : (delta_datagrams.empty() ? -1 : DELTA_RETRY_MS);
+        int ready = poll(pfds, 3, timeout);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("backend: watch_database: poll");
+            return;
+        }
+        if (ready > 0 && (pfds[1].revents & POLLIN)) {
+            struct signalfd_siginfo info;
+            if (read(signal_fd, &info, sizeof info) == sizeof info) {
+                print_batch_counters();
+            }
+        }
+        if (ready > 0 && (pfds[2].revents & POLLIN)) {
+            serve_metrics();
+        }
+        if (ready > 0 && !(pfds[0].revents & POLLIN)) {
+            continue;
+        }
+        if (ready > 0) {
+            ssize_t len = read(inotify_fd, events_buf, sizeof events_buf);
+            for (ssize_t i = 0; i < len; ) {
+                struct inotify_event *event = (struct inotify_event *)(events_buf + i);
+                if (event->len > 0 && watch_name == event->name) {
+                    changed = true;
+                }
+                i += sizeof(struct inotify_event) + event->len;
+            }
+            continue;
+        }
+        if (changed) {
+            changed = false;
+            reload_database();
+        }
+        send_username_delta();
+    }
+}
+
+// build a new index from database_file next to the current one and swap it in,
+// queries already running finish on the old index, which is freed with its last reader
+// on an input error the current index is kept
+void reload_database(){
+    shared_ptr<const availability_index> old_index = atomic_load(&current_index);
+    shared_ptr<availability_index> index = make_shared<availability_index>();
+    string error;
+    if (!build_index(database_file, snapshot_file.c_str(), use_snapshot, loader_threads, max_intervals, use_bitmap, *index, error)) {
+        log_printf(LEVEL_WARNING, "Server %s kept its current data, %s could not be reloaded: %s", shard_name, database_file, error.c_str());
+        metrics_add(COUNT_RELOAD_FAILURES);
+        return;
+    }
+    index->version = old_index->version + 1;
+    if (version_newer(time(NULL), index->version)) {
+        index->version = time(NULL);
+    }
+    {
+        // a full username list for serverM to ask for if it cannot apply the delta
+        lock_guard<mutex> lock(registration_mutex);
+        registration_chunks.clear();
+        make_chunked_datagrams(MSG_USERNAME_LIST, index->version, index->usernames(), registration_chunks);
+    }
+    atomic_store(&current_index, shared_ptr<const availability_index>(index));
+    metrics_add(COUNT_RELOADS);
+    log_printf(LEVEL_INFO, "Server %s reloaded %s: %u usernames.", shard_name, database_file, index->user_count);
+}
+
+// send serverM the usernames added and removed since the index it acknowledged last,
+// format: header(data version, seq) + base_version +username1 -username2 ...
+// the delta is rebuilt whenever a reload happens before serverM acknowledged the previous one
+void send_username_delta(){
+    shared_ptr<const availability_index> index = atomic_load(&current_index);
+    if (acked_version.load() == index->version) {
+        acked_index = index;
+    }
+    if (acked_index == index) {
+        delta_datagrams.clear();
+        return;
+    }
+    if (delta_datagrams.empty() || delta_version != index->version) {
+        vector<string> words;
+        diff_usernames(*acked_index, *index, words);
+        delta_datagrams.clear();
+        make_chunked_datagrams(MSG_USERNAME_DELTA, index->version, words, delta_datagrams, to_string(acked_index->version));
+        delta_version = index->version;
+    }
+    vector<int> all_chunks(delta_datagrams.size());
+    for (size_t i = 0; i < all_chunks.size(); i++) {
+        all_chunks[i] = i;
+    }
+    if (send_datagrams(sockfd, delta_datagrams, all_chunks, (struct sockaddr *)&serverM_addr, serverM_addr_len, &list_send_batches) == -1) {
+        log_printf(LEVEL_ERROR, "send_username_delta: sendmmsg: %s", strerror(errno));
+    }
+}
+
+// usage: backend [--shard NAME] [--port PORT] [--data FILE] [--host ADDR] [--main HOST:PORT]
+//                [--intervals] [--loader-threads N] [--no-snapshot] [--workers N] [--max-intervals N] [--metrics-port PORT]
+//                [--log-level LEVEL]
+// --shard NAME: shard name used in the on screen messages, SHARD_NAME by default
+// --port PORT: UDP port of this shard, it must match the shard table of serverM, SHARD_PORT by default
+// --data FILE: database file of this shard, SHARD_DATABASE by default
+// --host ADDR: address to bind, 127.0.0.1 by default
+// --main HOST:PORT: address of serverM, 127.0.0.1:23984 by default
+// --intervals: always intersect with the interval merge instead of the bitmap engine
+// --loader-threads N: parse the database file with N threads instead of one per core
+// --no-snapshot: always parse the text database and do not write a snapshot
+// --workers N: serve queries with N threads sharing the port with SO_REUSEPORT, 0 means one per core, 1 by default
+// --max-intervals N: accept up to N time intervals per user, 0 for no limit, MAX_INTERVALS_PER_USER by default
+// --metrics-port PORT: local TCP port of the Prometheus metrics endpoint, SHARD_METRICS_PORT by default, 0 disables it
+// --log-level LEVEL: error, warning, info (the default, every on screen message) or debug, see log.h
+int main(int argc, char *argv[]){
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--shard") == 0 && i + 1 < argc) {
+            shard_name = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            shard_port = argv[++i];
+        } else if (strcmp(argv[i], "--data") == 0 && i + 1 < argc) {
+            database_file = argv[++i];
+        } else if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+            shard_host = argv[++i];
+        } else if (strcmp(argv[i], "--main") == 0 && i + 1 < argc) {
+            char *colon = strrchr(argv[++i], ':');
+            if (colon == NULL) {
+                fprintf(stderr, "backend: --main expects HOST:PORT\n");
+                exit(1);
+            }
+            *colon = '\0';
+            main_host = argv[i];
+            main_port = colon + 1;
+        } else if (strcmp(argv[i], "--intervals") == 0) {
+            use_bitmap = false;
+        } else if (strcmp(argv[i], "--loader-threads") == 0 && i + 1 < argc) {
+            loader_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--no-snapshot") == 0) {
+            use_snapshot = false;
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            worker_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-intervals") == 0 && i + 1 < argc) {
+            max_intervals = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--metrics-port") == 0 && i + 1 < argc) {
+            metrics_port = argv[++i];
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            log_level = log_parse_level(argv[++i]);
+        }
+    }
+    if (log_level == -1) {
+        fprintf(stderr, "backend: --log-level expects error, warning, info or debug\n");
+        exit(1);
+    }
+    if (worker_count == 0) {
+        worker_count = thread::hardware_concurrency();
+    }
+    if (worker_count == 0) {
+        worker_count = 1;
+    }
+    // SIGUSR1 prints the batch counters, it is blocked here so every thread inherits the mask
+    // and only watch_database() receives it through its signalfd
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    log_start(log_level); // after the mask, the drain thread must not take SIGUSR1 either
+    snapshot_file = string(database_file) + SNAPSHOT_SUFFIX;
+    read_file();
+    create_worker_sockets();
+    resolve_main_server();
+    if (strcmp(metrics_port, "0") != 0) {
+        sockfd_metrics = metrics_listen(LOCAL_HOST, metrics_port); // -1 if it is taken, poll() then ignores it
+    }
+    log_printf(LEVEL_INFO, "The Server %s is up and running using UDP on port %s", shard_name, shard_port);
+    send_username_list();
+    thread(watch_database).detach(); // reload database_file whenever it changes
+    for (size_t i = 1; i < workers.size(); i++) {
+        thread(run_worker, ref(workers[i])).detach();
+    }
+    run_worker(workers[0]);
+    close(sockfd);
+    return 0;
+}
\ No newline at end of file
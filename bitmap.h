@@ -0,0 +1,137 @@
+/**
+ * bitmap.h - bitmap availability engine for bounded time domains
+ *            bit t of a user's bitmap is set when the user is free during [t, t + 1),
+ *            so intersecting N users is N word-wise ANDs (SSE2, or AVX2 when the CPU has it)
+ *            and the result is converted back to an interval list only for the reply
+*/
+
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "interval.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define BITMAP_X86 1
+#endif
+
+#define BITMAP_MIN_BITS 128 // narrowest bitmap, one SSE register
+#define BITMAP_MAX_BITS 4096 // widest bitmap, beyond this the interval merge is used instead
+
+// number of 64-bit words per bitmap for a time domain [0, max_time]:
+// the smallest power of two >= max_time bits, at least BITMAP_MIN_BITS,
+// or 0 if the domain is wider than BITMAP_MAX_BITS
+inline size_t choose_bitmap_words(timestamp_t max_time){
+    if (max_time < 0 || max_time > BITMAP_MAX_BITS) {
+        return 0;
+    }
+    size_t bits = BITMAP_MIN_BITS;
+    while (bits < (size_t)max_time) {
+        bits *= 2;
+    }
+    return bits / 64;
+}
+
+// set the bits of every interval in bitmap, which must hold words zeroed words
+inline void intervals_to_bitmap(const interval *intervals, size_t count, uint64_t *bitmap, size_t words){
+    for (size_t i = 0; i < count; i++) {
+        size_t start = intervals[i].start;
+        size_t end = intervals[i].end; // exclusive
+        if (end > words * 64) {
+            end = words * 64;
+        }
+        while (start < end) {
+            size_t word = start / 64;
+            size_t bit = start % 64;
+            size_t span = end - start < 64 - bit ? end - start : 64 - bit;
+            uint64_t mask = span == 64 ? ~0ULL : ((1ULL << span) - 1) << bit;
+            bitmap[word] |= mask;
+            start += span;
+        }
+    }
+}
+
+// convert the runs of set bits back to [start, end] intervals appended to out
+inline void bitmap_to_intervals(const uint64_t *bitmap, size_t words, std::vector<interval> &out){
+    bool in_run = false;
+    timestamp_t run_start = 0;
+    for (size_t w = 0; w < words; w++) {
+        uint64_t word = bitmap[w];
+        size_t bit = 0;
+        while (bit < 64) {
+            // skip to the next bit that changes the run state
+            uint64_t rest = (in_run ? ~word : word) >> bit;
+            if (rest == 0) {
+                break;
+            }
+            bit += __builtin_ctzll(rest);
+            timestamp_t t = (timestamp_t)(w * 64 + bit);
+            if (in_run) {
+                out.push_back(interval{run_start, t});
+            } else {
+                run_start = t;
+            }
+            in_run = !in_run;
+        }
+    }
+    if (in_run) {
+        out.push_back(interval{run_start, (timestamp_t)(words * 64)});
+    }
+}
+
+#ifdef BITMAP_X86
+// acc &= src, 256 bits per step, words must be a multiple of 2
+__attribute__((target("avx2")))
+inline void bitmap_and_avx2(uint64_t *acc, const uint64_t *src, size_t words){
+    size_t w = 0;
+    for (; w + 4 <= words; w += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(acc + w));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + w));
+        _mm256_storeu_si256((__m256i *)(acc + w), _mm256_and_si256(a, b));
+    }
+    for (; w < words; w += 2) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(acc + w));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + w));
+        _mm_storeu_si128((__m128i *)(acc + w), _mm_and_si128(a, b));
+    }
+}
+
+// acc &= src, 128 bits per step, words must be a multiple of 2
+inline void bitmap_and_sse2(uint64_t *acc, const uint64_t *src, size_t words){
+    for (size_t w = 0; w < words; w += 2) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(acc + w));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + w));
+        _mm_storeu_si128((__m128i *)(acc + w), _mm_and_si128(a, b));
+    }
+}
+#endif
+
+// acc &= src, using the widest vector unit the CPU supports
+inline void bitmap_and(uint64_t *acc, const uint64_t *src, size_t words){
+#ifdef BITMAP_X86
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2) {
+        bitmap_and_avx2(acc, src, words);
+    } else {
+        bitmap_and_sse2(acc, src, words);
+    }
+#else
+    for (size_t w = 0; w < words; w++) {
+        acc[w] &= src[w];
+    }
+#endif
+}
+
+// return true if no bit is set
+inline bool bitmap_empty(const uint64_t *bitmap, size_t words){
+    uint64_t any = 0;
+    for (size_t w = 0; w < words; w++) {
+        any |= bitmap[w];
+    }
+    return any == 0;
+}
+
+#endif
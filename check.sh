@@ -0,0 +1,132 @@
+#!/bin/bash
+# check.sh: checks that a warmed up serverM makes no heap allocation per request, and a few replies
+# run by "make check", needs serverM_counting (make serverM_counting), serverA, serverB and client,
+# uses the default ports and the a.txt and b.txt of input_files.tar.gz in a temporary directory
+
+REQUESTS=${REQUESTS:-2000}
+# allocations allowed per run of REQUESTS requests: accepting the connection and the
+# first requests on it may grow a table or a free list once, a request must not
+SLACK=16
+
+cd "$(dirname "$0")" || exit 1
+for program in serverM_counting serverA serverB client; do
+    if [ ! -x "$program" ]; then
+        echo "check: $program is missing, run make all serverM_counting first"
+        exit 1
+    fi
+done
+
+top=$(pwd)
+work=$(mktemp -d)
+trap 'kill $server_pids 2>/dev/null; wait 2>/dev/null; rm -rf "$work"' EXIT
+tar xzf input_files.tar.gz -C "$work" || exit 1
+cd "$work" || exit 1
+
+failed=0
+server_pids=""
+
+# start serverM_counting with the given arguments and both backends, wait until serverM takes clients
+start_servers(){
+    "$top/serverM_counting" --log-level warning "$@" > serverM.log 2>&1 < /dev/null &
+    server_pids="$!"
+    sleep 0.2
+    "$top/serverA" --log-level warning > serverA.log 2>&1 < /dev/null &
+    server_pids="$server_pids $!"
+    "$top/serverB" --log-level warning > serverB.log 2>&1 < /dev/null &
+    server_pids="$server_pids $!"
+    for i in $(seq 50); do
+        if (exec 3<> /dev/tcp/127.0.0.1/24984) 2> /dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    echo "check: serverM did not start"
+    cat serverM.log
+    exit 1
+}
+
+stop_servers(){
+    kill $server_pids 2> /dev/null
+    wait 2> /dev/null
+    server_pids=""
+}
+
+# value of one serverM metric
+metric(){
+    curl -s localhost:26984/metrics | awk -v name="$1" '$1 == name { print $2 }'
+}
+
+# send the line n times on one connection with the given client arguments
+send_lines(){
+    local n="$1" line="$2"
+    shift 2
+    for i in $(seq "$n"); do
+        echo "$line"
+    done | timeout 30 "$top/client" "$@" > /dev/null 2>&1
+}
+
+# check_allocations LABEL LINE [client arguments]: warms up, then counts the allocations of REQUESTS
+# requests (serverM_counting leaves the allocations of a scrape out of the counter)
+check_allocations(){
+    local label="$1" line="$2"
+    shift 2
+    send_lines 200 "$line" "$@"
+    local a0 r0 a1 r1
+    a0=$(metric serverm_heap_allocations_total)
+    r0=$(metric serverm_replies_total)
+    send_lines "$REQUESTS" "$line" "$@"
+    a1=$(metric serverm_heap_allocations_total)
+    r1=$(metric serverm_replies_total)
+    if [ -z "$a0" ] || [ -z "$a1" ]; then
+        echo "FAIL $label: no serverm_heap_allocations_total, is serverM_counting built with -DCOUNT_ALLOCATIONS?"
+        failed=1
+        return
+    fi
+    local allocations=$((a1 - a0)) replies=$((r1 - r0))
+    if [ "$replies" -lt "$REQUESTS" ]; then
+        echo "FAIL $label: $replies of $REQUESTS requests answered"
+        failed=1
+    elif [ "$allocations" -gt "$SLACK" ]; then
+        echo "FAIL $label: $allocations allocations for $replies requests"
+        failed=1
+    else
+        echo "ok   $label: $allocations allocations for $replies requests"
+    fi
+}
+
+# reply lines of the client to one line sent with the given client arguments
+replies(){
+    local line="$1"
+    shift
+    echo "$line" | timeout 10 "$top/client" "$@" 2> /dev/null | grep -v "^Client\|^Please\|^-----"
+}
+
+# check_same_reply LABEL LINE1 LINE2 [client arguments]: LINE1 and LINE2 must get the same reply
+check_same_reply(){
+    local label="$1" line1="$2" line2="$3"
+    shift 3
+    local reply1 reply2
+    reply1=$(replies "$line1" "$@")
+    reply2=$(replies "$line2" "$@")
+    if [ -z "$reply1" ] || [ "$reply1" != "$reply2" ]; then
+        echo "FAIL $label: \"$line1\" got \"$reply1\", \"$line2\" got \"$reply2\""
+        failed=1
+    else
+        echo "ok   $label"
+    fi
+}
+
+start_servers --cache-size 0
+check_same_reply "quorum counts a repeated user once" "khloe khloe" "khloe" --quorum 2
+check_same_reply "quorum counts a repeated user once, counts" "eli khloe eli" "eli khloe" --quorum 2 --counts
+check_allocations "two shards" "khloe eli kinsley"
+check_allocations "unknown user" "khloe nobody"
+check_allocations "slot" "khloe eli kinsley" --slot 2 --window 0 100 --first 1
+check_allocations "quorum counts" "khloe eli kinsley" --quorum 2 --counts
+stop_servers
+
+start_servers
+check_allocations "cached" "khloe eli kinsley"
+stop_servers
+
+exit $failed
@@ -1,6 +1,17 @@
 /**
  * client.cpp - a client program that connects to serverM via TCP
  *             and sends usernames to serverM and receives the reply from serverM
+ *             with --bench it is a load generator instead: it keeps N connections busy with queries
+ *             from a workload file or sampled from a username list, either closed-loop (one request
+ *             in flight per connection) or at a fixed rate, and reports throughput and latency percentiles
+ *             requests and replies use the framed protocol of framing.h, with --text the original
+ *             text protocol is spoken instead
+ *             with --batch FILE every line of FILE is sent in one batch request and the replies are
+ *             printed next to their lines
+ *             with --slot D (and --window T0 T1, --first K) every request asks only for the first K common
+ *             intervals inside [T0, T1] that last at least D
+ *             with --quorum K every request asks for the times at which at least K of the users are free,
+ *             with --counts as well the intervals are cut wherever the number of free users changes
 */
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,13 +21,25 @@
 #include <netdb.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
+#include <poll.h>
 #include <iostream>
+#include <fstream>
 #include <list>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+#include <vector>
 #include <cstring>
 #include <sstream>
+#include <chrono>
+#include <random>
+#include "histogram.h"
+#include "framing.h"
+#include "interval.h"
 
 using namespace std;
 
@@ -27,6 +50,19 @@ using namespace std;
 #define SERVER_M_PORT "24984"
 #define MAXDATASIZE 1024
 #define BACKLOG 10
+#define BENCH_STALL_MS 10000 // give up a benchmark when no reply arrived for this long
+
+/**
+ * one benchmark connection, it has at most bench_pipeline requests in flight (one with --text)
+*/
+struct bench_connection {
+    int fd = -1;
+    int busy = 0; // requests sent whose final reply has not arrived
+    vector<string> usernames; // text protocol: the usernames of the request in flight
+    chrono::steady_clock::time_point start; // text protocol: when the request was due, latency is measured from here
+    unordered_map<uint32_t, chrono::steady_clock::time_point> starts; // framed: when each request in flight was due, by request id
+    string reply; // reply bytes received so far
+};
 
 /**
  * global variables
@@ -38,17 +74,48 @@ int rv;
 char s[INET_ADDRSTRLEN];
 unsigned int client_port;
 list<string> username_record;
+bool text_protocol = false; // --text, speak the original text protocol instead of framing.h
+uint32_t next_request_id = 1; // request id of the next framed request
+string frame_input; // reply bytes received that do not make a whole frame yet
+bool slot_query = false; // --slot, --window or --first: send slot requests
+slot_filter slot_options; // the slots every request asks for
+uint32_t quorum = 0; // --quorum K: send quorum requests for at least K free users, 0 for intersections
+bool quorum_counts = false; // --counts: ask quorum requests for the number of free users of every interval
+
+/**
+ * benchmark options, set from the command line
+*/
+int bench_connections = 1; // --connections
+long bench_requests = 10000; // --requests, total number of requests
+double bench_duration = 0; // --duration, stop sending after this many seconds instead, 0 for --requests
+double bench_rate = 0; // --rate, requests per second over all connections, 0 for closed-loop
+const char *bench_workload = NULL; // --workload, file with one query per line, replayed in order
+const char *bench_users = NULL; // --users, file with one username per line (or a database file)
+int bench_group_size = 2; // --group-size, usernames per sampled query
+int bench_pipeline = 1; // --pipeline, requests in flight per connection
+unsigned bench_seed = 1; // --seed, for the sampler
+vector<string> bench_queries; // the workload lines
+vector<string> bench_usernames; // the usernames the sampler draws from
 
 /**
  * function prototypes
 */
 void *get_in_addr(struct sockaddr *sa);
+int connect_to_serverM();
 void create_socket();
 void send_username(const string&  username);
 void receive_from_serverM();
+string receive_frame();
+void receive_framed_reply();
+void run_batch(const char *batch_file);
 bool check_username(const string&  username);
 void insert_to_username_record(const string& username_string);
 bool match_username_record(const string& username_string);
+void load_bench_input();
+string next_bench_query(mt19937 &rng, long sequence);
+bool bench_reply_complete(const bench_connection &conn);
+void print_bench_report(const latency_histogram &histogram, long completed, long errors, double elapsed);
+void run_benchmark();
 
 
 /**
@@ -67,8 +134,9 @@ void *get_in_addr(struct sockaddr *sa)
 /**
  * got from Beej's Guide to Network Programming
 */
-// create TCP socket in order to connect serverM
-void create_socket(){
+// open a TCP connection to serverM and return its socket
+int connect_to_serverM(){
+    int fd = -1;
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
@@ -80,17 +148,19 @@ void create_socket(){
 
     // loop through all the results and connect to the first we can
     for(p = servinfo; p != NULL; p = p->ai_next) {
-        if ((sockfd = socket(p->ai_family, p->ai_socktype, // create socket
+        if ((fd = socket(p->ai_family, p->ai_socktype, // create socket
                 p->ai_protocol)) == -1) {
             perror("client: socket");
             continue;
         }
 
-        if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) { // connect to serverM
-            close(sockfd);
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == -1) { // connect to serverM
+            close(fd);
             perror("client: connect");
             continue;
         }
+        int yes = 1; // requests are small and sent whole
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
 
         break;
     }
@@ -99,7 +169,15 @@ void create_socket(){
         fprintf(stderr, "client: failed to connect\n");
         exit(2);
     }
-    
+
+    freeaddrinfo(servinfo);
+    return fd;
+}
+
+// create TCP socket in order to connect serverM
+void create_socket(){
+    sockfd = connect_to_serverM();
+
     // Get the local port of the client's socket
     struct sockaddr_storage local_addr;
     socklen_t local_addr_len = sizeof(local_addr);
@@ -118,16 +196,28 @@ void create_socket(){
         client_port = ntohs(addr_in6->sin6_port);
         //printf("client: local port number is %u\n", client_port);
     }
-
-    freeaddrinfo(servinfo);
 }
 
 /**
  * got from Beej's Guide to Network Programming
 */
-// send usernames to serverM
+// send usernames to serverM, in a request frame unless text_protocol is set,
+// or in a slot request frame with slot_options if slot_query is set, or in a quorum request frame if quorum is set
 void send_username(const string&  username){
-    if (send(sockfd, username.c_str(), username.length(), 0) == -1) // send username to serverM
+    string request;
+    if (text_protocol) {
+        request = username;
+    } else if (slot_query) {
+        string parameters = to_string(slot_options.min_duration) + " " + to_string(slot_options.window_start) + " "
+                            + to_string(slot_options.window_end) + " " + to_string(slot_options.limit) + " ";
+        request = make_frame(FRAME_SLOT_REQUEST, next_request_id++, parameters + username);
+    } else if (quorum > 0) {
+        string parameters = to_string(quorum) + (quorum_counts ? " 1 " : " 0 ");
+        request = make_frame(FRAME_QUORUM_REQUEST, next_request_id++, parameters + username);
+    } else {
+        request = make_frame(FRAME_REQUEST, next_request_id++, username);
+    }
+    if (send(sockfd, request.c_str(), request.length(), 0) == -1) // send username to serverM
         perror("client: send");
     cout << "Client finished sending the usernames to Main Server." << endl;
 }
@@ -146,6 +236,82 @@ void receive_from_serverM(){
     cout << buf << endl;
 }
 
+// receive the next frame from serverM and return its payload
+string receive_frame(){
+    struct frame_header header;
+    int parsed;
+    while ((parsed = parse_frame(frame_input.data(), frame_input.size(), &header)) == 0) {
+        if ((numbytes = recv(sockfd, buf, MAXDATASIZE, 0)) <= 0) {
+            fprintf(stderr, "client: serverM closed the connection\n");
+            exit(1);
+        }
+        frame_input.append(buf, numbytes);
+    }
+    if (parsed == -1) {
+        fprintf(stderr, "client: malformed reply from serverM\n");
+        exit(1);
+    }
+    string payload = frame_input.substr(FRAME_HEADER_LEN, header.length);
+    frame_input.erase(0, FRAME_HEADER_LEN + header.length);
+    return payload;
+}
+
+// receive the reply frame of the last request and print every line of it as one reply
+void receive_framed_reply(){
+    istringstream reply(receive_frame());
+    string line;
+    while (getline(reply, line)) {
+        cout << "Client received the reply from the Main Server using TCP over port ";
+        cout << client_port << ": " << endl;
+        cout << line << endl;
+    }
+}
+
+// send every valid line of batch_file in one batch request frame, then print every line with its reply
+void run_batch(const char *batch_file){
+    ifstream in(batch_file);
+    if (!in) {
+        fprintf(stderr, "client: cannot open %s\n", batch_file);
+        exit(1);
+    }
+    vector<string> requests;
+    string line, payload;
+    while (getline(in, line)) {
+        if (line.empty() || !check_username(line)) {
+            fprintf(stderr, "client: skipping invalid line \"%s\"\n", line.c_str());
+            continue;
+        }
+        payload += (requests.empty() ? "" : "\n") + line;
+        requests.push_back(line);
+    }
+    if (payload.size() > FRAME_MAX_PAYLOAD) {
+        fprintf(stderr, "client: %s is too long for one batch request\n", batch_file);
+        exit(1);
+    }
+    create_socket();
+    string request = make_frame(FRAME_BATCH_REQUEST, next_request_id++, payload);
+    size_t sent = 0;
+    while (sent < request.size()) {
+        ssize_t n = send(sockfd, request.data() + sent, request.size() - sent, 0);
+        if (n == -1) {
+            perror("client: send");
+            exit(1);
+        }
+        sent += n;
+    }
+    cout << "Client finished sending a batch of " << requests.size() << " requests to Main Server." << endl;
+
+    istringstream reply(receive_frame());
+    cout << "Client received the reply from the Main Server using TCP over port " << client_port << ": " << endl;
+    for (const string &usernames : requests) {
+        if (!getline(reply, line)) {
+            line.clear();
+        }
+        cout << usernames << ": " << line << endl;
+    }
+    close(sockfd);
+}
+
 // check if the username is valid return true if valid, false if not
 bool check_username(const string&  username_str){
     istringstream iss(username_str);
@@ -211,19 +377,386 @@ bool match_username_record(const string& username_string) {
     return true;
 }
 
+// read the benchmark input: the workload file (one query per line, empty lines skipped)
+// or the username list for the sampler (one username per line; anything from a ';' on is ignored,
+// so a database file like a.txt works too)
+void load_bench_input(){
+    const char *filename = bench_workload != NULL ? bench_workload : bench_users;
+    ifstream file(filename);
+    if (!file) {
+        fprintf(stderr, "client: cannot open %s\n", filename);
+        exit(1);
+    }
+    string line;
+    while (getline(file, line)) {
+        if (bench_workload == NULL) {
+            line = line.substr(0, line.find(';'));
+            line.erase(remove(line.begin(), line.end(), ' '), line.end());
+        }
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty()) {
+            continue;
+        }
+        (bench_workload != NULL ? bench_queries : bench_usernames).push_back(line);
+    }
+    if (bench_queries.empty() && bench_usernames.empty()) {
+        fprintf(stderr, "client: %s has no queries\n", filename);
+        exit(1);
+    }
+}
 
-int main(){
+// the query of the sequence-th request: the workload lines in order (wrapping around),
+// or bench_group_size distinct usernames drawn uniformly from the username list
+string next_bench_query(mt19937 &rng, long sequence){
+    if (!bench_queries.empty()) {
+        return bench_queries[sequence % bench_queries.size()];
+    }
+    uniform_int_distribution<size_t> pick(0, bench_usernames.size() - 1);
+    vector<size_t> chosen;
+    while ((int)chosen.size() < bench_group_size && chosen.size() < bench_usernames.size()) {
+        size_t index = pick(rng);
+        if (find(chosen.begin(), chosen.end(), index) == chosen.end()) {
+            chosen.push_back(index);
+        }
+    }
+    string query;
+    for (size_t index : chosen) {
+        query += (query.empty() ? "" : " ") + bench_usernames[index];
+    }
+    return query;
+}
+
+// text protocol: serverM sends "<usernames> do not exist." first when some usernames are unknown and then
+// the result ("Time intervals ..." or "Timed out: ...") unless every username was unknown,
+// so a request is complete once the result arrived or every username was reported missing
+bool bench_reply_complete(const bench_connection &conn){
+    if (conn.reply.find("Time intervals") != string::npos || conn.reply.find("Timed out") != string::npos) {
+        return true;
+    }
+    size_t not_exist = conn.reply.find(" do not exist.");
+    if (not_exist == string::npos) {
+        return false;
+    }
+    string missing = conn.reply.substr(0, not_exist) + ", ";
+    for (const string &username : conn.usernames) {
+        if (missing.find(username + ", ") == string::npos) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// print throughput, latency percentiles and a histogram with one row per power of two microseconds
+void print_bench_report(const latency_histogram &histogram, long completed, long errors, double elapsed){
+    cout << "Benchmark: " << completed << " requests over " << bench_connections << " connections in "
+         << elapsed << " s (" << (bench_rate > 0 ? "open loop at " + to_string((long)bench_rate) + " requests/s" : string("closed loop")) << ")" << endl;
+    cout << "Throughput: " << (elapsed > 0 ? completed / elapsed : 0) << " requests/s" << endl;
+    cout << "Errors: " << errors << endl;
+    cout << "Latency (us): mean " << (histogram.total > 0 ? histogram.sum / histogram.total : 0)
+         << " p50 " << histogram_percentile(histogram, 0.50)
+         << " p90 " << histogram_percentile(histogram, 0.90)
+         << " p99 " << histogram_percentile(histogram, 0.99)
+         << " p999 " << histogram_percentile(histogram, 0.999)
+         << " max " << histogram.max << endl;
+    cout << "Latency histogram (us):" << endl;
+    uint64_t row_count = 0;
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        row_count += histogram.counts[bucket];
+        // a row ends at the last bucket below the next power of two
+        bool row_end = bucket < HISTOGRAM_SUB_BUCKETS ? (bucket & (bucket + 1)) == 0 : bucket % HISTOGRAM_SUB_BUCKETS == HISTOGRAM_SUB_BUCKETS - 1;
+        if (!row_end) {
+            continue;
+        }
+        if (row_count > 0) {
+            uint64_t high = histogram_bucket_high(bucket);
+            uint64_t low = bucket == 0 ? 0 : (high + 1) / 2;
+            double share = 100.0 * row_count / histogram.total;
+            printf("  [%8llu, %8llu] %10llu %6.2f%% %s\n", (unsigned long long)low, (unsigned long long)high,
+                   (unsigned long long)row_count, share, string((size_t)(share / 2), '#').c_str());
+        }
+        row_count = 0;
+    }
+}
+
+// drive serverM with bench_connections connections until bench_requests requests completed
+// (or bench_duration passed) and print the report
+// closed loop: every connection keeps bench_pipeline requests in flight
+// open loop: requests are due every 1/bench_rate seconds whether or not earlier ones finished,
+// a due request waits for a connection with fewer than bench_pipeline requests in flight
+// and its latency counts from when it was due
+void run_benchmark(){
+    load_bench_input();
+    vector<bench_connection> conns(bench_connections);
+    vector<struct pollfd> pfds(bench_connections);
+    for (int i = 0; i < bench_connections; i++) {
+        conns[i].fd = connect_to_serverM();
+        pfds[i].fd = conns[i].fd;
+        pfds[i].events = POLLIN;
+    }
+    mt19937 rng(bench_seed);
+    latency_histogram histogram;
+    histogram_clear(histogram);
+    deque<chrono::steady_clock::time_point> due; // open loop: requests that are due but not sent yet
+    chrono::steady_clock::time_point begin = chrono::steady_clock::now(), last_reply = begin;
+    chrono::steady_clock::time_point next_due = begin;
+    chrono::nanoseconds interval(bench_rate > 0 ? (long long)(1e9 / bench_rate) : 0);
+    long issued = 0, completed = 0, errors = 0, in_flight = 0;
+    bool sending = true;
+
+    while (sending || in_flight > 0) {
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        if (sending && ((bench_duration > 0 && now - begin >= chrono::duration<double>(bench_duration))
+                        || (bench_duration <= 0 && issued + (long)due.size() >= bench_requests))) {
+            sending = false;
+        }
+        if (bench_rate > 0) {
+            while (sending && next_due <= now && (bench_duration > 0 || issued + (long)due.size() < bench_requests)) {
+                due.push_back(next_due);
+                next_due += interval;
+            }
+        }
+        // hand requests to the connections that have room for one
+        for (bench_connection &conn : conns) {
+            while (conn.busy < bench_pipeline) {
+                chrono::steady_clock::time_point start;
+                if (bench_rate > 0) {
+                    if (due.empty()) {
+                        break;
+                    }
+                    start = due.front();
+                    due.pop_front();
+                } else {
+                    if (!sending) {
+                        break;
+                    }
+                    start = chrono::steady_clock::now();
+                }
+                string query = next_bench_query(rng, issued++);
+                string request = query;
+                if (text_protocol) {
+                    conn.start = start;
+                    conn.usernames.clear();
+                    istringstream iss(query);
+                    string username;
+                    while (iss >> username) {
+                        conn.usernames.push_back(username);
+                    }
+                    conn.reply.clear();
+                } else {
+                    conn.starts[next_request_id] = start;
+                    request = make_frame(FRAME_REQUEST, next_request_id++, query);
+                }
+                if (send(conn.fd, request.c_str(), request.length(), 0) == -1) {
+                    perror("client: run_benchmark: send");
+                    errors++;
+                    break;
+                }
+                conn.busy++;
+                in_flight++;
+                if (bench_rate <= 0 && bench_duration <= 0 && issued >= bench_requests) {
+                    sending = false;
+                }
+            }
+        }
+        if (!sending && in_flight == 0 && due.empty()) {
+            break;
+        }
+
+        int timeout = BENCH_STALL_MS;
+        if (bench_rate > 0 && sending) {
+            long long wait_ms = chrono::duration_cast<chrono::milliseconds>(next_due - chrono::steady_clock::now()).count();
+            timeout = wait_ms < 0 ? 0 : (wait_ms < timeout ? wait_ms : timeout);
+        }
+        int ready = poll(pfds.data(), pfds.size(), timeout);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("client: run_benchmark: poll");
+            exit(1);
+        }
+        now = chrono::steady_clock::now();
+        if (ready == 0) {
+            if (in_flight > 0 && now - last_reply >= chrono::milliseconds(BENCH_STALL_MS)) {
+                fprintf(stderr, "client: no reply from serverM for %d ms, stopping the benchmark\n", BENCH_STALL_MS);
+                errors += in_flight;
+                break;
+            }
+            continue;
+        }
+        for (int i = 0; i < bench_connections; i++) {
+            if (!(pfds[i].revents & (POLLIN | POLLERR | POLLHUP))) {
+                continue;
+            }
+            bench_connection &conn = conns[i];
+            if ((numbytes = recv(conn.fd, buf, MAXDATASIZE - 1, 0)) <= 0) {
+                fprintf(stderr, "client: run_benchmark: serverM closed a connection\n");
+                exit(1);
+            }
+            if (text_protocol) {
+                if (!conn.busy) { // the tail of an earlier reply
+                    continue;
+                }
+                conn.reply.append(buf, numbytes);
+                if (bench_reply_complete(conn)) {
+                    histogram_record(histogram, chrono::duration_cast<chrono::microseconds>(now - conn.start).count());
+                    conn.busy = 0;
+                    in_flight--;
+                    completed++;
+                    last_reply = now;
+                }
+                continue;
+            }
+            // every whole reply frame completes the request with its id
+            conn.reply.append(buf, numbytes);
+            size_t offset = 0;
+            struct frame_header header;
+            int parsed;
+            while ((parsed = parse_frame(conn.reply.data() + offset, conn.reply.size() - offset, &header)) == 1) {
+                offset += FRAME_HEADER_LEN + header.length;
+                auto entry = conn.starts.find(header.request_id);
+                if (entry == conn.starts.end()) {
+                    fprintf(stderr, "client: run_benchmark: reply for unknown request %u\n", header.request_id);
+                    continue;
+                }
+                histogram_record(histogram, chrono::duration_cast<chrono::microseconds>(now - entry->second).count());
+                conn.starts.erase(entry);
+                conn.busy--;
+                in_flight--;
+                completed++;
+                last_reply = now;
+            }
+            if (parsed == -1) {
+                fprintf(stderr, "client: run_benchmark: malformed reply from serverM\n");
+                exit(1);
+            }
+            conn.reply.erase(0, offset);
+        }
+    }
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    for (bench_connection &conn : conns) {
+        close(conn.fd);
+    }
+    print_bench_report(histogram, completed, errors, elapsed);
+}
+
+// usage: client [--text]
+//        client [--slot D] [--window T0 T1] [--first K]
+//        client --quorum K [--counts]
+//        client --batch FILE
+//        client --bench (--workload FILE | --users FILE [--group-size K]) [--connections N]
+//               [--requests R | --duration SECONDS] [--rate QPS] [--pipeline P] [--seed S] [--text]
+// --text: use the original text protocol instead of request frames
+// --batch FILE: send every line of FILE as one request of a single batch request and print each reply next to its line
+// --slot D: ask only for the common intervals that last at least D, 0 by default
+// --window T0 T1: ask only for the common intervals inside [T0, T1], clipped to it, the whole time line by default
+// --first K: ask only for the first K of those intervals, 0 (the default) for all of them
+// --quorum K: ask for the times at which at least K (K >= 1) of the users are free instead of all of them
+// --counts: with --quorum, cut the intervals wherever the number of free users changes and report that number
+// --bench: run the load generator instead of the interactive client
+// --workload FILE: replay the queries in FILE, one per line
+// --users FILE: sample queries of K (default 2) distinct usernames from FILE, one username per line
+// --connections N: connections to serverM, 1 by default
+// --requests R: total requests, 10000 by default; --duration SECONDS: send for this long instead
+// --rate QPS: open loop at QPS requests per second over all connections, closed loop by default
+// --pipeline P: requests in flight per connection, 1 by default, only 1 with --text
+// --seed S: seed of the sampler
+int main(int argc, char *argv[]){
+    bool bench = false;
+    const char *batch_file = NULL; // --batch FILE
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bench") == 0) {
+            bench = true;
+        } else if (strcmp(argv[i], "--workload") == 0 && i + 1 < argc) {
+            bench_workload = argv[++i];
+        } else if (strcmp(argv[i], "--users") == 0 && i + 1 < argc) {
+            bench_users = argv[++i];
+        } else if (strcmp(argv[i], "--group-size") == 0 && i + 1 < argc) {
+            bench_group_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+            bench_connections = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--requests") == 0 && i + 1 < argc) {
+            bench_requests = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            bench_duration = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            bench_rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            bench_seed = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--pipeline") == 0 && i + 1 < argc) {
+            bench_pipeline = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--text") == 0) {
+            text_protocol = true;
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch_file = argv[++i];
+        } else if (strcmp(argv[i], "--slot") == 0 && i + 1 < argc) {
+            slot_query = true;
+            slot_options.min_duration = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--window") == 0 && i + 2 < argc) {
+            slot_query = true;
+            slot_options.window_start = atoll(argv[++i]);
+            slot_options.window_end = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--first") == 0 && i + 1 < argc) {
+            slot_query = true;
+            slot_options.limit = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--quorum") == 0 && i + 1 < argc) {
+            quorum = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--counts") == 0) {
+            quorum_counts = true;
+        }
+    }
+    if ((quorum > 0 || quorum_counts) && (slot_query || text_protocol || bench || batch_file != NULL || quorum == 0)) {
+        fprintf(stderr, "client: --quorum K (K >= 1) and --counts are only for framed interactive requests without slots\n");
+        exit(1);
+    }
+    if (slot_query && (text_protocol || bench || batch_file != NULL)) {
+        fprintf(stderr, "client: --slot, --window and --first are only for framed interactive requests\n");
+        exit(1);
+    }
+    if (batch_file != NULL) {
+        if (text_protocol) {
+            fprintf(stderr, "client: the text protocol has no batch requests, --batch needs the framed protocol\n");
+            exit(1);
+        }
+        run_batch(batch_file);
+        return 0;
+    }
+    if (bench) {
+        if ((bench_workload == NULL) == (bench_users == NULL)) {
+            fprintf(stderr, "client: --bench needs either --workload FILE or --users FILE\n");
+            exit(1);
+        }
+        if (bench_connections < 1 || bench_group_size < 1 || bench_pipeline < 1) {
+            fprintf(stderr, "client: --connections, --group-size and --pipeline must be at least 1\n");
+            exit(1);
+        }
+        if (text_protocol && bench_pipeline > 1) {
+            fprintf(stderr, "client: the text protocol has no request ids, --pipeline needs the framed protocol\n");
+            exit(1);
+        }
+        run_benchmark();
+        return 0;
+    }
     create_socket();
     cout << "Client is up and running." << endl;
     string usernames;
     while(1){
         cout << "Please enter the usernames to check schedule availability:" << endl;
-        getline(cin, usernames);
+        if (!getline(cin, usernames)) { // end of input
+            break;
+        }
         if (!check_username(usernames)){
             continue;
         }
-        insert_to_username_record(usernames);
         send_username(usernames);
+        if (!text_protocol) {
+            receive_framed_reply(); // one frame holds the whole reply
+            cout << "-----Start a new request-----" << endl;
+            continue;
+        }
+        insert_to_username_record(usernames);
         receive_from_serverM();
         if (match_username_record(buf)){
             cout << "-----Start a new request-----" << endl;
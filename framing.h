@@ -0,0 +1,90 @@
+/**
+ * framing.h - framed TCP protocol between the client and serverM
+ *             every message is a frame_header followed by length bytes of text payload:
+ *             request: client -> serverM, payload "username1 username2 username3 ...",
+ *                      request_id chosen by the client
+ *             reply:   serverM -> client, payload the reply lines separated by '\n'
+ *                      ("<usernames> do not exist." and/or "Time intervals ..."), request_id of the request
+ *             slot request: client -> serverM, payload "min_duration window_start window_end limit username1 username2 ...",
+ *                           answered with a reply frame like a request, but only with the first limit (0 for all)
+ *                           common intervals inside the window that last at least min_duration
+ *             quorum request: client -> serverM, payload "quorum counts username1 username2 ...", answered with
+ *                             a reply frame with the intervals in which at least quorum of the users are free,
+ *                             cut wherever the number of free users changes and tagged with it if counts is 1
+ *             batch request: client -> serverM, payload one request per line, "username1 username2 ...\nusername3 ..."
+ *             batch reply:   serverM -> client, payload one line per request of the batch, in the same order,
+ *                            the reply lines of a request joined by spaces; sent once every request is answered
+ *             a client may send many requests without waiting for the replies, which carry the request id
+ *             and may come back in any order
+ *             the first byte of a frame is FRAME_MAGIC, which never starts a request of the old text
+ *             protocol (small letters only), so serverM tells the two apart by the first byte of a connection
+*/
+
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <string>
+#include <string_view>
+
+#define FRAME_MAGIC 0xFA // first byte of every frame
+#define FRAME_REQUEST 'Q' // client -> serverM
+#define FRAME_REPLY 'A' // serverM -> client
+#define FRAME_SLOT_REQUEST 'S' // client -> serverM, a request for the first slots of at least a given length
+#define FRAME_QUORUM_REQUEST 'M' // client -> serverM, a request for the times at least some of the users are free
+#define FRAME_BATCH_REQUEST 'B' // client -> serverM, many requests in one frame
+#define FRAME_BATCH_REPLY 'b' // serverM -> client, the replies of a batch request
+#define FRAME_MAX_PAYLOAD (1024 * 1024) // longer frames are a protocol error
+
+/**
+ * fixed header at the start of every frame, multi-byte fields are in network byte order
+*/
+struct frame_header {
+    uint8_t magic; // FRAME_MAGIC
+    uint8_t type; // FRAME_REQUEST, FRAME_REPLY, FRAME_SLOT_REQUEST, FRAME_QUORUM_REQUEST, FRAME_BATCH_REQUEST or FRAME_BATCH_REPLY
+    uint16_t reserved; // 0
+    uint32_t request_id; // chosen by the client, echoed in the reply
+    uint32_t length; // payload bytes after the header
+};
+
+#define FRAME_HEADER_LEN ((int)sizeof(struct frame_header))
+
+// append a frame to out: header followed by the payload, out keeps its capacity for the next frame
+inline void append_frame(std::string &out, char type, uint32_t request_id, std::string_view payload){
+    struct frame_header header;
+    header.magic = FRAME_MAGIC;
+    header.type = (uint8_t)type;
+    header.reserved = 0;
+    header.request_id = htonl(request_id);
+    header.length = htonl(payload.size());
+
+    out.append((const char *)&header, FRAME_HEADER_LEN);
+    out.append(payload.data(), payload.size());
+}
+
+// build a frame: header followed by the payload
+inline std::string make_frame(char type, uint32_t request_id, const std::string &payload){
+    std::string frame;
+    append_frame(frame, type, request_id, payload);
+    return frame;
+}
+
+// parse the frame at the start of data (converted to host byte order), the payload follows the header
+// return 1 if the whole frame is there (it is FRAME_HEADER_LEN + header->length bytes long),
+// 0 if more bytes are needed, -1 if the bytes are not a valid frame
+inline int parse_frame(const char *data, size_t len, struct frame_header *header){
+    if (len < (size_t)FRAME_HEADER_LEN) {
+        return (len > 0 && (uint8_t)data[0] != FRAME_MAGIC) ? -1 : 0;
+    }
+    memcpy(header, data, FRAME_HEADER_LEN);
+    header->request_id = ntohl(header->request_id);
+    header->length = ntohl(header->length);
+    if (header->magic != FRAME_MAGIC || header->length > FRAME_MAX_PAYLOAD) {
+        return -1;
+    }
+    return len >= FRAME_HEADER_LEN + (size_t)header->length ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,87 @@
+/**
+ * histogram.h - log-linear latency histogram
+ *               values below HISTOGRAM_SUB_BUCKETS are counted exactly, above that every power of two
+ *               is split into HISTOGRAM_SUB_BUCKETS equal buckets, so a bucket is never wider than
+ *               1/16 of the values in it and percentiles are within about 6% of the exact value
+*/
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define HISTOGRAM_SUB_BUCKETS 16 // buckets per power of two
+#define HISTOGRAM_SUB_BITS 4 // log2(HISTOGRAM_SUB_BUCKETS)
+#define HISTOGRAM_BUCKETS (64 * HISTOGRAM_SUB_BUCKETS) // enough for any uint64_t value
+
+struct latency_histogram {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total; // number of recorded values
+    uint64_t sum; // sum of the recorded values, for the mean
+    uint64_t max; // largest recorded value
+};
+
+inline void histogram_clear(latency_histogram &histogram){
+    memset(&histogram, 0, sizeof histogram);
+}
+
+// bucket of a value, ie. 0..15 map to themselves, 16..31 to 16..31, 32 and 33 to 32, 34 and 35 to 33
+inline int histogram_bucket(uint64_t value){
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - HISTOGRAM_SUB_BITS;
+    return (msb - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + ((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+// smallest value counted in a bucket
+inline uint64_t histogram_bucket_low(int bucket){
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    return (uint64_t)(HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) << shift;
+}
+
+// largest value counted in a bucket
+inline uint64_t histogram_bucket_high(int bucket){
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    return histogram_bucket_low(bucket) + ((uint64_t)1 << shift) - 1;
+}
+
+inline void histogram_record(latency_histogram &histogram, uint64_t value){
+    histogram.counts[histogram_bucket(value)]++;
+    histogram.total++;
+    histogram.sum += value;
+    if (value > histogram.max) {
+        histogram.max = value;
+    }
+}
+
+// value below which a fraction q (0..1) of the recorded values fall, reported as the upper edge
+// of the bucket that contains it; 0 if nothing was recorded
+inline uint64_t histogram_percentile(const latency_histogram &histogram, double q){
+    if (histogram.total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * histogram.total + 0.999999);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        seen += histogram.counts[bucket];
+        if (seen >= rank) {
+            uint64_t high = histogram_bucket_high(bucket);
+            return high < histogram.max ? high : histogram.max;
+        }
+    }
+    return histogram.max;
+}
+
+#endif
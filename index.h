@@ -0,0 +1,180 @@
+/**
+ * index.h - the read-only availability index of a backend server
+ *           everything a query needs is built into one availability_index and never modified
+ *           afterwards, so a reload can build a new index in the background and publish it with
+ *           one atomic shared_ptr store while queries keep reading the old one
+ *           the index is the sections of snapshot.h: a user table sorted by name (looked up by binary
+ *           search), the interval pool, the names and the bitmaps; they are either built from the text
+ *           database or point straight into a mapped snapshot of it
+*/
+
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <numeric>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "interval.h"
+#include "bitmap.h"
+#include "loader.h"
+#include "snapshot.h"
+
+/**
+ * the usernames of an index in name order, as views into its names section
+*/
+struct username_iterator {
+    const snapshot_user *user;
+    const char *names;
+    std::string_view operator*() const { return std::string_view(names + user->name_offset, user->name_len); }
+    username_iterator &operator++(){ user++; return *this; }
+    bool operator!=(const username_iterator &other) const { return user != other.user; }
+};
+
+struct username_range {
+    username_iterator first, last;
+    username_iterator begin() const { return first; }
+    username_iterator end() const { return last; }
+};
+
+struct availability_index : snapshot_sections {
+    uint32_t version = 0; // data version, registered with serverM and bumped by every reload
+    // the sections of an index parsed from the text database, empty for a mapped snapshot
+    std::vector<snapshot_user> owned_users;
+    std::vector<interval> owned_intervals;
+    std::string owned_names;
+    std::vector<uint64_t> owned_bitmaps;
+
+    availability_index() {}
+    availability_index(const availability_index &) = delete; // the sections point into the owned storage
+    availability_index &operator=(const availability_index &) = delete;
+    ~availability_index(){ unmap_snapshot(*this); }
+
+    std::string_view username(const snapshot_user &user) const { return std::string_view(names + user.name_offset, user.name_len); }
+    username_range usernames() const { return username_range{{users, names}, {users + user_count, names}}; }
+
+    // the user_record of username, NULL if the index does not have it
+    const user_record *find(std::string_view name) const {
+        const snapshot_user *last = users + user_count;
+        const snapshot_user *user = std::lower_bound(users, last, name, [this](const snapshot_user &entry, std::string_view key){
+            return username(entry) < key;
+        });
+        return user != last && username(*user) == name ? &user->record : NULL;
+    }
+};
+
+// turn the users load_database() parsed (file order, offsets into pool) into the sorted user table of
+// index; a username listed twice keeps its last line, as the map the index used to be did
+inline void build_user_table(availability_index &index, std::vector<interval> &pool,
+                             const std::vector<std::pair<std::string, user_record>> &users){
+    std::vector<uint32_t> order(users.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&users](uint32_t a, uint32_t b){ return users[a].first < users[b].first; });
+    index.owned_users.reserve(users.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        if (i + 1 < order.size() && users[order[i]].first == users[order[i + 1]].first) {
+            continue; // a later line of the same user follows
+        }
+        const std::pair<std::string, user_record> &user = users[order[i]];
+        snapshot_user entry;
+        entry.name_offset = index.owned_names.size();
+        entry.name_len = user.first.size();
+        entry.record = user.second;
+        entry.record.bitmap_offset = 0;
+        index.owned_users.push_back(entry);
+        index.owned_names += user.first;
+        index.max_user_intervals = std::max(index.max_user_intervals, user.second.count);
+    }
+    index.owned_intervals.swap(pool);
+    index.users = index.owned_users.data();
+    index.user_count = index.owned_users.size();
+    index.intervals = index.owned_intervals.data();
+    index.interval_count = index.owned_intervals.size();
+    index.names = index.owned_names.data();
+    index.names_bytes = index.owned_names.size();
+}
+
+// pick the bitmap width from the largest time in the database and build every user's bitmap
+// if the domain is too wide for a bitmap, leave bitmap_words at 0 so queries merge intervals
+inline void build_bitmaps(availability_index &index){
+    timestamp_t max_time = 0;
+    for (const interval &iv : index.owned_intervals) {
+        if (iv.end > max_time) {
+            max_time = iv.end;
+        }
+    }
+    index.bitmap_words = choose_bitmap_words(max_time);
+    if (index.bitmap_words == 0) {
+        return;
+    }
+    index.owned_bitmaps.assign(index.owned_users.size() * index.bitmap_words, 0);
+    uint32_t next_offset = 0;
+    for (snapshot_user &user : index.owned_users) {
+        user.record.bitmap_offset = next_offset;
+        intervals_to_bitmap(&index.owned_intervals[user.record.offset], user.record.count,
+                            &index.owned_bitmaps[next_offset], index.bitmap_words);
+        next_offset += index.bitmap_words;
+    }
+    index.bitmaps = index.owned_bitmaps.data();
+}
+
+// build index from database_file
+// if snapshot_file was built from the current database_file the index is mapped from it as it is,
+// otherwise the file is parsed by loader_threads workers (see loader.h) and, when use_snapshot is set,
+// a fresh snapshot is written for the next start
+// a user may have at most max_intervals time intervals (0 for no limit), a snapshot with more is
+// not used so the text parser reports the error
+// the bitmaps are always built and written, use_bitmap only decides whether queries use them
+// return false and set error if the database file is missing or invalid
+inline bool build_index(const char *database_file, const char *snapshot_file, bool use_snapshot, unsigned loader_threads,
+                        unsigned max_intervals, bool use_bitmap, availability_index &index, std::string &error){
+    snapshot_sections mapped;
+    bool from_snapshot = use_snapshot && load_snapshot(snapshot_file, database_file, mapped);
+    if (from_snapshot && max_intervals > 0 && mapped.max_user_intervals > max_intervals) { // written by a backend started with a higher limit
+        unmap_snapshot(mapped);
+        from_snapshot = false;
+    }
+    if (from_snapshot) {
+        static_cast<snapshot_sections &>(index) = mapped;
+    } else {
+        std::vector<interval> pool;
+        std::vector<std::pair<std::string, user_record>> users;
+        if (!load_database(database_file, loader_threads, max_intervals, pool, users, error)) {
+            return false;
+        }
+        build_user_table(index, pool, users);
+        build_bitmaps(index);
+        if (use_snapshot && !write_snapshot(snapshot_file, database_file, index)) {
+            fprintf(stderr, "build_index: could not write %s\n", snapshot_file);
+        }
+    }
+    if (!use_bitmap) {
+        index.bitmap_words = 0;
+    }
+    return true;
+}
+
+// append "+username" for every user of now that is not in before
+// and "-username" for every user of before that is not in now
+inline void diff_usernames(const availability_index &before, const availability_index &now, std::vector<std::string> &out){
+    const snapshot_user *old_it = before.users, *old_end = before.users + before.user_count;
+    const snapshot_user *new_it = now.users, *new_end = now.users + now.user_count;
+    while (old_it != old_end || new_it != new_end) {
+        if (new_it == new_end || (old_it != old_end && before.username(*old_it) < now.username(*new_it))) {
+            out.push_back("-" + std::string(before.username(*old_it)));
+            ++old_it;
+        } else if (old_it == old_end || now.username(*new_it) < before.username(*old_it)) {
+            out.push_back("+" + std::string(now.username(*new_it)));
+            ++new_it;
+        } else {
+            ++old_it;
+            ++new_it;
+        }
+    }
+}
+
+#endif
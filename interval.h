@@ -0,0 +1,336 @@
+/**
+ * interval.h - packed time interval representation shared by the backend servers
+ *              a user's availability is a contiguous, sorted array of (start, end) integer pairs,
+ *              the "[start, end]" text form is only produced at the wire edge
+ *              times are 64-bit, so a domain can be minutes over years, and a user may have any
+ *              number of intervals
+*/
+
+#ifndef INTERVAL_H
+#define INTERVAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+typedef int64_t timestamp_t; // one time value of an interval
+
+struct interval {
+    timestamp_t start;
+    timestamp_t end;
+};
+
+// where a user's intervals live inside the shared interval pool
+struct user_record {
+    uint32_t offset; // index of the first interval in the pool
+    uint32_t count; // number of intervals
+    uint32_t bitmap_offset; // index of the user's first word in the bitmap pool, bitmap mode only
+};
+
+// append "[start, end]" to out
+inline void format_interval(const interval &iv, std::string &out){
+    out += '[';
+    out += std::to_string(iv.start);
+    out += ", ";
+    out += std::to_string(iv.end);
+    out += ']';
+}
+
+// format intervals as "[t1_start, t1_end] [t2_start, t2_end] ...", the payload format of a result datagram
+inline std::string format_interval_list(const interval *intervals, size_t count, const char *separator = " "){
+    std::string out;
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0) {
+            out += separator;
+        }
+        format_interval(intervals[i], out);
+    }
+    return out;
+}
+
+#define GALLOP_RATIO 8 // gallop through the longer list once it is this many times longer than the other
+
+// index of the first interval at or after from that ends after t: exponential search from from,
+// then binary search inside the last step, so skipping n intervals costs O(log n)
+inline size_t gallop_past(const interval *a, size_t from, size_t len, timestamp_t t){
+    size_t low = from, high = from, step = 1;
+    while (high < len && a[high].end <= t) {
+        low = high + 1;
+        high += step;
+        step *= 2;
+    }
+    if (high > len) {
+        high = len;
+    }
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (a[mid].end <= t) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// intersect_intervals() for a short a and a much longer b: every interval of a gallops through b
+// to the first interval that can overlap it instead of stepping through b one interval at a time
+inline void intersect_intervals_galloping(const interval *a, size_t a_len, const interval *b, size_t b_len, std::vector<interval> &out){
+    size_t j = 0;
+    for (size_t i = 0; i < a_len && j < b_len; i++) {
+        j = gallop_past(b, j, b_len, a[i].start);
+        for (size_t k = j; k < b_len && b[k].start < a[i].end; k++) {
+            timestamp_t max_start = a[i].start > b[k].start ? a[i].start : b[k].start;
+            timestamp_t min_end = a[i].end < b[k].end ? a[i].end : b[k].end;
+            if (max_start < min_end) {
+                out.push_back(interval{max_start, min_end});
+            }
+        }
+    }
+}
+
+// intersect two sorted interval arrays and append the common intervals to out
+// ie. a = [[1, 3], [5, 10]], b = [[0, 4], [8, 11]] gives [[1, 3], [8, 10]]
+// arrays of similar length are merged, if one is GALLOP_RATIO times longer it is galloped through
+inline void intersect_intervals(const interval *a, size_t a_len, const interval *b, size_t b_len, std::vector<interval> &out){
+    if (a_len * GALLOP_RATIO < b_len) {
+        intersect_intervals_galloping(a, a_len, b, b_len, out);
+        return;
+    }
+    if (b_len * GALLOP_RATIO < a_len) {
+        intersect_intervals_galloping(b, b_len, a, a_len, out);
+        return;
+    }
+    size_t i = 0, j = 0;
+    while (i < a_len && j < b_len) {
+        timestamp_t max_start = a[i].start > b[j].start ? a[i].start : b[j].start;
+        timestamp_t min_end = a[i].end < b[j].end ? a[i].end : b[j].end;
+        if (max_start < min_end) {
+            out.push_back(interval{max_start, min_end});
+        }
+        if (a[i].end < b[j].end) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+}
+
+// one user's sorted intervals, an input of intersect_k_way()
+struct interval_list {
+    const interval *intervals;
+    size_t count;
+};
+
+// a point of the sweep in intersect_k_way(): the start or end of interval index of list
+struct sweep_event {
+    timestamp_t time;
+    bool is_start;
+    uint32_t list;
+    uint32_t index;
+};
+
+// heap order of the sweep: earliest first, and an end before a start at the same time, so intervals
+// that only touch ([1, 3] and [3, 5]) do not overlap, like in intersect_intervals()
+inline bool sweep_event_after(const sweep_event &a, const sweep_event &b){
+    return a.time != b.time ? a.time > b.time : a.is_start > b.is_start;
+}
+
+// index of the first interval at or after from that is not a single point, those never overlap anything
+inline size_t next_sweep_interval(const interval_list &list, size_t from){
+    while (from < list.count && list.intervals[from].start == list.intervals[from].end) {
+        from++;
+    }
+    return from;
+}
+
+// intersect k sorted interval arrays in one pass and append the common intervals to out:
+// the next start or end of every list waits in a min-heap (heap is scratch space, reused between calls),
+// the events are taken in time order while counting how many users are free, and every stretch in which
+// all k are free is a common interval; nothing is built between the first list and the last
+// the sweep ends as soon as one list has no interval left
+inline void intersect_k_way(const interval_list *lists, size_t k, std::vector<sweep_event> &heap, std::vector<interval> &out){
+    heap.clear();
+    for (size_t i = 0; i < k; i++) {
+        size_t first = next_sweep_interval(lists[i], 0);
+        if (first == lists[i].count) { // never free
+            return;
+        }
+        heap.push_back(sweep_event{lists[i].intervals[first].start, true, (uint32_t)i, (uint32_t)first});
+    }
+    std::make_heap(heap.begin(), heap.end(), sweep_event_after);
+    size_t free_users = 0;
+    timestamp_t common_start = 0;
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), sweep_event_after);
+        sweep_event event = heap.back();
+        const interval_list &list = lists[event.list];
+        if (event.is_start) {
+            if (++free_users == k) {
+                common_start = event.time;
+            }
+            heap.back() = sweep_event{list.intervals[event.index].end, false, event.list, event.index};
+        } else {
+            if (free_users-- == k && common_start < event.time) {
+                out.push_back(interval{common_start, event.time});
+            }
+            size_t next = next_sweep_interval(list, event.index + 1);
+            if (next == list.count) { // this user is never free again, so neither is everyone
+                return;
+            }
+            heap.back() = sweep_event{list.intervals[next].start, true, event.list, (uint32_t)next};
+        }
+        std::push_heap(heap.begin(), heap.end(), sweep_event_after);
+    }
+}
+
+// a change in the number of free users at time: +n where n users become free, -n where n stop being free
+struct coverage_step {
+    timestamp_t time;
+    int32_t delta;
+};
+
+// add delta at time to the end of a coverage step list sorted by time, steps at the same time are
+// added up and dropped once they cancel out
+inline void add_coverage_step(std::vector<coverage_step> &steps, timestamp_t time, int32_t delta){
+    if (!steps.empty() && steps.back().time == time) {
+        steps.back().delta += delta;
+        if (steps.back().delta == 0) {
+            steps.pop_back();
+        }
+    } else {
+        steps.push_back(coverage_step{time, delta});
+    }
+}
+
+// append the coverage steps of k sorted interval lists to out: every interval counts +1 at its start
+// and -1 at its end, so intervals that only touch ([1, 3] and [3, 5]) are never counted together;
+// the starts and ends are merged in time order with the min-heap of intersect_k_way()
+inline void coverage_steps(const interval_list *lists, size_t k, std::vector<sweep_event> &heap, std::vector<coverage_step> &out){
+    heap.clear();
+    for (size_t i = 0; i < k; i++) {
+        if (lists[i].count > 0) {
+            heap.push_back(sweep_event{lists[i].intervals[0].start, true, (uint32_t)i, 0});
+        }
+    }
+    std::make_heap(heap.begin(), heap.end(), sweep_event_after);
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), sweep_event_after);
+        sweep_event event = heap.back();
+        const interval_list &list = lists[event.list];
+        add_coverage_step(out, event.time, event.is_start ? 1 : -1);
+        if (event.is_start) {
+            heap.back() = sweep_event{list.intervals[event.index].end, false, event.list, event.index};
+        } else if (event.index + 1 < list.count) {
+            heap.back() = sweep_event{list.intervals[event.index + 1].start, true, event.list, event.index + 1};
+        } else {
+            heap.pop_back();
+            continue;
+        }
+        std::push_heap(heap.begin(), heap.end(), sweep_event_after);
+    }
+}
+
+// walk a coverage step list sorted by time and append every stretch in which at least quorum (>= 1)
+// users are free to out; if counts is not NULL a stretch is also cut wherever the number of free users
+// changes, and that number is appended to counts for every interval
+inline void quorum_intervals(const coverage_step *steps, size_t n, int64_t quorum, std::vector<uint32_t> *counts,
+                             std::vector<interval> &out){
+    int64_t free_users = 0;
+    timestamp_t run_start = 0;
+    for (size_t i = 0; i < n; i++) {
+        int64_t now_free = free_users + steps[i].delta;
+        if (free_users >= quorum && (counts != NULL || now_free < quorum)) {
+            out.push_back(interval{run_start, steps[i].time});
+            if (counts != NULL) {
+                counts->push_back(free_users);
+            }
+        }
+        if (now_free >= quorum && (counts != NULL || free_users < quorum)) {
+            run_start = steps[i].time;
+        }
+        free_users = now_free;
+    }
+}
+
+// what a slot query asks for: the common intervals, clipped to [window_start, window_end],
+// that last at least min_duration, only the first limit of them (0 for all)
+struct slot_filter {
+    timestamp_t min_duration = 0;
+    timestamp_t window_start = 0;
+    timestamp_t window_end = INT64_MAX;
+    uint32_t limit = 0;
+};
+
+// index of the first interval of a sorted array that ends at or after t, by binary search
+inline size_t first_interval_ending_at(const interval *a, size_t len, timestamp_t t){
+    size_t low = 0, high = len;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (a[mid].end < t) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// true if [start, end] is not empty and lasts at least min_duration (>= 0); the length is taken
+// unsigned once start < end, so it cannot overflow however far apart the window puts them
+inline bool slot_long_enough(timestamp_t start, timestamp_t end, timestamp_t min_duration){
+    return start < end && (uint64_t)end - (uint64_t)start >= (uint64_t)min_duration;
+}
+
+// append the parts of a sorted interval array inside the window of filter that last at least
+// min_duration to out, at most limit of them (0 for all); a part the window clips to a point is dropped
+inline void filter_slots(const interval *a, size_t len, const slot_filter &filter, uint32_t limit, std::vector<interval> &out){
+    uint32_t found = 0;
+    for (size_t i = first_interval_ending_at(a, len, filter.window_start); i < len; i++) {
+        if (a[i].start > filter.window_end) { // every later interval starts even later
+            break;
+        }
+        timestamp_t start = a[i].start > filter.window_start ? a[i].start : filter.window_start;
+        timestamp_t end = a[i].end < filter.window_end ? a[i].end : filter.window_end;
+        if (slot_long_enough(start, end, filter.min_duration)) {
+            out.push_back(interval{start, end});
+            if (++found == limit) {
+                break;
+            }
+        }
+    }
+}
+
+// intersect_intervals() for a slot query: both arrays are entered at window_start by binary search,
+// the merge stops at window_end or once limit slots were found (0 for no limit),
+// and only the common intervals clipped to the window that last at least min_duration are appended to out
+inline void intersect_slots(const interval *a, size_t a_len, const interval *b, size_t b_len, const slot_filter &filter,
+                            uint32_t limit, std::vector<interval> &out){
+    size_t i = first_interval_ending_at(a, a_len, filter.window_start);
+    size_t j = first_interval_ending_at(b, b_len, filter.window_start);
+    uint32_t found = 0;
+    while (i < a_len && j < b_len) {
+        timestamp_t max_start = a[i].start > b[j].start ? a[i].start : b[j].start;
+        if (max_start > filter.window_end) { // every later pair starts even later
+            break;
+        }
+        timestamp_t min_end = a[i].end < b[j].end ? a[i].end : b[j].end;
+        timestamp_t start = max_start > filter.window_start ? max_start : filter.window_start;
+        timestamp_t end = min_end < filter.window_end ? min_end : filter.window_end;
+        if (slot_long_enough(start, end, filter.min_duration)) {
+            out.push_back(interval{start, end});
+            if (++found == limit) {
+                break;
+            }
+        }
+        if (a[i].end < b[j].end) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+}
+
+#endif
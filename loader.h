@@ -0,0 +1,263 @@
+/**
+ * loader.h - regex-free parallel loader for the backend database files
+ *            the file is mmapped, split at line boundaries into one range per worker thread,
+ *            and every range is parsed by a hand-written single-pass scanner; the validation rules
+ *            are the ones read_file() always had:
+ *              username: not empty, no space inside, at most 20 characters, small letters only
+ *              intervals: every "[start,end]" (spaces ignored) has start <= end, starts after the
+ *                         previous end, and a user has at most 10 of them (or any other limit the
+ *                         backend is started with, or none); times are 64-bit
+*/
+
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <stdint.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "interval.h"
+
+#define MAX_USERNAME_LEN 20 // longest username accepted in a database file
+#define MAX_INTERVALS_PER_USER 10 // most time intervals accepted for one user by default
+#define MIN_BYTES_PER_LOADER 65536 // smaller files are not worth splitting across threads
+
+// what one worker parsed from its range of the file
+struct loader_range {
+    const char *begin; // first byte of the range, always the start of a line
+    const char *end; // one past the last byte, always the end of a line
+    std::vector<interval> pool; // intervals of the users in this range, back to back
+    std::vector<std::pair<std::string, user_record>> users; // users in file order, offsets into pool
+    std::string error; // first validation error in the range, empty if none
+    unsigned max_intervals = MAX_INTERVALS_PER_USER; // most time intervals of one user, 0 for no limit
+};
+
+// parse one line "username;[[t1_start,t1_end],[t2_start,t2_end]...]" into range
+// return false and set range.error on a validation error
+inline bool parse_database_line(const char *line, const char *line_end, loader_range &range, std::string &time_availability){
+    // Split the line into username and time availability, a line without ';' is all username
+    const char *semicolon = line;
+    while (semicolon < line_end && *semicolon != ';') {
+        semicolon++;
+    }
+    const char *usr_start = line;
+    const char *usr_end = semicolon;
+    const char *availability = semicolon < line_end ? semicolon + 1 : line;
+
+    // trim the spaces around the username
+    while (usr_start < usr_end && *usr_start == ' ') {
+        usr_start++;
+    }
+    while (usr_end > usr_start && usr_end[-1] == ' ') {
+        usr_end--;
+    }
+    if (usr_start == usr_end) {
+        range.error = "Error: username cannot be empty";
+        return false;
+    }
+    bool has_space = false, has_other = false;
+    for (const char *c = usr_start; c < usr_end; c++) {
+        if (*c == ' ') {
+            has_space = true;
+        } else if (*c < 'a' || *c > 'z') {
+            has_other = true;
+        }
+    }
+    if (has_space) {
+        range.error = "Error: username cannot contain space";
+        return false;
+    } else if (usr_end - usr_start > MAX_USERNAME_LEN) {
+        range.error = "Error: username cannot be longer than 20 characters";
+        return false;
+    } else if (has_other) { //username can only contain small letters
+        range.error = "Error: username can only contain small letters";
+        return false;
+    }
+
+    // Remove spaces from the time availability string
+    time_availability.clear();
+    for (const char *c = availability; c < line_end; c++) {
+        if (!isspace((unsigned char)*c)) {
+            time_availability += *c;
+        }
+    }
+
+    // Parse every "[digits,digits]" in the string, anything else is skipped
+    user_record record;
+    record.offset = range.pool.size();
+    record.bitmap_offset = 0;
+    int64_t prev_end_time = -1;
+    unsigned interval_count = 0;
+    const char *c = time_availability.data();
+    const char *end = c + time_availability.size();
+    while (c < end) {
+        if (*c != '[') {
+            c++;
+            continue;
+        }
+        const char *d = c + 1;
+        int64_t values[2];
+        bool matched = true;
+        for (int k = 0; k < 2 && matched; k++) {
+            const char *digits = d;
+            int64_t value = 0;
+            while (d < end && *d >= '0' && *d <= '9') {
+                if (value >= 0 && value <= (INT64_MAX - 9) / 10) {
+                    value = value * 10 + (*d - '0');
+                } else {
+                    value = -1; // too large for a time value
+                }
+                d++;
+            }
+            char expected = (k == 0) ? ',' : ']';
+            if (d == digits || d >= end || *d != expected) {
+                matched = false;
+            } else {
+                values[k] = value;
+                d++;
+            }
+        }
+        if (!matched) {
+            c++;
+            continue;
+        }
+        c = d;
+        // Ensure start_time and end_time fit in a 64-bit time, the scanner marks a larger value with -1
+        if (values[0] < 0 || values[1] < 0) {
+            range.error = "Error: time value does not fit in a 64-bit time";
+            return false;
+        }
+        // Ensure start time is less than end time and previous end time is less than the current start time
+        if (values[0] > values[1] || prev_end_time >= values[0]) {
+            range.error = "Error: start time must be less than end time and previous end time must be less than the current start time";
+            return false;
+        }
+        if (++interval_count > range.max_intervals && range.max_intervals > 0) {
+            range.error = "Error: total time intervals should not be larger than " + std::to_string(range.max_intervals);
+            return false;
+        }
+        range.pool.push_back(interval{(timestamp_t)values[0], (timestamp_t)values[1]});
+        prev_end_time = values[1];
+    }
+    record.count = range.pool.size() - record.offset;
+    range.users.emplace_back(std::string(usr_start, usr_end - usr_start), record);
+    return true;
+}
+
+// parse every line of range, stopping at the first validation error
+inline void parse_database_range(loader_range &range){
+    std::string time_availability; // reused for every line
+    const char *line = range.begin;
+    while (line < range.end) {
+        const char *line_end = line;
+        while (line_end < range.end && *line_end != '\n') {
+            line_end++;
+        }
+        if (!parse_database_line(line, line_end, range, time_availability)) {
+            return;
+        }
+        line = line_end + 1;
+    }
+}
+
+// mmap filename and parse it with up to threads workers (0 picks one per core),
+// accepting at most max_intervals time intervals per user (0 for no limit)
+// on success the users are appended in file order to users, with offsets into pool
+// return false and set error if the file cannot be opened or a line is invalid
+inline bool load_database(const char *filename, unsigned threads, unsigned max_intervals, std::vector<interval> &pool,
+                          std::vector<std::pair<std::string, user_record>> &users, std::string &error){
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        error = std::string("Error: cannot open file ") + filename;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        error = std::string("Error: cannot open file ") + filename;
+        return false;
+    }
+    size_t size = st.st_size;
+    if (size == 0) { // nothing to map
+        close(fd);
+        return true;
+    }
+    const char *data = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        error = std::string("Error: cannot open file ") + filename;
+        return false;
+    }
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    if (threads == 0 || size < (size_t)MIN_BYTES_PER_LOADER * 2) {
+        threads = 1;
+    } else if (threads > size / MIN_BYTES_PER_LOADER) {
+        threads = size / MIN_BYTES_PER_LOADER;
+    }
+
+    // split the file into ranges that end on a line boundary
+    std::vector<loader_range> ranges(threads);
+    const char *file_end = data + size;
+    const char *range_begin = data;
+    for (unsigned i = 0; i < threads; i++) {
+        const char *range_end = (i == threads - 1) ? file_end : data + size / threads * (i + 1);
+        if (range_end < range_begin) {
+            range_end = range_begin;
+        }
+        while (range_end < file_end && range_end > range_begin && range_end[-1] != '\n') {
+            range_end++;
+        }
+        ranges[i].begin = range_begin;
+        ranges[i].end = range_end;
+        ranges[i].max_intervals = max_intervals;
+        range_begin = range_end;
+    }
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads; i++) {
+        workers.emplace_back(parse_database_range, std::ref(ranges[i]));
+    }
+    parse_database_range(ranges[0]);
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    munmap((void *)data, size);
+
+    // the first error in file order wins, every range before it parsed cleanly
+    for (loader_range &range : ranges) {
+        if (!range.error.empty()) {
+            error = range.error;
+            return false;
+        }
+    }
+
+    // stitch the ranges together in file order
+    size_t total_users = users.size(), total_intervals = pool.size();
+    for (loader_range &range : ranges) {
+        total_users += range.users.size();
+        total_intervals += range.pool.size();
+    }
+    users.reserve(total_users);
+    pool.reserve(total_intervals);
+    for (loader_range &range : ranges) {
+        uint32_t base = pool.size();
+        pool.insert(pool.end(), range.pool.begin(), range.pool.end());
+        for (auto &user : range.users) {
+            user.second.offset += base;
+            users.push_back(std::move(user));
+        }
+    }
+    return true;
+}
+
+#endif
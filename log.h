@@ -0,0 +1,326 @@
+/**
+ * log.h - asynchronous logging, request handling never waits for a terminal or a pipe
+ *         a log line is formatted straight into a slot of a bounded lock-free queue (Vyukov's bounded
+ *         MPMC ring: a thread claims a slot with one compare-and-swap on the enqueue position and
+ *         publishes it by storing the slot's sequence number) and a background thread writes the
+ *         queued lines out in large write() calls
+ *         a line below the level threshold is not even formatted; a line that finds the queue full is
+ *         dropped and counted instead of waiting (log_dropped_lines()), a line longer than
+ *         LOG_LINE_MAX is cut off with "..."
+ *         the drain thread polls every LOG_POLL_MS while lines come in and only goes to sleep on a futex
+ *         after LOG_IDLE_POLLS empty polls, so a busy process never makes a system call to wake it
+ *         before log_start() (and in programs that never call it) every line is written synchronously
+*/
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <atomic>
+#include <string>
+#include <thread>
+
+#define LOG_QUEUE_SIZE 1024 // queued lines, a power of two
+#define LOG_LINE_MAX 1000 // bytes of one line, longer lines are cut off
+#define LOG_WRITE_BUFFER 65536 // bytes the drain thread collects before a write()
+#define LOG_POLL_MS 1 // drain thread poll interval while lines come in
+#define LOG_IDLE_POLLS 100 // empty polls before the drain thread sleeps until it is woken
+
+enum log_level {
+    LEVEL_ERROR, // to stderr
+    LEVEL_WARNING, // to stderr
+    LEVEL_INFO, // to stdout, the on screen messages
+    LEVEL_DEBUG // to stdout
+};
+
+/**
+ * one queued line, sequence is the position it was claimed for + 1 once it is complete and
+ * the position + LOG_QUEUE_SIZE once the drain thread is done with it
+*/
+struct log_slot {
+    std::atomic<uint64_t> sequence{0};
+    int level = LEVEL_INFO;
+    uint32_t length = 0;
+    char text[LOG_LINE_MAX];
+};
+
+inline log_slot log_queue[LOG_QUEUE_SIZE];
+inline std::atomic<uint64_t> log_enqueue_position(0);
+inline std::atomic<uint64_t> log_dequeue_position(0); // written by the drain thread only
+inline std::atomic<int> log_threshold(LEVEL_INFO); // lines above this level are skipped
+inline std::atomic<bool> log_started(false);
+inline std::atomic<bool> log_stopping(false);
+inline std::atomic<uint32_t> log_sleeping(0); // 1 while the drain thread waits on the futex
+inline std::atomic<uint64_t> log_dropped(0);
+inline std::thread log_thread;
+
+// true if lines of level are written at all
+inline bool log_enabled(int level){
+    return level <= log_threshold.load(std::memory_order_relaxed);
+}
+
+// "error", "warning", "info" or "debug" -> its level, -1 for anything else
+inline int log_parse_level(const char *name){
+    const char *names[] = {"error", "warning", "info", "debug"};
+    for (int level = LEVEL_ERROR; level <= LEVEL_DEBUG; level++) {
+        if (strcmp(name, names[level]) == 0) {
+            return level;
+        }
+    }
+    return -1;
+}
+
+// lines dropped so far because the queue was full
+inline uint64_t log_dropped_lines(){
+    return log_dropped.load(std::memory_order_relaxed);
+}
+
+// write all of data to fd, a log line is lost rather than retried forever on a broken pipe
+inline void log_write(int fd, const char *data, size_t length){
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        data += n;
+        length -= n;
+    }
+}
+
+// claim the slot of the next line and set *position to its position, NULL if the queue is full
+inline log_slot *log_claim(uint64_t *position){
+    uint64_t pos = log_enqueue_position.load(std::memory_order_relaxed);
+    while (true) {
+        log_slot &slot = log_queue[pos % LOG_QUEUE_SIZE];
+        int64_t diff = (int64_t)slot.sequence.load(std::memory_order_acquire) - (int64_t)pos;
+        if (diff == 0) {
+            if (log_enqueue_position.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                *position = pos;
+                return &slot;
+            }
+        } else if (diff < 0) { // the drain thread has not written the line LOG_QUEUE_SIZE lines back yet
+            return NULL;
+        } else { // another thread claimed pos
+            pos = log_enqueue_position.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+// hand a claimed slot to the drain thread and wake it if it sleeps
+inline void log_publish(log_slot *slot, uint64_t position){
+    slot->sequence.store(position + 1, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the fence in log_run()
+    if (log_sleeping.load(std::memory_order_relaxed) == 1 && log_sleeping.exchange(0) == 1) {
+        syscall(SYS_futex, (uint32_t *)&log_sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/**
+ * one log line, formatted piece by piece into its queue slot and queued when it goes out of scope
+ * ie. { log_line line(LEVEL_INFO); line.printf("Found <"); ...; line.chop(2); line.printf(">"); }
+*/
+class log_line {
+public:
+    explicit log_line(int level) : level(level) {
+        if (!log_enabled(level)) {
+            return;
+        }
+        if (!log_started.load(std::memory_order_acquire)) {
+            text = local;
+            return;
+        }
+        slot = log_claim(&position);
+        if (slot == NULL) {
+            log_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        text = slot->text;
+    }
+
+    ~log_line(){
+        if (text == NULL) {
+            return;
+        }
+        if (slot == NULL) { // the logger is not running
+            local[length] = '\n';
+            log_write(level <= LEVEL_WARNING ? 2 : 1, local, length + 1);
+            return;
+        }
+        slot->level = level;
+        slot->length = length;
+        log_publish(slot, position);
+    }
+
+    log_line(const log_line &) = delete;
+    log_line &operator=(const log_line &) = delete;
+
+    // append printf-style text
+    void printf(const char *format, ...) __attribute__((format(printf, 2, 3))) {
+        va_list args;
+        va_start(args, format);
+        vprintf(format, args);
+        va_end(args);
+    }
+
+    void vprintf(const char *format, va_list args){
+        if (text == NULL || truncated) {
+            return;
+        }
+        int n = vsnprintf(text + length, LOG_LINE_MAX - length, format, args);
+        if (n < 0) {
+            return;
+        }
+        if ((size_t)n >= LOG_LINE_MAX - length) {
+            truncate();
+        } else {
+            length += n;
+        }
+    }
+
+    // append a string as it is
+    void append(const std::string &s){
+        if (text == NULL || truncated) {
+            return;
+        }
+        if (s.size() >= LOG_LINE_MAX - length) {
+            truncate();
+            return;
+        }
+        memcpy(text + length, s.data(), s.size());
+        length += s.size();
+    }
+
+    // drop the last n characters, ie. the ", " after the last entry of a list
+    void chop(size_t n){
+        if (text != NULL && !truncated) {
+            length -= n < length ? n : length;
+        }
+    }
+
+private:
+    // end the line with "..." once it does not fit
+    void truncate(){
+        memcpy(text + LOG_LINE_MAX - 4, "...", 3);
+        length = LOG_LINE_MAX - 1; // room for the newline of a synchronous write
+        truncated = true;
+    }
+
+    int level;
+    char *text = NULL; // NULL if the line is skipped or dropped
+    uint32_t length = 0;
+    bool truncated = false;
+    log_slot *slot = NULL;
+    uint64_t position = 0;
+    char local[LOG_LINE_MAX]; // the line while the logger is not running
+};
+
+// log one printf-style line
+inline void log_printf(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+inline void log_printf(int level, const char *format, ...){
+    log_line line(level);
+    va_list args;
+    va_start(args, format);
+    line.vprintf(format, args);
+    va_end(args);
+}
+
+// write out every line queued so far, return false if there was none
+inline bool log_drain(){
+    static char buffer[LOG_WRITE_BUFFER];
+    size_t used = 0;
+    int fd = 1;
+    bool any = false;
+    uint64_t pos = log_dequeue_position.load(std::memory_order_relaxed);
+    while (true) {
+        log_slot &slot = log_queue[pos % LOG_QUEUE_SIZE];
+        if (slot.sequence.load(std::memory_order_acquire) != pos + 1) { // empty, or the next line is still written
+            break;
+        }
+        int line_fd = slot.level <= LEVEL_WARNING ? 2 : 1;
+        if (used > 0 && (line_fd != fd || used + slot.length + 1 > sizeof buffer)) {
+            log_write(fd, buffer, used);
+            used = 0;
+        }
+        fd = line_fd;
+        memcpy(buffer + used, slot.text, slot.length);
+        buffer[used + slot.length] = '\n';
+        used += slot.length + 1;
+        slot.sequence.store(pos + LOG_QUEUE_SIZE, std::memory_order_release);
+        pos++;
+        any = true;
+    }
+    log_dequeue_position.store(pos, std::memory_order_relaxed);
+    if (used > 0) {
+        log_write(fd, buffer, used);
+    }
+    return any;
+}
+
+// body of the drain thread
+inline void log_run(){
+    int idle_polls = 0;
+    while (true) {
+        if (log_drain()) {
+            idle_polls = 0;
+            continue;
+        }
+        if (log_stopping.load(std::memory_order_acquire)) {
+            log_drain(); // the lines published while the last drain finished
+            return;
+        }
+        if (++idle_polls < LOG_IDLE_POLLS) {
+            struct timespec poll = {0, LOG_POLL_MS * 1000000L};
+            nanosleep(&poll, NULL);
+            continue;
+        }
+        log_sleeping.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the fence in log_publish()
+        uint64_t pos = log_dequeue_position.load(std::memory_order_relaxed);
+        if (log_queue[pos % LOG_QUEUE_SIZE].sequence.load(std::memory_order_acquire) != pos + 1
+            && !log_stopping.load(std::memory_order_acquire)) {
+            struct timespec timeout = {1, 0}; // only a safety net, log_publish() wakes the thread
+            syscall(SYS_futex, (uint32_t *)&log_sleeping, FUTEX_WAIT_PRIVATE, 1, &timeout, NULL, 0);
+        }
+        log_sleeping.store(0, std::memory_order_relaxed);
+        idle_polls = 0;
+    }
+}
+
+// write out every queued line and stop the drain thread, registered with atexit() so exit() loses nothing
+inline void log_stop(){
+    if (!log_started.exchange(false)) {
+        return;
+    }
+    log_stopping.store(true, std::memory_order_release);
+    if (log_sleeping.exchange(0) == 1) {
+        syscall(SYS_futex, (uint32_t *)&log_sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+    log_thread.join();
+}
+
+// start the drain thread, lines of a level above threshold are skipped from now on
+inline void log_start(int threshold){
+    log_threshold.store(threshold, std::memory_order_relaxed);
+    for (uint64_t i = 0; i < LOG_QUEUE_SIZE; i++) {
+        log_queue[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    fflush(stdout); // whatever was printed before goes out before the first queued line
+    fflush(stderr);
+    log_thread = std::thread(log_run);
+    log_started.store(true, std::memory_order_release);
+    atexit(log_stop);
+}
+
+#endif
@@ -0,0 +1,248 @@
+/**
+ * metrics.h - counters and latency histograms served in the Prometheus text format
+ *             every thread that records a metric gets its own metrics_block the first time it does,
+ *             and only that thread ever writes to it, with a relaxed load and store instead of a locked
+ *             read-modify-write, so recording never contends with another thread or with a scrape;
+ *             a scrape adds up the blocks of every thread
+ *             a program numbers its counters and histograms itself (at most METRICS_MAX_COUNTERS and
+ *             METRICS_MAX_HISTOGRAMS) and names them in metric_desc tables when it formats them
+ *             histograms count nanoseconds in one bucket per power of two and are exported in seconds,
+ *             with a bucket boundary ("le") at every power of two from 2^METRICS_MIN_BUCKET_BITS up
+ *             the endpoint is plain HTTP on its own local TCP port, every path but /trace (see trace.h)
+ *             gets the metrics
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <string>
+
+#define METRICS_MAX_THREADS 256 // threads beyond this many record into nothing
+#define METRICS_MAX_COUNTERS 32 // counters per program
+#define METRICS_MAX_HISTOGRAMS 8 // histograms per program
+#define METRICS_HISTOGRAM_BUCKETS 65 // bucket b counts the values of b bits, 0 in bucket 0
+#define METRICS_MIN_BUCKET_BITS 10 // smallest exported bucket boundary 2^10 ns, about 1 microsecond
+#define METRICS_MAX_BUCKET_BITS 36 // largest exported bucket boundary 2^36 ns, about 69 seconds
+#define METRICS_MAX_REQUEST 8192 // longer HTTP requests are cut off and answered anyway
+
+/**
+ * the metrics one thread recorded, written by that thread only
+*/
+struct metrics_block {
+    std::atomic<uint64_t> counters[METRICS_MAX_COUNTERS];
+    std::atomic<uint64_t> buckets[METRICS_MAX_HISTOGRAMS][METRICS_HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> sums[METRICS_MAX_HISTOGRAMS]; // sum of the recorded nanoseconds
+};
+
+/**
+ * name, labels ("" or "key=\"value\"") and help text of one counter or histogram,
+ * metrics with the same name and different labels are one Prometheus family
+*/
+struct metric_desc {
+    const char *name;
+    const char *labels;
+    const char *help;
+};
+
+inline std::atomic<metrics_block *> metrics_blocks[METRICS_MAX_THREADS]; // every thread's block, in registration order
+inline std::atomic<int> metrics_thread_count(0); // threads that registered a block
+
+// the calling thread's block, registered on first use
+inline metrics_block *metrics_local(){
+    static thread_local metrics_block *block = NULL;
+    if (block == NULL) {
+        block = new metrics_block(); // value-initialised, every count starts at 0
+        int slot = metrics_thread_count.fetch_add(1);
+        if (slot < METRICS_MAX_THREADS) {
+            metrics_blocks[slot].store(block, std::memory_order_release);
+        }
+    }
+    return block;
+}
+
+// monotonic clock in nanoseconds, the clock of steady_clock
+inline uint64_t metrics_now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// add n to a counter of the calling thread
+inline void metrics_add(int counter, uint64_t n = 1){
+    std::atomic<uint64_t> &value = metrics_local()->counters[counter];
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// record a duration in nanoseconds in a histogram of the calling thread
+inline void metrics_observe(int histogram, uint64_t ns){
+    metrics_block *block = metrics_local();
+    std::atomic<uint64_t> &bucket = block->buckets[histogram][ns == 0 ? 0 : 64 - __builtin_clzll(ns)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic<uint64_t> &sum = block->sums[histogram];
+    sum.store(sum.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+}
+
+// record the time since start_ns (from metrics_now_ns()) in a histogram
+inline void metrics_observe_since(int histogram, uint64_t start_ns){
+    metrics_observe(histogram, metrics_now_ns() - start_ns);
+}
+
+// a counter summed over every thread
+inline uint64_t metrics_counter_total(int counter){
+    uint64_t total = 0;
+    int threads = metrics_thread_count.load(std::memory_order_acquire);
+    for (int i = 0; i < threads && i < METRICS_MAX_THREADS; i++) {
+        metrics_block *block = metrics_blocks[i].load(std::memory_order_acquire);
+        if (block != NULL) {
+            total += block->counters[counter].load(std::memory_order_relaxed);
+        }
+    }
+    return total;
+}
+
+// "name{labels}" with base_labels (ie. shard="A") in front of the metric's own labels, and extra
+// (ie. le="0.5") after them
+inline std::string metrics_series(const char *name, const std::string &base_labels, const char *labels, const std::string &extra = ""){
+    std::string all = base_labels;
+    for (const char *label : {labels, extra.c_str()}) {
+        if (label[0] != '\0') {
+            all += (all.empty() ? "" : ",") + std::string(label);
+        }
+    }
+    return all.empty() ? std::string(name) : std::string(name) + "{" + all + "}";
+}
+
+// "# HELP" and "# TYPE" lines of a family, only before its first series
+inline void metrics_family(const char *name, const char *help, const char *type, const char *previous, std::string &out){
+    if (previous != NULL && strcmp(previous, name) == 0) {
+        return;
+    }
+    out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+}
+
+// append count counters, numbered 0..count-1 as in descs, summed over every thread
+inline void metrics_format_counters(const metric_desc *descs, int count, const std::string &base_labels, std::string &out){
+    for (int i = 0; i < count; i++) {
+        metrics_family(descs[i].name, descs[i].help, "counter", i > 0 ? descs[i - 1].name : NULL, out);
+        out += metrics_series(descs[i].name, base_labels, descs[i].labels) + " " + std::to_string(metrics_counter_total(i)) + "\n";
+    }
+}
+
+// append one value that is not recorded per thread, ie. a gauge read at scrape time or a counter kept elsewhere
+inline void metrics_format_value(const char *name, const char *type, const char *help, double value,
+                                 const std::string &base_labels, std::string &out){
+    char text[32];
+    snprintf(text, sizeof text, "%.17g", value);
+    metrics_family(name, help, type, NULL, out);
+    out += metrics_series(name, base_labels, "") + " " + text + "\n";
+}
+
+// append count histograms, numbered 0..count-1 as in descs, summed over every thread, in seconds
+inline void metrics_format_histograms(const metric_desc *descs, int count, const std::string &base_labels, std::string &out){
+    for (int h = 0; h < count; h++) {
+        uint64_t buckets[METRICS_HISTOGRAM_BUCKETS] = {0};
+        uint64_t sum = 0;
+        int threads = metrics_thread_count.load(std::memory_order_acquire);
+        for (int i = 0; i < threads && i < METRICS_MAX_THREADS; i++) {
+            metrics_block *block = metrics_blocks[i].load(std::memory_order_acquire);
+            if (block == NULL) {
+                continue;
+            }
+            for (int b = 0; b < METRICS_HISTOGRAM_BUCKETS; b++) {
+                buckets[b] += block->buckets[h][b].load(std::memory_order_relaxed);
+            }
+            sum += block->sums[h].load(std::memory_order_relaxed);
+        }
+        metrics_family(descs[h].name, descs[h].help, "histogram", h > 0 ? descs[h - 1].name : NULL, out);
+        // bucket b holds the values in [2^(b-1), 2^b), so the values below 2^k are the buckets up to k
+        uint64_t cumulative = 0, total = 0;
+        for (int b = 0; b < METRICS_HISTOGRAM_BUCKETS; b++) {
+            total += buckets[b];
+            if (b < METRICS_MIN_BUCKET_BITS) {
+                cumulative += buckets[b];
+            }
+        }
+        for (int k = METRICS_MIN_BUCKET_BITS; k <= METRICS_MAX_BUCKET_BITS; k++) {
+            cumulative += buckets[k];
+            char le[48];
+            snprintf(le, sizeof le, "le=\"%.9g\"", (double)(1ULL << k) / 1e9);
+            out += metrics_series((std::string(descs[h].name) + "_bucket").c_str(), base_labels, descs[h].labels, le)
+                   + " " + std::to_string(cumulative) + "\n";
+        }
+        out += metrics_series((std::string(descs[h].name) + "_bucket").c_str(), base_labels, descs[h].labels, "le=\"+Inf\"")
+               + " " + std::to_string(total) + "\n";
+        char seconds[32];
+        snprintf(seconds, sizeof seconds, "%.9f", sum / 1e9);
+        out += metrics_series((std::string(descs[h].name) + "_sum").c_str(), base_labels, descs[h].labels) + " " + seconds + "\n";
+        out += metrics_series((std::string(descs[h].name) + "_count").c_str(), base_labels, descs[h].labels) + " "
+               + std::to_string(total) + "\n";
+    }
+}
+
+// true once input holds a whole HTTP request head (or is too long to wait for the rest)
+inline bool metrics_request_complete(const std::string &input){
+    return input.find("\r\n\r\n") != std::string::npos || input.find("\n\n") != std::string::npos
+           || input.size() >= METRICS_MAX_REQUEST;
+}
+
+// path of the HTTP request in input, "GET /trace HTTP/1.1" -> "/trace", "" if there is none
+inline std::string metrics_request_path(const std::string &input){
+    size_t start = input.find(' ');
+    if (start == std::string::npos) {
+        return "";
+    }
+    size_t end = input.find_first_of(" \r\n?", start + 1);
+    return input.substr(start + 1, end == std::string::npos ? std::string::npos : end - start - 1);
+}
+
+// the HTTP response carrying body in the Prometheus text format
+inline std::string metrics_http_response(const std::string &body){
+    return "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+           + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+}
+
+/**
+ * got from Beej's Guide to Network Programming
+*/
+// create a TCP socket listening on host:port for metrics scrapes, return it or -1
+inline int metrics_listen(const char *host, const char *port){
+    struct addrinfo hints, *servinfo, *p;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    int rv = getaddrinfo(host, port, &hints, &servinfo);
+    if (rv != 0) {
+        fprintf(stderr, "metrics_listen: getaddrinfo: %s\n", gai_strerror(rv));
+        return -1;
+    }
+    int fd = -1;
+    for (p = servinfo; p != NULL; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
+            continue;
+        }
+        int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+        if (bind(fd, p->ai_addr, p->ai_addrlen) == -1 || listen(fd, 16) == -1) {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        break;
+    }
+    freeaddrinfo(servinfo);
+    if (fd == -1) {
+        perror("metrics_listen: bind");
+    }
+    return fd;
+}
+
+#endif
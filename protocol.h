@@ -0,0 +1,318 @@
+/**
+ * protocol.h - datagram format shared by serverM and the backend servers (serverA, serverB)
+ *              every UDP datagram starts with a fixed message_header followed by a text payload:
+ *              username list:  backend -> serverM, payload "username1 username2 username3 ...",
+ *                              split into MTU-sized chunks numbered by seq, the last one flagged MSG_FLAG_LAST_CHUNK
+ *              register nack:  serverM -> backend, payload "seq1 seq2 ...", the username list chunks to send again
+ *              username delta: backend -> serverM, payload "base_version +username1 -username2 ...", the usernames
+ *                              added (+) and removed (-) by a reload since base_version, chunked like the list
+ *              delta ack:      serverM -> backend, no payload, the data version serverM now has for the backend
+ *              query:          serverM -> backend, payload "username1 username2 username3 ..."
+ *              slot query:     serverM -> backend, payload "min_duration window_start window_end limit username1 username2 ...",
+ *                              only the common intervals inside the window that last at least min_duration are wanted,
+ *                              the first limit of them (0 for all); answered with a result like a query
+ *              result:         backend -> serverM, payload "[t1_start, t1_end] [t2_start, t2_end] ...",
+ *                              chunked like the username list when it does not fit in one datagram
+ *              coverage query: serverM -> backend, payload "username1 username2 ...", for a quorum request
+ *              coverage:       backend -> serverM, payload "time:+n time:-n ...", how many of the requested users
+ *                              become free (+) or stop being free (-) at each time, chunked like a result
+ *              batch query:    serverM -> backend, payload one line per query, "request_id username1 username2 ...",
+ *                              lines separated by '\n', a long batch is a train of datagrams numbered by seq
+ *              batch result:   backend -> serverM, payload one line per query of a batch query,
+ *                              "request_id [t1_start, t1_end] [t2_start, t2_end] ...", chunked like the batch query;
+ *                              a line that does not fit in a datagram is sent as a result of its own instead
+ *              a result carries the request_id of the query it answers (a batch line its own request_id), so serverM can have many
+ *              queries outstanding per backend and the replies may arrive in any order;
+ *              username lists, deltas and acks carry the backend's data version in the request_id field instead
+ *              a query of a request serverM traces carries its trace id, which the result echoes, see trace.h;
+ *              every other datagram has trace id 0
+*/
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * message types
+*/
+#define MSG_USERNAME_LIST 'U' // backend -> serverM, the usernames stored at the backend
+#define MSG_QUERY 'Q' // serverM -> backend, the usernames whose time intervals should be intersected
+#define MSG_RESULT 'R' // backend -> serverM, the intersection result for one query
+#define MSG_SLOT_QUERY 'S' // serverM -> backend, a query for the first slots of at least a given length
+#define MSG_REGISTER_NACK 'N' // serverM -> backend, username list chunks that never arrived
+#define MSG_USERNAME_DELTA 'D' // backend -> serverM, usernames added and removed by a reload
+#define MSG_DELTA_ACK 'K' // serverM -> backend, the data version serverM has applied
+#define MSG_COVERAGE_QUERY 'C' // serverM -> backend, the usernames whose free-user counts are wanted
+#define MSG_COVERAGE_RESULT 'c' // backend -> serverM, the free-user count changes for one coverage query
+#define MSG_BATCH_QUERY 'q' // serverM -> backend, many queries, one per line
+#define MSG_BATCH_RESULT 'r' // backend -> serverM, the results of a batch query, one per line
+
+/**
+ * header flags
+*/
+#define MSG_FLAG_LAST_CHUNK 0x01 // this is the last chunk of a multi-datagram message
+#define MSG_FLAG_RESEND_TAIL 0x02 // nack only: also resend every chunk from header seq to the last one
+
+#define MAX_DATAGRAM_LEN 1472 // largest UDP payload that fits in a 1500-byte Ethernet MTU
+#define MAX_NACK_SEQS 128 // most chunk numbers listed in one nack, keeps it below 1 KB
+#define SEND_BATCH 64 // datagrams handed to the kernel per sendmmsg() call
+#define RECV_BATCH 64 // datagrams taken from the kernel per recvmmsg() call
+
+/**
+ * fixed header at the start of every datagram, multi-byte fields are in network byte order
+*/
+struct message_header {
+    uint8_t type; // one of the MSG_* constants
+    uint8_t flags; // MSG_FLAG_* bits
+    uint16_t seq; // chunk number of a multi-datagram message, 0 otherwise
+    uint32_t request_id; // chosen by serverM for a query and echoed in the result, the data version otherwise
+    uint64_t trace_id; // trace id of a traced query and its result, 0 otherwise
+};
+
+#define HEADER_LEN ((int)sizeof(struct message_header))
+#define MAX_PAYLOAD_LEN (MAX_DATAGRAM_LEN - HEADER_LEN)
+
+// append a datagram to out, a std::string or a string with another allocator: header followed by the payload
+template <class String>
+inline void append_datagram(String &out, char type, uint32_t request_id, std::string_view payload, uint16_t seq = 0, uint8_t flags = 0,
+                            uint64_t trace_id = 0){
+    struct message_header header;
+    memset(&header, 0, sizeof header);
+    header.type = (uint8_t)type;
+    header.flags = flags;
+    header.seq = htons(seq);
+    header.request_id = htonl(request_id);
+    header.trace_id = htobe64(trace_id);
+
+    out.append((const char *)&header, HEADER_LEN);
+    out.append(payload.data(), payload.size());
+}
+
+// build a datagram: header followed by the payload
+inline std::string make_datagram(char type, uint32_t request_id, const std::string &payload, uint16_t seq = 0, uint8_t flags = 0,
+                                 uint64_t trace_id = 0){
+    std::string datagram;
+    append_datagram(datagram, type, request_id, payload, seq, flags, trace_id);
+    return datagram;
+}
+
+// split a received datagram into its header (converted to host byte order) and payload
+// return false if the datagram is too short to carry a header
+inline bool parse_datagram(const char *data, int len, struct message_header *header, const char **payload, int *payload_len){
+    if (len < HEADER_LEN) {
+        return false;
+    }
+    memcpy(header, data, HEADER_LEN);
+    header->seq = ntohs(header->seq);
+    header->request_id = ntohl(header->request_id);
+    header->trace_id = be64toh(header->trace_id);
+    *payload = data + HEADER_LEN;
+    *payload_len = len - HEADER_LEN;
+    return true;
+}
+
+// true if data version a is newer than b, versions are compared as serial numbers so they may wrap
+inline bool version_newer(uint32_t a, uint32_t b){
+    return (int32_t)(a - b) > 0;
+}
+
+// split words joined by separator into datagrams of at most MAX_DATAGRAM_LEN bytes, numbered from 0,
+// the last one carries MSG_FLAG_LAST_CHUNK; there is always at least one datagram
+// a non-empty prefix is repeated as the first word of every datagram, every datagram carries trace_id
+template <class Words>
+inline void make_chunked_datagrams(char type, uint32_t request_id, const Words &words, std::vector<std::string> &out,
+                                   const std::string &prefix = std::string(), char separator = ' ', uint64_t trace_id = 0){
+    std::string payload = prefix;
+    uint16_t seq = 0;
+    for (std::string_view word : words) {
+        if (payload.size() > prefix.size() && payload.size() + 1 + word.size() > (size_t)MAX_PAYLOAD_LEN) {
+            out.push_back(make_datagram(type, request_id, payload, seq++, 0, trace_id));
+            payload = prefix;
+        }
+        if (!payload.empty()) {
+            payload += separator;
+        }
+        payload += word;
+    }
+    out.push_back(make_datagram(type, request_id, payload, seq, MSG_FLAG_LAST_CHUNK, trace_id));
+}
+
+/**
+ * batch size statistics of a recvmmsg()/sendmmsg() path, updated by whichever thread uses the path
+*/
+struct batch_counter {
+    std::atomic<uint64_t> calls{0}; // calls that moved at least one datagram
+    std::atomic<uint64_t> datagrams{0}; // datagrams moved by those calls
+    std::atomic<uint64_t> max_batch{0}; // most datagrams moved by one call
+    std::atomic<uint64_t> failed{0}; // datagrams the kernel refused to send, dropped like lost ones
+};
+
+inline void count_batch(batch_counter *counter, int n){
+    if (counter == NULL || n <= 0) {
+        return;
+    }
+    counter->calls.fetch_add(1, std::memory_order_relaxed);
+    counter->datagrams.fetch_add(n, std::memory_order_relaxed);
+    uint64_t max_batch = counter->max_batch.load(std::memory_order_relaxed);
+    while ((uint64_t)n > max_batch && !counter->max_batch.compare_exchange_weak(max_batch, n, std::memory_order_relaxed));
+}
+
+// "<datagrams> datagrams in <calls> calls (<average> per call, at most <max_batch>)"
+inline std::string format_batch_counter(const batch_counter &counter){
+    uint64_t calls = counter.calls.load(std::memory_order_relaxed);
+    uint64_t datagrams = counter.datagrams.load(std::memory_order_relaxed);
+    char average[32];
+    snprintf(average, sizeof average, "%.2f", calls == 0 ? 0.0 : (double)datagrams / calls);
+    return std::to_string(datagrams) + " datagrams in " + std::to_string(calls) + " calls (" + average
+           + " per call, at most " + std::to_string(counter.max_batch.load(std::memory_order_relaxed)) + ")";
+}
+
+/**
+ * receive buffers for up to RECV_BATCH datagrams, filled by receive_datagrams()
+*/
+struct datagram_batch {
+    char bufs[RECV_BATCH][MAX_DATAGRAM_LEN + 1]; // one more byte for a null terminator
+    struct sockaddr_storage addrs[RECV_BATCH]; // sender of every datagram
+    struct iovec iovecs[RECV_BATCH];
+    struct mmsghdr msgs[RECV_BATCH]; // msgs[i].msg_len is the length of datagram i
+    char controls[RECV_BATCH][CMSG_SPACE(sizeof(uint32_t))]; // SO_RXQ_OVFL drop count of every datagram
+    std::atomic<uint32_t> kernel_drops{0}; // datagrams the socket dropped for a full receive buffer, see enable_drop_count()
+};
+
+// ask the kernel to report with every received datagram how many it dropped on sockfd so far,
+// receive_datagrams() keeps the latest count in datagram_batch::kernel_drops
+inline void enable_drop_count(int sockfd){
+    int yes = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RXQ_OVFL, &yes, sizeof yes) == -1) {
+        perror("enable_drop_count: setsockopt SO_RXQ_OVFL");
+    }
+}
+
+// receive up to RECV_BATCH datagrams with one recvmmsg() call and null terminate each of them,
+// flags MSG_DONTWAIT drains a non-blocking socket, MSG_WAITFORONE blocks for the first datagram only
+// return the number of datagrams received, or -1 on error
+inline int receive_datagrams(int sockfd, datagram_batch &batch, int flags, batch_counter *counter = NULL){
+    for (int i = 0; i < RECV_BATCH; i++) {
+        batch.iovecs[i].iov_base = batch.bufs[i];
+        batch.iovecs[i].iov_len = MAX_DATAGRAM_LEN;
+        memset(&batch.msgs[i], 0, sizeof batch.msgs[i]);
+        batch.msgs[i].msg_hdr.msg_iov = &batch.iovecs[i];
+        batch.msgs[i].msg_hdr.msg_iovlen = 1;
+        batch.msgs[i].msg_hdr.msg_name = &batch.addrs[i];
+        batch.msgs[i].msg_hdr.msg_namelen = sizeof batch.addrs[i];
+        batch.msgs[i].msg_hdr.msg_control = batch.controls[i];
+        batch.msgs[i].msg_hdr.msg_controllen = sizeof batch.controls[i];
+    }
+    int n = recvmmsg(sockfd, batch.msgs, RECV_BATCH, flags, NULL);
+    for (int i = 0; i < n; i++) {
+        batch.bufs[i][batch.msgs[i].msg_len] = '\0';
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&batch.msgs[i].msg_hdr);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+            uint32_t drops;
+            memcpy(&drops, CMSG_DATA(cmsg), sizeof drops);
+            batch.kernel_drops.store(drops, std::memory_order_relaxed);
+        }
+    }
+    count_batch(counter, n);
+    return n;
+}
+
+/**
+ * a datagram queued for flush_datagrams(), addr must stay valid until the flush
+*/
+struct outgoing_datagram {
+    std::string data;
+    std::string_view bytes; // sent instead of data if data is empty, the sender keeps them valid until the flush
+    const struct sockaddr *addr;
+    socklen_t addr_len;
+};
+
+// send every queued datagram, SEND_BATCH per sendmmsg() call, and empty the queue
+// a datagram the kernel refuses is dropped like a lost one, the rest are still sent
+// return the number of datagrams sent, or -1 if any was dropped (errno is the last error)
+inline int flush_datagrams(int sockfd, std::vector<outgoing_datagram> &queue, batch_counter *counter = NULL){
+    struct mmsghdr msgs[SEND_BATCH];
+    struct iovec iovecs[SEND_BATCH];
+    size_t done = 0;
+    int sent = 0, saved_errno = 0;
+    while (done < queue.size()) {
+        size_t batch = queue.size() - done < SEND_BATCH ? queue.size() - done : SEND_BATCH;
+        memset(msgs, 0, sizeof(msgs[0]) * batch);
+        for (size_t i = 0; i < batch; i++) {
+            const outgoing_datagram &datagram = queue[done + i];
+            std::string_view bytes = datagram.data.empty() ? datagram.bytes : std::string_view(datagram.data);
+            iovecs[i].iov_base = (void *)bytes.data();
+            iovecs[i].iov_len = bytes.size();
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = (void *)datagram.addr;
+            msgs[i].msg_hdr.msg_namelen = datagram.addr_len;
+        }
+        int n = sendmmsg(sockfd, msgs, batch, 0);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            saved_errno = errno;
+            done++; // skip the datagram that failed
+            if (counter != NULL) {
+                counter->failed.fetch_add(1, std::memory_order_relaxed);
+            }
+            continue;
+        }
+        count_batch(counter, n);
+        sent += n;
+        done += n;
+    }
+    queue.clear();
+    if (saved_errno != 0) {
+        errno = saved_errno;
+        return -1;
+    }
+    return sent;
+}
+
+// send datagrams[indices[i]] for every i to addr, SEND_BATCH datagrams per sendmmsg() call
+// return the number of datagrams sent, or -1 on error
+inline int send_datagrams(int sockfd, const std::vector<std::string> &datagrams, const std::vector<int> &indices,
+                          const struct sockaddr *addr, socklen_t addr_len, batch_counter *counter = NULL){
+    struct mmsghdr msgs[SEND_BATCH];
+    struct iovec iovecs[SEND_BATCH];
+    size_t sent = 0;
+    while (sent < indices.size()) {
+        size_t batch = indices.size() - sent < SEND_BATCH ? indices.size() - sent : SEND_BATCH;
+        memset(msgs, 0, sizeof(msgs[0]) * batch);
+        for (size_t i = 0; i < batch; i++) {
+            const std::string &datagram = datagrams[indices[sent + i]];
+            iovecs[i].iov_base = (void *)datagram.data();
+            iovecs[i].iov_len = datagram.size();
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = (void *)addr;
+            msgs[i].msg_hdr.msg_namelen = addr_len;
+        }
+        int n = sendmmsg(sockfd, msgs, batch, 0);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        count_batch(counter, n);
+        sent += n;
+    }
+    return sent;
+}
+
+#endif
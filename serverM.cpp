@@ -1,6 +1,39 @@
 /**
  * serverM.cpp -- A main server program that will listen to the client via TCP and
- *               send the message to the serverA and serverB via UDP.
+ *               send the message to the backend shards (serverA, serverB, ...) via UDP.
+ *               The shard table can have any number of shards, every request is only
+ *               sent to the shards that store one of its usernames.
+ *               The listening socket, every client socket and the UDP socket are
+ *               owned by one non-blocking, edge-triggered epoll event loop so that
+ *               many client requests can be in flight at the same time.
+ *               Every request has a deadline: queries a shard has not answered are sent
+ *               again after a retransmission timeout that doubles each time, and once the
+ *               deadline passes the client gets whatever part of the result has arrived.
+ *               Complete results are kept in an LRU cache keyed by the sorted set of usernames,
+ *               a repeated request is answered from it as long as the shards it came from
+ *               still have the same data version.
+ *               Backend datagrams are received and sent in batches with recvmmsg()/sendmmsg(),
+ *               SIGUSR1 prints how many datagrams each call moved.
+ *               Clients speak the framed protocol of framing.h, which lets one connection have many
+ *               requests in flight, or the original text protocol (one recv() per request, the reply
+ *               in one or two sends); the first byte of a connection tells which.
+ *               A batch request frame carries many requests: their queries are collected per shard
+ *               and sent as one batch query datagram train per shard, and the client gets one reply
+ *               frame once every request of the batch is answered.
+ *               A slot request only wants the first common intervals of some length inside a window;
+ *               the shards are sent a slot query so they drop everything else before replying.
+ *               A quorum request wants the times at which at least some of the users are free: every shard
+ *               sends how many of its users become free or busy at each time, and the counts are added up.
+ *               Counters and per-stage latency histograms are served in the Prometheus text format on
+ *               METRICS_TCP_PORT, see metrics.h.
+ *               With --trace-sample N one request in N is traced: its queries carry a trace id and the spans
+ *               of its stages are recorded here and at the shards, /trace on the metrics port lists them.
+ *               The on screen messages go through the asynchronous logger of log.h, so a slow terminal
+ *               or pipe never holds up the event loop.
+ *               Every request is built in an arena of its own (arena.h) that is reset once the request is
+ *               answered, so the request path makes no heap allocation once the arenas have warmed up;
+ *               the serverM_counting build (-DCOUNT_ALLOCATIONS) counts every allocation in
+ *               serverm_heap_allocations_total on the metrics port, check.sh uses it to verify that.
 */
 
 #include <stdio.h>
@@ -11,90 +44,451 @@
 #include <netdb.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <algorithm>
 #include <iostream>
 #include <list>
+#include <queue>
+#include <unordered_map>
+#include <vector>
 #include <cstring>
 #include <sstream>
-#include <regex>
+#include <string_view>
+#include <charconv>
 #include <chrono>
-#include <thread>
 #include <fcntl.h>
+#include "protocol.h"
+#include "framing.h"
+#include "interval.h"
+#include "metrics.h"
+#include "trace.h"
+#include "log.h"
+#include "arena.h"
 
 using namespace std;
 /**
  * constants definition
 */
 #define LOCAL_HOST "127.0.0.1" // Local host address
-#define BACKEND_UDP_PORT "23984"    // UDP port number at serverA and serverB end
+#define BACKEND_UDP_PORT "23984"    // UDP port number the backend shards send to
 #define CLIENT_TCP_PORT "24984"    // TCP port number at client end
-#define SERVER_A_UDP_PORT "21984"    // UDP port number at serverA end
-#define SERVER_B_UDP_PORT "22984"    // UDP port number at serverB end
+#define SERVER_A_UDP_PORT "21984"    // UDP port number at serverA end, the default first shard
+#define SERVER_B_UDP_PORT "22984"    // UDP port number at serverB end, the default second shard
 #define MAXBUFLEN 1024 // Max number of bytes we can get at once
 #define BACKLOG 10 // How many pending connections queue will hold
+#define MAXEVENTS 64 // Max number of events returned by one epoll_wait call
+#define REGISTRATION_RETRY_MS 200 // ask for missing username list chunks after this long without a datagram
+#define UDP_RCVBUF_SIZE (8 * 1024 * 1024) // UDP receive buffer, large enough to absorb a registration burst
+#define DEFAULT_RTO_MS 100 // first retransmission timeout of a query, --rto
+#define DEFAULT_DEADLINE_MS 1000 // time a request may take before the client gets a timeout reply, --deadline
+#define DEFAULT_CACHE_SIZE 4096 // results kept in the result cache, --cache-size
+#define CLIENT_PROTOCOL_UNKNOWN 0 // nothing received on the connection yet
+#define CLIENT_PROTOCOL_TEXT 1 // original protocol: every recv() is one request, replies are plain text
+#define CLIENT_PROTOCOL_FRAMED 2 // framing.h: length-prefixed frames carrying a request id
+#define METRICS_TCP_PORT "26984" // TCP port of the metrics endpoint, --metrics-port
+#define ARENA_POOL_SIZE 256 // arenas of finished requests kept for the next requests, the rest are freed
+
+/**
+ * counters, see metrics.h; the names are in serverM_counters
+*/
+enum serverM_counter {
+    COUNT_REQUESTS, COUNT_REPLIES, COUNT_TIMEOUTS, COUNT_CACHE_HITS, COUNT_CACHE_MISSES, COUNT_USERNAMES_NOT_FOUND,
+    COUNT_SHARD_QUERIES, COUNT_RETRANSMISSIONS, COUNT_DROPPED_MALFORMED, COUNT_DROPPED_UNKNOWN_SENDER,
+    COUNT_DROPPED_LATE, COUNT_DROPPED_DUPLICATE, SERVERM_COUNTERS
+};
+
+/**
+ * latency histograms, see metrics.h; the names are in serverM_histograms
+*/
+enum serverM_histogram {
+    STAGE_TCP_RECEIVE, STAGE_FIND_USERNAME, STAGE_FAN_OUT, STAGE_BACKEND, STAGE_MERGE, STAGE_REPLY, STAGE_REQUEST,
+    SERVERM_HISTOGRAMS
+};
+
+/**
+ * the part of a request that is sent to one shard, built in the request's arena like the request_context
+*/
+struct shard_query {
+    explicit shard_query(request_arena *arena)
+        : usernames(arena_allocator<string_view>(arena)), time_interval_list(arena_allocator<string_view>(arena)),
+          result_chunks(arena_allocator<string_view>(arena)), chunk_received(arena_allocator<bool>(arena)),
+          datagram(arena_allocator<char>(arena)), coverage(arena_allocator<coverage_step>(arena)),
+          batch_line(arena_allocator<char>(arena)) {}
+
+    int shard = 0; // index of the shard in shard_table
+    arena_vector<string_view> usernames; // a sub-list of client_username_list stored at the shard, format: username1 username2 username3 …
+    arena_vector<string_view> time_interval_list; // the shard's time interval list, format: [[t1_start, t1_end], [t2_start, t2_end], … ].
+    bool received = false; // flag to indicate whether the shard's time interval list is received
+    arena_vector<string_view> result_chunks; // payloads of the result datagrams that arrived, by seq
+    vector<bool, arena_allocator<bool>> chunk_received; // chunk_received[seq] is true once result chunk seq arrived
+    int total_chunks = -1; // number of result chunks, known once the chunk flagged MSG_FLAG_LAST_CHUNK arrived
+    int received_chunks = 0; // number of distinct result chunks received
+    arena_string datagram; // the query datagram, kept to retransmit it
+    arena_vector<coverage_step> coverage; // quorum request: the shard's free-user count changes, sorted by time
+    arena_string batch_line; // batch member: "request_id username1 username2 ..." line of a batch query, kept to retransmit it
+};
+
+/**
+ * state of one batch request from a client, shared by the request_context of every request in it
+*/
+struct batch_context {
+    int client_fd = -1; // TCP socket of the client, -1 once the client disconnected
+    uint32_t client_request_id = 0; // request id of the batch request frame, echoed in the reply
+    vector<string> replies; // reply of every request of the batch, in the client's order
+    size_t remaining = 0; // requests of the batch that have not been answered yet
+};
+
+/**
+ * per-request state
+ * every client request owns one request_context from the moment it is received
+ * until the reply is sent, so many requests can be in flight at the same time
+ * the request_context and everything it holds live in the request's arena: the usernames and result
+ * intervals are views of strings copied into the arena once, and the whole arena is reset when the
+ * request is released, see new_request_context() and release_request_context()
+*/
+struct request_context {
+    explicit request_context(request_arena *arena)
+        : arena(arena), framed_reply(arena_allocator<char>(arena)), client_username_list(arena_allocator<string_view>(arena)),
+          queries(arena_allocator<shard_query>(arena)), username_not_exist(arena_allocator<string_view>(arena)),
+          result_username_list(arena_allocator<string_view>(arena)), result_time_intervals(arena_allocator<string_view>(arena)),
+          cache_key(arena_allocator<char>(arena)), shard_versions(arena_allocator<pair<int, uint32_t>>(arena)) {}
+
+    request_arena *arena; // the memory of the request, from free_arenas
+    uint32_t request_id = 0; // correlation id carried by every query datagram and echoed by the backends
+    int client_fd = -1; // TCP socket of the client that sent the request, -1 once the client disconnected
+    bool framed = false; // the request came in a frame, the reply lines are sent together in one frame
+    uint32_t client_request_id = 0; // framed: request id chosen by the client, echoed in the reply
+    arena_string framed_reply; // framed: reply lines collected until the request finishes
+    batch_context *batch = NULL; // the batch request the request is part of, NULL for a single request
+    size_t batch_index = 0; // batch member: position of the request in the batch
+    bool slot_query = false; // the client asked for slots, see slots
+    slot_filter slots; // slot query: the window, minimum length and number of slots wanted
+    uint32_t quorum = 0; // quorum request: how many of the users must be free, 0 for an intersection
+    bool quorum_counts = false; // quorum request: cut the intervals where the number of free users changes and report it
+    arena_vector<string_view> client_username_list; // client input username list (up to 10 usernames), format: username1 username2 username3 …
+    arena_vector<shard_query> queries; // one per shard that stores a requested username, in shard_table order
+    arena_vector<string_view> username_not_exist; // a sub-list of client_username_list that does not exist at any shard, format: username1 username2 username3 …
+    arena_vector<string_view> result_username_list; // result username list
+    arena_vector<string_view> result_time_intervals; // result time intervals list
+    arena_string cache_key; // sorted, de-duplicated result_username_list, see make_cache_key()
+    arena_vector<pair<int, uint32_t>> shard_versions; // data version of every queried shard when the request was sent
+    uint64_t start_ns = 0; // metrics_now_ns() when the request was received
+    uint64_t sent_ns = 0; // metrics_now_ns() when the queries were queued for the shards
+    uint64_t trace_id = 0; // trace id of a sampled request, carried by its queries; 0 if it is not traced
+    chrono::steady_clock::time_point deadline; // the client gets a timeout reply if the shards have not all replied by then
+    chrono::steady_clock::time_point next_retransmit; // when the unanswered queries are sent again
+    int rto_ms = 0; // current retransmission timeout, doubled after every retransmission
+};
+
+/**
+ * per-connection state of a client
+*/
+struct client_connection {
+    int protocol = CLIENT_PROTOCOL_UNKNOWN; // decided by the first byte the client sends
+    string input; // framed: bytes received that do not make a whole frame yet
+    string output; // reply bytes the socket did not take yet, sent when it becomes writable
+};
+
+/**
+ * state of one scrape connection of the metrics endpoint
+*/
+struct metrics_connection {
+    string input; // the request bytes read so far
+    string output; // answer bytes the socket did not take yet, sent when it becomes writable
+    bool answered = false; // the answer was built, only output is left to send
+};
+
+/**
+ * one result cache entry: the final intersection for a set of usernames and the shards it came from
+*/
+struct cache_entry {
+    string key; // sorted, de-duplicated usernames separated by spaces
+    list<string> result_time_intervals; // the final intersection, format: [t1_start, t1_end], ...
+    vector<pair<int, uint32_t>> shard_versions; // (shard index, data version) the result was computed from
+};
+
+/**
+ * a point in time at which a pending request has to be looked at again (retransmission or deadline)
+*/
+struct request_timer {
+    chrono::steady_clock::time_point when;
+    uint32_t request_id;
+    bool operator>(const request_timer &other) const { return when > other.when; }
+};
+
+/**
+ * reassembly state of one backend's multi-datagram username list
+*/
+struct registration_state {
+    bool complete = false; // every chunk up to the last one has arrived
+    int total_chunks = -1; // number of chunks, known once the chunk flagged MSG_FLAG_LAST_CHUNK arrived
+    int received_count = 0; // number of distinct chunks received
+    vector<bool> received; // received[seq] is true once chunk seq arrived
+    uint32_t version = 0; // data version of the username list, advanced by every applied delta
+};
+
+/**
+ * reassembly state of one backend's multi-datagram username delta
+*/
+struct delta_state {
+    uint32_t version = 0; // data version the delta leads to
+    int total_chunks = -1; // number of chunks, known once the chunk flagged MSG_FLAG_LAST_CHUNK arrived
+    int received_count = 0; // number of distinct chunks received
+    vector<bool> received; // received[seq] is true once chunk seq arrived
+    vector<string> chunks; // chunk payloads, applied together once all of them arrived
+};
+
+/**
+ * one backend shard
+*/
+struct shard {
+    string name; // shard name used in the on screen messages, ie. "A"
+    string host; // UDP address of the shard
+    string port;
+    struct sockaddr_storage addr; // resolved once at startup
+    socklen_t addr_len = 0;
+    string trace_name; // "server A", name of the span of a traced query waiting for the shard's result
+    registration_state registration; // username list reassembly
+    delta_state delta; // username delta reassembly
+};
 
 /**
  * global variables
 */
 
-list<string> serverA_username_list; // serverA username list, format: username1 username2 username3 …
-list<string> serverB_username_list; // serverA username list, format: username1 username2 username3 …
-list<string> client_username_list; // client input username list (up to 10 usernames), format: username1 username2 username3 …
-list<string> username_to_serverA; // a sub-list of client_username_list that will be sent to serverA, format: username1 username2 username3 …
-list<string> username_to_serverB; // a sub-list of client_username_list that will be sent to serverB, format: username1 username2 username3 …
-list<string> username_not_exist; // a sub-list of client_username_list that does not exist in serverA_username_list and serverB_username_list, format: username1 username2 username3 …
-list<string> serverA_time_interval_list; // serverA time interval list, format: [[t1_start, t1_end], [t2_start, t2_end], … ].
-list<string> serverB_time_interval_list; // serverB time interval list, format: [[t1_start, t1_end], [t2_start, t2_end], … ].
-list<string> result_username_list; // result username list
-list<string> result_time_intervals; // result time intervals list
-bool received_serverA_username_list = false; // flag to indicate whether serverA username list is received
-bool received_serverB_username_list = false; // flag to indicate whether serverB username list is received
-bool received_serverA_time_interval_list = false; // flag to indicate whether serverA time interval list is received
-bool received_serverB_time_interval_list = false; // flag to indicate whether serverB time interval list is received
+// every backend shard, set from the command line, serverA and serverB by default
+// a username stored at more than one shard is owned by the first of them in the table
+vector<shard> shard_table;
+// username -> index of the owning shard in shard_table, built from the username lists the shards register,
+// so routing a username is a single hashed probe however many users there are
+unordered_map<string, uint16_t> username_directory;
+// username -> every shard that stores it, ascending, only for the usernames stored at more than one shard;
+// when one of them forgets the username (a reload or a restart) the next one becomes its owner
+unordered_map<string, vector<uint16_t>> shared_usernames;
+// requests waiting for a reply from one or more shards, keyed by request id;
+// the table's nodes are recycled through a free list, so a request does not allocate one
+unordered_map<uint32_t, request_context*, hash<uint32_t>, equal_to<uint32_t>,
+              node_pool_allocator<pair<const uint32_t, request_context*>>> pending_requests;
+uint32_t next_request_id = 1; // request id of the next client request, 0 is never used
+// one timer per pending request, earliest first; the timer of a finished request is skipped when it fires
+priority_queue<request_timer, vector<request_timer>, greater<request_timer>> request_timers;
+int rto_ms = DEFAULT_RTO_MS; // first retransmission timeout, set with --rto
+int deadline_ms = DEFAULT_DEADLINE_MS; // request deadline, set with --deadline
+// result cache, most recently used first; result_cache_index finds an entry by its key
+list<cache_entry> result_cache;
+unordered_map<string, list<cache_entry>::iterator> result_cache_index;
+size_t cache_size = DEFAULT_CACHE_SIZE; // most entries kept in result_cache, set with --cache-size, 0 disables it
+// state of every connected client, keyed by its socket
+unordered_map<int, client_connection> client_connections;
+// per shard, the batch query lines queued while handling the events, sent by flush_shard_batches();
+// views of the batch_line of each query, which lives until the request is recycled after the flush
+vector<vector<string_view>> shard_batch_lines;
+// arenas of finished requests, reset and ready for new_request_context(), at most ARENA_POOL_SIZE
+vector<request_arena *> free_arenas;
+// requests answered while handling the events, their arenas are reset by recycle_requests() once the
+// datagrams queued from them (ie. a query datagram still in udp_outbox) have been sent
+vector<request_context *> retired_requests;
+// scratch space reused by every request, so the lookups and the merge do not allocate once it has grown
+string lookup_key; // a username or cache key as a string, to look it up in username_directory or result_cache_index
+vector<shard_query *> merge_replied; // the queries of the request being merged that were answered
+vector<vector<interval>> merge_shard_intervals; // the parsed result of every answered query
+vector<interval_list> merge_lists;
+vector<sweep_event> merge_heap;
+vector<interval> merge_common, merge_result; // the intersection, the slots or quorum intervals picked from it
+vector<coverage_step> merge_coverage_all, merge_coverage_steps;
+vector<uint32_t> merge_counts;
+// metric names, in the order of serverM_counter and serverM_histogram
+const metric_desc serverM_counters[SERVERM_COUNTERS] = {
+    {"serverm_requests_total", "", "Client requests received, every request of a batch counts."},
+    {"serverm_replies_total", "", "Requests answered to the client."},
+    {"serverm_timeouts_total", "", "Requests answered after their deadline without every shard's result."},
+    {"serverm_cache_lookups_total", "result=\"hit\"", "Result cache lookups."},
+    {"serverm_cache_lookups_total", "result=\"miss\"", "Result cache lookups."},
+    {"serverm_usernames_not_found_total", "", "Requested usernames no shard stores."},
+    {"serverm_shard_queries_total", "", "Queries sent to the shards, without retransmissions."},
+    {"serverm_retransmissions_total", "", "Queries sent to a shard again after a retransmission timeout."},
+    {"serverm_datagrams_dropped_total", "reason=\"malformed\"", "Backend datagrams dropped without being used."},
+    {"serverm_datagrams_dropped_total", "reason=\"unknown_sender\"", "Backend datagrams dropped without being used."},
+    {"serverm_datagrams_dropped_total", "reason=\"late\"", "Backend datagrams dropped without being used."},
+    {"serverm_datagrams_dropped_total", "reason=\"duplicate\"", "Backend datagrams dropped without being used."},
+};
+const metric_desc serverM_histograms[SERVERM_HISTOGRAMS] = {
+    {"serverm_stage_seconds", "stage=\"tcp_receive\"", "Time spent in one stage of a request."},
+    {"serverm_stage_seconds", "stage=\"find_username\"", "Time spent in one stage of a request."},
+    {"serverm_stage_seconds", "stage=\"fan_out\"", "Time spent in one stage of a request."},
+    {"serverm_stage_seconds", "stage=\"backend\"", "Time spent in one stage of a request."},
+    {"serverm_stage_seconds", "stage=\"merge\"", "Time spent in one stage of a request."},
+    {"serverm_stage_seconds", "stage=\"reply\"", "Time spent in one stage of a request."},
+    {"serverm_request_seconds", "", "Time from receiving a request to replying to it."},
+};
+const char *metrics_port = METRICS_TCP_PORT; // --metrics-port, "0" disables the endpoint
+int sockfd_metrics = -1; // listening socket of the metrics endpoint
+unordered_map<int, metrics_connection> metrics_connections; // scrape connections by socket
+unsigned trace_sample_one_in = 0; // --trace-sample N: trace one request in N, 0 traces none
+int log_level = LEVEL_INFO; // --log-level LEVEL: skip the messages of a lower level
 
 /**
  * socket variables
 */
 int sockfd_TCP, sockfd_UDP, new_fd; // listen on sock_fd, new connection on new_fd
+int epfd; // epoll instance that owns sockfd_TCP, sockfd_UDP and every client socket
+struct epoll_event events[MAXEVENTS];
 struct addrinfo hints, *servinfo, *p;
-struct sockaddr_storage their_addr; // connector's address information 
+struct sockaddr_storage their_addr; // connector's address information
 socklen_t sin_size, addr_len;
 struct sigaction sa;
 int yes=1;
 char s[INET_ADDRSTRLEN];
 char buf[MAXBUFLEN];
+datagram_batch udp_batch; // receive buffers for backend datagrams
+vector<outgoing_datagram> udp_outbox; // datagrams to the shards, sent by flush_UDP_datagrams()
+batch_counter udp_receive_batches, udp_send_batches; // datagrams per recvmmsg()/sendmmsg() call
+int signal_fd; // SIGUSR1, read by the event loop
 int rv;
 int numbytes;
 
+#ifdef COUNT_ALLOCATIONS
+/**
+ * heap allocation counter, only in the serverM_counting build (make serverM_counting, -DCOUNT_ALLOCATIONS):
+ * every operator new of serverM (and so every std container and string) goes through here, and
+ * serverm_heap_allocations_total shows what the request path still allocates, see check.sh
+ * kept out of line so the compiler does not pair the inlined malloc() of one with the free() of the other
+*/
+atomic<uint64_t> heap_allocations(0);
+thread_local bool serving_scrape = false; // a scrape's own allocations are left out, see scrape_allocations
+
+__attribute__((noinline)) void *operator new(size_t size){
+    if (!serving_scrape) {
+        heap_allocations.fetch_add(1, memory_order_relaxed);
+    }
+    void *p = malloc(size == 0 ? 1 : size);
+    if (p == NULL) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept {
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+// held while the event loop serves the metrics port, so scraping the counter does not move it
+struct scrape_allocations {
+    scrape_allocations(){ serving_scrape = true; }
+    ~scrape_allocations(){ serving_scrape = false; }
+};
+#else
+struct scrape_allocations {
+    scrape_allocations(){}
+};
+#endif
+
 /**
  * function prototypes
 */
 
 void create_TCP_socket(); // create TCP socket w/ port number CLIENT_TCP_PORT & bind
 void create_UDP_socket(); // create UDP socket w/ port number BACKEND_UDP_PORT & bind
+void resolve_shard_addresses(); // resolve the UDP address of every shard once at startup
 void listen_TCP_socket(); // listen to TCP socket
-void accept_TCP_connection(); // accept TCP connection
-void receive_client_username_list(); // receive client username list
-void accept_UDP_connection(); // accept UDP connection
-void reply_to_client(); // reply to client with the result
+void set_non_blocking(int fd); // put fd in non-blocking mode
+void add_to_epoll(int fd, uint32_t events); // register fd with the epoll instance
+void create_epoll(); // create the epoll instance and register sockfd_TCP, sockfd_UDP and signal_fd
+void accept_TCP_connection(); // accept every pending TCP connection
+void close_client(int fd); // close a client socket and detach it from its pending requests
+void receive_client_username_list(int fd); // receive client username lists until the socket is drained
+request_context *new_request_context(int fd, string_view usernames); // create the request_context of one request in an arena
+void release_request_context(request_context *ctx); // the request is answered, recycle its arena after the flush
+void recycle_requests(); // free the released requests and return their arenas to free_arenas
+void start_client_request(int fd, string_view usernames, bool framed, uint32_t client_request_id, const slot_filter *slots = NULL); // start one client request
+template <class T>
+bool take_number(string_view &text, T &value); // parse the number at the start of text and move text past it
+string_view take_rest_of_line(string_view text); // what follows the space after the numbers of a request, up to a newline
+bool parse_slot_request(string_view payload, slot_filter &slots, string_view &usernames); // split a slot request frame's payload
+void start_quorum_request(int fd, string_view payload, uint32_t client_request_id); // start one quorum request frame
+void start_batch_request(int fd, const string &requests, uint32_t client_request_id); // start every request of a batch request
+void answer_batch_member(request_context *ctx); // store the reply of one request of a batch, reply to the client once all are in
+void send_to_client(request_context *ctx, string_view message, bool last); // send one reply line of a request
+void write_to_client(int fd, string_view data); // send bytes to a client, buffering what the socket does not take
+void write_frame_to_client(int fd, char type, uint32_t request_id, string_view payload); // send one frame to a client
+void flush_client_output(int fd); // send the buffered reply bytes of a client
+bool accept_UDP_connection(); // accept UDP connection, return false once the socket is drained
+void handle_UDP_datagram(const char *data, int len, const struct sockaddr_storage &addr); // dispatch one backend datagram
+void receive_shard_result(int shard_index, uint32_t request_id, int seq, bool last, const char *payload, int payload_len); // store a shard's result chunk for a pending request
+void queue_datagram(int shard_index, const string &datagram); // send a datagram to a shard on the next flush
+void queue_datagram_bytes(int shard_index, string_view datagram); // send a datagram kept alive by the caller on the next flush
+void flush_UDP_datagrams(); // send every queued datagram
+void flush_shard_batches(); // queue the batch query lines of every shard as one datagram train per shard
+void create_signal_fd(); // receive SIGUSR1 through a file descriptor
+void accept_metrics_connection(); // accept every pending scrape connection
+void receive_metrics_request(int fd); // read a scrape request and answer it with the metrics
+void flush_metrics_output(int fd); // send the rest of a scrape's answer, close the connection once it is sent
+string format_metrics(); // every metric in the Prometheus text format
+void print_batch_counters(); // print the achieved recvmmsg()/sendmmsg() batch sizes
+int find_shard(const struct sockaddr_storage &addr); // index of the shard a datagram came from, -1 if unknown
+bool registration_complete(); // true once every shard registered its username list
+void add_username(const string &username, int shard_index); // record that a shard stores a username
+void remove_username(const string &username, int shard_index); // record that a shard no longer stores a username
+void receive_username_chunk(int shard_index, const struct message_header &header, const char *payload, int payload_len); // add one username list chunk to username_directory
+void request_missing_chunks(int shard_index); // send a nack for the username list chunks of a shard that have not arrived
+void receive_username_delta(int shard_index, const struct message_header &header, const char *payload, int payload_len); // apply a shard's username delta to username_directory
+void reset_registration(int shard_index, uint32_t version); // forget a shard's usernames before it registers again
+void send_delta_ack(int shard_index); // tell a shard which data version serverM has for it
+void reply_to_client(request_context *ctx, string_view missing_shards = string_view()); // reply to client with the result
 void sigchld_handler(int s); // reap all dead processes
 void *get_in_addr(struct sockaddr *sa); // get sockaddr, IPv4 or IPv6
-void find_username(); // use client_username_list to find the username in serverA_username_list and serverB_username_list
-// send username_to_serverA to serverA
-void send_username_to_serverA(); 
-// send username_to_serverB to serverB
-void send_username_to_serverB(); 
+// look up every username of client_username_list in username_directory
+void find_username(request_context *ctx);
+// send the usernames of one shard_query to its shard
+void send_username_to_shard(request_context *ctx, shard_query &query);
 // handle the case when username_not_exist is not empty, return true if username_not_exist is empty
-void username_not_exist_handler(); 
-// send request to serverA and serverB and handler the case when username_not_exist is not empty
-void send_request(); 
-// receive result from serverA and serverB 
-// and compute the intersection 
+void username_not_exist_handler(request_context *ctx);
+// send request to the shards and handler the case when username_not_exist is not empty,
+// return false if there is nothing to wait for (the caller frees ctx)
+bool send_request(request_context *ctx);
+// build the result cache key of a request in its cache_key
+void make_cache_key(request_context *ctx);
+// answer a request from the result cache, return false on a miss
+bool reply_from_cache(request_context *ctx);
+// store the result of a completed request in the result cache
+void insert_into_cache(request_context *ctx);
+// keep only the slots a slot query asked for in result_time_intervals
+void apply_slot_filter(request_context *ctx);
+void merge_coverage(request_context *ctx, const vector<shard_query *> &replied);
+// find the "[start, end]" strings in a result and append views of them to out
+void scan_interval_strings(string_view text, arena_vector<string_view> &out);
+// parse "[start, end]" strings into intervals appended to out
+void parse_interval_strings(const arena_vector<string_view> &time_intervals, vector<interval> &out);
+// format intervals as "[start, end]" strings in arena appended to out, followed by " (n free)" if counts is set
+void format_interval_strings(const vector<interval> &intervals, const vector<uint32_t> *counts, request_arena &arena,
+                             arena_vector<string_view> &out);
+// compute the intersection of the results from every shard
 // and store the final intersection in result_time_intervals
-void receive_result(); 
+void receive_result(request_context *ctx);
+// once every expected backend reply arrived, merge the results, reply to the client and free ctx
+void finish_request_if_ready(request_context *ctx);
+// schedule the next retransmission or deadline of a pending request
+void schedule_request_timer(request_context *ctx);
+// resend the queries of a pending request that have not been answered yet
+void retransmit_request(request_context *ctx);
+// reply with the partial result of a request whose deadline passed and free ctx
+void expire_request(request_context *ctx);
+// handle every request timer that is due
+void run_request_timers();
+// milliseconds epoll_wait may sleep before the next request timer or registration retry, -1 for no limit
+int next_timeout_ms();
+void run_event_loop(); // serve every socket until the process is killed
 
 /**
  * got from Beej's Guide to Network Programming
@@ -129,10 +523,10 @@ void *get_in_addr(struct sockaddr *sa)
 void create_TCP_socket(){
 
     memset(&hints, 0, sizeof hints); // make sure the struct is empty
-    hints.ai_family = AF_UNSPEC; 
+    hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM; // TCP socket
     hints.ai_flags = AI_PASSIVE; // use my IP
-    
+
     if ((rv = getaddrinfo(LOCAL_HOST, CLIENT_TCP_PORT, &hints, &servinfo)) != 0) { // get address info
         fprintf(stderr, "serverM: create_TCP_socket: getaddrinfo: %s\n", gai_strerror(rv));
         exit(1);
@@ -159,7 +553,7 @@ void create_TCP_socket(){
     }
 
     freeaddrinfo(servinfo); // all done with this structure
-    
+
     if (p == NULL)  { // if we got here, it means we didn't get bound
         fprintf(stderr, "serverM: create_TCP_socket: failed to bind\n");
         exit(1);
@@ -173,10 +567,10 @@ void create_TCP_socket(){
 // create UDP socket w/ port number BACKEND_UDP_PORT & bind
 void create_UDP_socket(){
     memset(&hints, 0, sizeof hints); // make sure the struct is empty
-    hints.ai_family = AF_UNSPEC; 
+    hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_DGRAM; // UDP socket
     hints.ai_flags = AI_PASSIVE; // use my IP
-    
+
     if ((rv = getaddrinfo(LOCAL_HOST, BACKEND_UDP_PORT, &hints, &servinfo)) != 0) { // get address info
         fprintf(stderr, "serverM: create_UDP_socket: getaddrinfo: %s\n", gai_strerror(rv));
         exit(1);
@@ -188,6 +582,10 @@ void create_UDP_socket(){
             continue;
         }
 
+        int rcvbuf = UDP_RCVBUF_SIZE; // best effort, the kernel caps it at net.core.rmem_max
+        setsockopt(sockfd_UDP, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+        enable_drop_count(sockfd_UDP); // reported by the metrics endpoint
+
         if (bind(sockfd_UDP, p->ai_addr, p->ai_addrlen) == -1) { // bind socket
             close(sockfd_UDP);
             perror("serverM: create_UDP_socket: bind");
@@ -196,7 +594,7 @@ void create_UDP_socket(){
 
         break;
     }
-    
+
     if (p == NULL)  { // if we got here, it means we didn't get bound
         fprintf(stderr, "serverM: create_UDP_socket: failed to bind\n");
         exit(1);
@@ -204,6 +602,58 @@ void create_UDP_socket(){
 
     freeaddrinfo(servinfo); // all done with this structure
 }
+
+// resolve the UDP address of every shard once at startup,
+// so the request path never calls getaddrinfo
+void resolve_shard_addresses(){
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    for (shard &backend : shard_table) {
+        if ((rv = getaddrinfo(backend.host.c_str(), backend.port.c_str(), &hints, &servinfo)) != 0) {
+            fprintf(stderr, "serverM: resolve_shard_addresses: getaddrinfo %s: %s\n", backend.name.c_str(), gai_strerror(rv));
+            exit(1);
+        }
+        memcpy(&backend.addr, servinfo->ai_addr, servinfo->ai_addrlen);
+        backend.addr_len = servinfo->ai_addrlen;
+        freeaddrinfo(servinfo);
+    }
+}
+
+// find the shard a datagram came from by its source address and port
+// return -1 if it is not in shard_table
+int find_shard(const struct sockaddr_storage &addr){
+    for (size_t i = 0; i < shard_table.size(); i++) {
+        const struct sockaddr_storage &shard_addr = shard_table[i].addr;
+        if (shard_addr.ss_family != addr.ss_family) {
+            continue;
+        }
+        if (addr.ss_family == AF_INET) {
+            const struct sockaddr_in *a = (const struct sockaddr_in *)&addr, *b = (const struct sockaddr_in *)&shard_addr;
+            if (a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr) {
+                return i;
+            }
+        } else if (addr.ss_family == AF_INET6) {
+            const struct sockaddr_in6 *a = (const struct sockaddr_in6 *)&addr, *b = (const struct sockaddr_in6 *)&shard_addr;
+            if (a->sin6_port == b->sin6_port && memcmp(&a->sin6_addr, &b->sin6_addr, sizeof a->sin6_addr) == 0) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+// true once every shard registered its username list
+bool registration_complete(){
+    for (const shard &backend : shard_table) {
+        if (!backend.registration.complete) {
+            return false;
+        }
+    }
+    return true;
+}
+
 /**
  * got from Beej's Guide to Network Programming
 */
@@ -213,7 +663,7 @@ void listen_TCP_socket(){
         perror("serverM: TCPlisten");
         exit(1);
     }
-    
+
     sa.sa_handler = sigchld_handler; // reap all dead processes
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = SA_RESTART;
@@ -223,437 +673,1719 @@ void listen_TCP_socket(){
     }
 }
 
+// put fd in non-blocking mode, required for edge-triggered epoll
+void set_non_blocking(int fd){
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("serverM: set_non_blocking: fcntl");
+        exit(1);
+    }
+}
+
+// register fd with the epoll instance, the fd itself is stored as the event data
+void add_to_epoll(int fd, uint32_t events_mask){
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.events = events_mask;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("serverM: add_to_epoll: epoll_ctl");
+        exit(1);
+    }
+}
+
+// create the epoll instance and register the listening socket, the UDP socket and the metrics socket
+void create_epoll(){
+    if ((epfd = epoll_create1(0)) == -1) {
+        perror("serverM: create_epoll: epoll_create1");
+        exit(1);
+    }
+    set_non_blocking(sockfd_TCP);
+    set_non_blocking(sockfd_UDP);
+    add_to_epoll(sockfd_TCP, EPOLLIN | EPOLLET);
+    add_to_epoll(sockfd_UDP, EPOLLIN | EPOLLET);
+    add_to_epoll(signal_fd, EPOLLIN);
+    if (sockfd_metrics != -1) {
+        set_non_blocking(sockfd_metrics);
+        add_to_epoll(sockfd_metrics, EPOLLIN | EPOLLET);
+    }
+}
+
+// block SIGUSR1 and receive it through signal_fd instead, so the event loop prints the counters
+// between two events rather than inside a signal handler
+void create_signal_fd(){
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1 || (signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+        perror("serverM: create_signal_fd");
+        exit(1);
+    }
+}
+
+// print the number of datagrams moved per recvmmsg() and sendmmsg() call so far
+void print_batch_counters(){
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof info) == sizeof info); // drain the pending signals
+    log_printf(LEVEL_INFO, "Main Server received %s of recvmmsg().", format_batch_counter(udp_receive_batches).c_str());
+    log_printf(LEVEL_INFO, "Main Server sent %s of sendmmsg().", format_batch_counter(udp_send_batches).c_str());
+}
+
+// accept every pending scrape connection of the metrics endpoint (edge-triggered, so loop until EAGAIN)
+void accept_metrics_connection(){
+    scrape_allocations scrape;
+    while (1) {
+        int fd = accept(sockfd_metrics, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("serverM: accept_metrics_connection: accept");
+            }
+            return;
+        }
+        set_non_blocking(fd);
+        metrics_connections[fd] = metrics_connection();
+        add_to_epoll(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    }
+}
+
+// read what a scrape connection sent, and once the HTTP request is complete (or the scraper stopped
+// sending) answer it with the metrics, or the recorded trace spans for /trace, and close the connection
+// once the answer is sent; /trace can be hundreds of kilobytes, more than the socket takes at once,
+// so what it does not take waits in the connection's output until it is writable again
+void receive_metrics_request(int fd){
+    scrape_allocations scrape;
+    metrics_connection &conn = metrics_connections[fd];
+    if (conn.answered) { // writable again, or the scraper hung up
+        flush_metrics_output(fd);
+        return;
+    }
+    string &input = conn.input;
+    bool done = false;
+    while (!done) {
+        ssize_t n = recv(fd, buf, MAXBUFLEN, 0);
+        if (n > 0) {
+            input.append(buf, n);
+            done = metrics_request_complete(input);
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return; // wait for the rest of the request
+        } else {
+            done = true; // closed or failed, answer whatever was asked
+        }
+    }
+    string body = metrics_request_path(input) == "/trace" ? trace_dump("serverM") : format_metrics();
+    conn.output = metrics_http_response(body);
+    conn.answered = true;
+    flush_metrics_output(fd);
+}
 
+// send as much of a scrape's answer as the socket takes, and close the connection once all of it
+// is sent or the scraper went away
+void flush_metrics_output(int fd){
+    string &output = metrics_connections[fd].output;
+    size_t sent = 0;
+    while (sent < output.size()) {
+        ssize_t n = send(fd, output.data() + sent, output.size() - sent, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            output.erase(0, sent); // the rest goes out on the next EPOLLOUT
+            return;
+        }
+        if (n == -1) {
+            log_printf(LEVEL_WARNING, "serverM: flush_metrics_output: could not send the metrics: %s", strerror(errno));
+            break;
+        }
+        sent += n;
+    }
+    metrics_connections.erase(fd);
+    close(fd);
+}
+
+// every counter and histogram, plus the gauges read from the event loop's own state
+string format_metrics(){
+    string out;
+    metrics_format_counters(serverM_counters, SERVERM_COUNTERS, "", out);
+    metrics_format_histograms(serverM_histograms, SERVERM_HISTOGRAMS, "", out);
+    uint64_t hits = metrics_counter_total(COUNT_CACHE_HITS), misses = metrics_counter_total(COUNT_CACHE_MISSES);
+    metrics_format_value("serverm_inflight_requests", "gauge", "Requests waiting for a shard.", pending_requests.size(), "", out);
+    metrics_format_value("serverm_client_connections", "gauge", "Connected clients.", client_connections.size(), "", out);
+    metrics_format_value("serverm_cache_entries", "gauge", "Results in the result cache.", result_cache.size(), "", out);
+    metrics_format_value("serverm_cache_hit_ratio", "gauge", "Result cache hits per lookup so far.",
+                         hits + misses == 0 ? 0.0 : (double)hits / (hits + misses), "", out);
+    metrics_format_value("serverm_udp_datagrams_received_total", "counter", "Datagrams received from the shards.",
+                         udp_receive_batches.datagrams.load(), "", out);
+    metrics_format_value("serverm_udp_datagrams_sent_total", "counter", "Datagrams sent to the shards.",
+                         udp_send_batches.datagrams.load(), "", out);
+    metrics_format_value("serverm_udp_send_failures_total", "counter", "Datagrams to the shards the kernel refused to send.",
+                         udp_send_batches.failed.load(), "", out);
+    metrics_format_value("serverm_udp_receive_drops_total", "counter", "Datagrams the kernel dropped for a full receive buffer.",
+                         udp_batch.kernel_drops.load(), "", out);
+#ifdef COUNT_ALLOCATIONS
+    metrics_format_value("serverm_heap_allocations_total", "counter", "Heap allocations (operator new calls) so far.",
+                         heap_allocations.load(memory_order_relaxed), "", out);
+#endif
+    metrics_format_value("serverm_log_dropped_lines_total", "counter", "Log lines dropped because the log queue was full.",
+                         log_dropped_lines(), "", out);
+    return out;
+}
 
 /**
  * got from Beej's Guide to Network Programming
 */
-// accept TCP connection, return true if accept successfully
+// accept every pending TCP connection (edge-triggered, so loop until EAGAIN)
+// and register the new client sockets with the epoll instance
 void accept_TCP_connection(){
-    sin_size = sizeof their_addr;
-    new_fd = accept(sockfd_TCP, (struct sockaddr *)&their_addr, &sin_size);
-    if (new_fd == -1) {
-        perror("accept");
-        exit(1);
+    while (1) {
+        sin_size = sizeof their_addr;
+        new_fd = accept(sockfd_TCP, (struct sockaddr *)&their_addr, &sin_size);
+        if (new_fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { // no more pending connections
+                return;
+            }
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("serverM: accept");
+            return;
+        }
+        set_non_blocking(new_fd);
+        client_connections[new_fd] = client_connection();
+        add_to_epoll(new_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    }
+}
+
+// close a client socket, the requests it still has in flight are kept until the
+// backends reply but their result is dropped
+void close_client(int fd){
+    for (auto &entry : pending_requests) {
+        if (entry.second->client_fd == fd) {
+            entry.second->client_fd = -1;
+        }
+        if (entry.second->batch != NULL && entry.second->batch->client_fd == fd) {
+            entry.second->batch->client_fd = -1;
+        }
     }
+    client_connections.erase(fd);
+    close(fd); // closing also removes fd from the epoll instance
 }
+
 /**
  * got from Beej's Guide to Network Programming
 */
-// receive client username list using TCP and store them in client_username_list
-void receive_client_username_list(){
-    client_username_list.clear(); // clear the list before adding new usernames
-    // Receive the list of usernames from the client
-    if ((numbytes = recv(new_fd, buf, MAXBUFLEN - 1, 0)) == -1) {
-        perror("serverM: accept_TCP_connection: TCPrecv");
-        close(new_fd);
-        exit(1);
+// receive client username lists using TCP until the socket is drained
+// text protocol: every recv() is one request; framed protocol: every whole frame is one request,
+// a frame split across recv() calls waits in the connection's input
+void receive_client_username_list(int fd){
+    while (1) {
+        // a client answered from the cache can keep this loop busy for many requests; once the arenas
+        // run out, send what points into the answered ones and reuse them instead of allocating more
+        if (free_arenas.empty() && !retired_requests.empty()) {
+            flush_UDP_datagrams();
+            recycle_requests();
+        }
+        // Receive the list of usernames from the client
+        uint64_t receive_start = metrics_now_ns();
+        if ((numbytes = recv(fd, buf, MAXBUFLEN - 1, 0)) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { // nothing left to read
+                return;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("serverM: receive_client_username_list: TCPrecv");
+            close_client(fd);
+            return;
+        }
+        if (numbytes == 0) { // client closed the connection
+            close_client(fd);
+            return;
+        }
+        metrics_observe_since(STAGE_TCP_RECEIVE, receive_start);
+        client_connection &conn = client_connections[fd];
+        if (conn.protocol == CLIENT_PROTOCOL_UNKNOWN) {
+            conn.protocol = (uint8_t)buf[0] == FRAME_MAGIC ? CLIENT_PROTOCOL_FRAMED : CLIENT_PROTOCOL_TEXT;
+            // a framed reply is one send, do not let Nagle hold it back waiting for an ack;
+            // text connections keep the socket options they always had
+            if (conn.protocol == CLIENT_PROTOCOL_FRAMED) {
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+            }
+        }
+        if (conn.protocol == CLIENT_PROTOCOL_TEXT) {
+            start_client_request(fd, string_view(buf, numbytes), false, 0);
+            continue;
+        }
+        // start a request for every whole frame, keep the rest for the next recv()
+        conn.input.append(buf, numbytes);
+        size_t offset = 0;
+        struct frame_header header;
+        int parsed;
+        while ((parsed = parse_frame(conn.input.data() + offset, conn.input.size() - offset, &header)) == 1) {
+            string_view payload = string_view(conn.input).substr(offset + FRAME_HEADER_LEN, header.length);
+            if (header.type == FRAME_REQUEST) {
+                start_client_request(fd, payload, true, header.request_id);
+            } else if (header.type == FRAME_SLOT_REQUEST) {
+                slot_filter slots;
+                string_view usernames;
+                if (parse_slot_request(payload, slots, usernames)) {
+                    start_client_request(fd, usernames, true, header.request_id, &slots);
+                } else {
+                    write_frame_to_client(fd, FRAME_REPLY, header.request_id, "Invalid slot request.");
+                }
+            } else if (header.type == FRAME_QUORUM_REQUEST) {
+                start_quorum_request(fd, payload, header.request_id);
+            } else if (header.type == FRAME_BATCH_REQUEST) {
+                start_batch_request(fd, string(payload), header.request_id);
+            } else {
+                log_printf(LEVEL_ERROR, "serverM: receive_client_username_list: unknown frame type");
+            }
+            offset += FRAME_HEADER_LEN + header.length;
+        }
+        if (parsed == -1) {
+            log_printf(LEVEL_ERROR, "serverM: receive_client_username_list: malformed frame, closing the connection");
+            close_client(fd);
+            return;
+        }
+        conn.input.erase(0, offset);
     }
-    buf[numbytes] = '\0';
-    string received_data(buf);
-    istringstream iss(received_data);
-    string username;
+}
 
+// create the request_context of a request from client fd with a new request id in an arena of
+// free_arenas (a new one if there is none), copy usernames into the arena and split them by space
+// into client_username_list
+request_context *new_request_context(int fd, string_view usernames){
+    request_arena *arena;
+    if (free_arenas.empty()) {
+        arena = new request_arena();
+    } else {
+        arena = free_arenas.back();
+        free_arenas.pop_back();
+    }
+    request_context *ctx = new (arena->allocate(sizeof(request_context), alignof(request_context))) request_context(arena);
+    ctx->request_id = next_request_id++;
+    if (next_request_id == 0) { // skip 0 on wrap-around
+        next_request_id = 1;
+    }
+    ctx->client_fd = fd;
+    ctx->start_ns = metrics_now_ns();
+    metrics_add(COUNT_REQUESTS);
     // Process the received data and add usernames to the client_username_list
-    while (getline(iss, username, ' ')) { // split the received data by space
-        client_username_list.push_back(username);
+    string_view text = arena->copy(usernames);
+    size_t start = 0;
+    while (start < text.size()) { // split the received data by space, like getline(iss, username, ' ')
+        size_t space = text.find(' ', start);
+        if (space == string_view::npos) {
+            space = text.size();
+        }
+        ctx->client_username_list.push_back(text.substr(start, space - start));
+        start = space + 1;
+    }
+    return ctx;
+}
+
+// the request is answered and no longer in pending_requests: its arena is reset and reused once the
+// event loop has sent the datagrams of this iteration, some of which may still point into it
+void release_request_context(request_context *ctx){
+    retired_requests.push_back(ctx);
+}
+
+// destroy every released request and return its arena to free_arenas, called after flush_UDP_datagrams()
+void recycle_requests(){
+    for (request_context *ctx : retired_requests) {
+        request_arena *arena = ctx->arena;
+        ctx->~request_context();
+        arena->reset();
+        if (free_arenas.size() < ARENA_POOL_SIZE) {
+            free_arenas.push_back(arena);
+        } else {
+            delete arena;
+        }
+    }
+    retired_requests.clear();
+}
+
+// start one client request: split usernames into client_username_list and send the queries
+// framed requests are answered with one frame carrying client_request_id
+// slots is set for a slot request
+void start_client_request(int fd, string_view usernames, bool framed, uint32_t client_request_id, const slot_filter *slots){
+    request_context *ctx = new_request_context(fd, usernames);
+    ctx->framed = framed;
+    ctx->client_request_id = client_request_id;
+    if (slots != NULL) {
+        ctx->slot_query = true;
+        ctx->slots = *slots;
     }
     // Print the on screen message for the received request
-    cout << "Main Server received the request from client using TCP over port "
-                << CLIENT_TCP_PORT << "." << endl;
+    log_printf(LEVEL_INFO, "Main Server received the request from client using TCP over port %s.", CLIENT_TCP_PORT);
 
-    /*// Print the received usernames
-    cout << "Received usernames from the client:" << endl;
-    for (const string &username : client_username_list) {
-        cout << username << endl;
+    if (!send_request(ctx)) { // send request to the shards that store the usernames
+        release_request_context(ctx); // nothing to wait for
     }
-    */
 }
 
+// split the payload of a slot request, "min_duration window_start window_end limit username1 ...",
+// into slots and usernames; return false if the numbers are missing or make no sense
+bool parse_slot_request(string_view payload, slot_filter &slots, string_view &usernames){
+    if (!take_number(payload, slots.min_duration) || !take_number(payload, slots.window_start)
+        || !take_number(payload, slots.window_end) || !take_number(payload, slots.limit)
+        || slots.min_duration < 0 || slots.window_start > slots.window_end) {
+        return false;
+    }
+    usernames = take_rest_of_line(payload);
+    return true;
+}
+
+// parse the number after the spaces at the start of text into value and move text past it,
+// return false if there is none or it does not fit in T; the frame payload is parsed where it is, without a copy
+template <class T>
+bool take_number(string_view &text, T &value){
+    while (!text.empty() && isspace((unsigned char)text[0])) {
+        text.remove_prefix(1);
+    }
+    from_chars_result result = from_chars(text.data(), text.data() + text.size(), value);
+    if (result.ec != errc()) {
+        return false;
+    }
+    text.remove_prefix(result.ptr - text.data());
+    return true;
+}
+
+// the usernames after the numbers of a slot or quorum request: skip the one space after the last number
+// and stop at a newline
+string_view take_rest_of_line(string_view text){
+    if (text.empty()) {
+        return text;
+    }
+    text.remove_prefix(1); // the space before the usernames
+    return text.substr(0, text.find('\n'));
+}
+
+// start a quorum request, payload "quorum counts username1 ...": like a request, but answered with the
+// times at which at least quorum of the usernames are free; a quorum below 1 is answered as invalid
+void start_quorum_request(int fd, string_view payload, uint32_t client_request_id){
+    long long quorum = 0;
+    int counts = 0;
+    if (!take_number(payload, quorum) || !take_number(payload, counts) || quorum < 1 || quorum > UINT32_MAX) {
+        write_frame_to_client(fd, FRAME_REPLY, client_request_id, "Invalid quorum request.");
+        return;
+    }
+    string_view usernames = take_rest_of_line(payload);
+    request_context *ctx = new_request_context(fd, usernames);
+    ctx->framed = true;
+    ctx->client_request_id = client_request_id;
+    ctx->quorum = quorum;
+    ctx->quorum_counts = counts != 0;
+    log_printf(LEVEL_INFO, "Main Server received the request from client using TCP over port %s.", CLIENT_TCP_PORT);
+
+    if (!send_request(ctx)) {
+        release_request_context(ctx);
+    }
+}
+
+// start every request of a batch request, one per line of requests; their queries are sent
+// together by flush_shard_batches() and the replies in one frame by answer_batch_member()
+void start_batch_request(int fd, const string &requests, uint32_t client_request_id){
+    vector<string> lines;
+    istringstream iss(requests);
+    string line;
+    while (getline(iss, line, '\n')) {
+        lines.push_back(line);
+    }
+    log_printf(LEVEL_INFO, "Main Server received a batch of %zu requests from client using TCP over port %s.", lines.size(), CLIENT_TCP_PORT);
+    if (lines.empty()) {
+        write_frame_to_client(fd, FRAME_BATCH_REPLY, client_request_id, "");
+        return;
+    }
+
+    batch_context *batch = new batch_context();
+    batch->client_fd = fd;
+    batch->client_request_id = client_request_id;
+    batch->replies.resize(lines.size());
+    batch->remaining = lines.size();
+    // the last request to be answered frees batch, which can only happen once every request was started
+    for (size_t i = 0; i < lines.size(); i++) {
+        request_context *ctx = new_request_context(fd, lines[i]);
+        ctx->batch = batch;
+        ctx->batch_index = i;
+        if (!send_request(ctx)) {
+            release_request_context(ctx); // answered already
+        }
+    }
+}
+
+// a request of a batch is answered: keep its reply, and once it was the last one of the batch
+// send every reply to the client in one frame and free the batch
+void answer_batch_member(request_context *ctx){
+    batch_context *batch = ctx->batch;
+    batch->replies[ctx->batch_index].assign(ctx->framed_reply.data(), ctx->framed_reply.size());
+    if (--batch->remaining > 0) {
+        return;
+    }
+    if (batch->client_fd != -1) {
+        string payload;
+        for (size_t i = 0; i < batch->replies.size(); i++) {
+            payload += (i == 0 ? "" : "\n") + batch->replies[i];
+        }
+        write_frame_to_client(batch->client_fd, FRAME_BATCH_REPLY, batch->client_request_id, payload);
+        log_printf(LEVEL_INFO, "Main Server sent the results of a batch of %zu requests to the client.", batch->replies.size());
+    }
+    delete batch;
+}
+
+// send one reply line of a request to its client, last is true for the final line
+// text protocol: every line is sent on its own as before
+// framed protocol: the lines are collected and sent in one reply frame with the last one
+// batch member: the lines are joined by spaces and handed to answer_batch_member() with the last one
+void send_to_client(request_context *ctx, string_view message, bool last){
+    if (last) {
+        metrics_add(COUNT_REPLIES);
+        metrics_observe_since(STAGE_REQUEST, ctx->start_ns);
+    }
+    if (ctx->batch != NULL) {
+        ctx->framed_reply += ctx->framed_reply.empty() ? "" : " ";
+        ctx->framed_reply += message;
+        if (last) {
+            answer_batch_member(ctx);
+        }
+    } else if (ctx->client_fd == -1) { // the client went away while the backends were working
+    } else if (!ctx->framed) {
+        write_to_client(ctx->client_fd, message);
+    } else {
+        ctx->framed_reply += ctx->framed_reply.empty() ? "" : "\n";
+        ctx->framed_reply += message;
+        if (last) {
+            write_frame_to_client(ctx->client_fd, FRAME_REPLY, ctx->client_request_id, ctx->framed_reply);
+        }
+    }
+    if (last) { // after the reply is written, so the span covers every other span of the request
+        trace_span_since(ctx->trace_id, "request", ctx->request_id, ctx->start_ns);
+    }
+}
+
+// send data to a client without blocking the event loop, whatever the socket does not take
+// is kept in the connection's output and sent by flush_client_output() once it is writable
+void write_to_client(int fd, string_view data){
+    client_connection &conn = client_connections[fd];
+    conn.output += data;
+    flush_client_output(fd);
+}
+
+// send a frame to a client like write_to_client(), the frame is built straight in the connection's output
+void write_frame_to_client(int fd, char type, uint32_t request_id, string_view payload){
+    client_connection &conn = client_connections[fd];
+    append_frame(conn.output, type, request_id, payload);
+    flush_client_output(fd);
+}
+
+// send as much of a client's buffered output as the socket takes
+void flush_client_output(int fd){
+    auto entry = client_connections.find(fd);
+    if (entry == client_connections.end()) {
+        return;
+    }
+    string &output = entry->second.output;
+    size_t sent = 0;
+    while (sent < output.size()) {
+        ssize_t n = send(fd, output.data() + sent, output.size() - sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("serverM: flush_client_output: send");
+                sent = output.size(); // the connection is broken, recv() reports it
+            }
+            break;
+        }
+        sent += n;
+    }
+    output.erase(0, sent);
+}
+
+
 /**
  * got from Beej's Guide to Network Programming
 */
 // accept UDP connection
-// first, determine the data received is a list of usernames or a list of time intervals
-// and if the message is from serverA, store the username list in serverA_username_list
-// if the messgae is from serverB, store the username list in serverB_username_list
-// after receiving the username list, print the on screen message: 
+// first, determine from the message header whether the data received is a list of usernames or a result
+// and if the message is a username list chunk, add every username to username_directory
+// with the server it came from as the owner, a username delta chunk is applied the same way
+// after receiving the username list, print the on screen message:
 // "Main Server received the username list from server<A or B> using UDP over port <port number>."
-// else if the message is from serverA, store the time interval list in serverA_time_interval_list
-// if the messgae is from serverB, store the time interval list in serverB_time_interval_list
-// after receiving the time interval list, print the on screen message: 
-//"Main Server received from server <A or B> the intersection result using UDP over port <port number>: 
+// else the message is the time interval list for the pending request with the request id in the header,
+// store it in the time_interval_list of the request's query for that shard
+// after receiving the time interval list, print the on screen message:
+//"Main Server received from server <A or B> the intersection result using UDP over port <port number>:
 // <[[t1_start, t1_end], [t2_start, t2_end], … ]>."
+// return false if there was nothing to receive (the socket is drained)
 
-void accept_UDP_connection(){
-    addr_len = sizeof their_addr;
-    // receive message from serverA or serverB
-    if ((numbytes = recvfrom(sockfd_UDP, buf, MAXBUFLEN-1 , 0, (struct sockaddr *)&their_addr, &addr_len)) == -1) { 
-        perror("serverM: accept_UDP_connetion: recvfrom");
+// up to RECV_BATCH datagrams are taken from the socket with one recvmmsg() call
+bool accept_UDP_connection(){
+    // receive messages from the shards
+    int n = receive_datagrams(sockfd_UDP, udp_batch, MSG_DONTWAIT, &udp_receive_batches);
+    if (n == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return false;
+        }
+        perror("serverM: accept_UDP_connetion: recvmmsg");
         exit(1);
     }
-    // Add null terminator to the buffer
-    buf[numbytes] = '\0';
-
-    // Identify the server from which the message was received
-    char server_id;
-    uint16_t port = ntohs(((struct sockaddr_in *)&their_addr)->sin_port); 
-    
-    if (port == atoi(SERVER_A_UDP_PORT)) {
-        server_id = 'A';
-    } else if (port == atoi(SERVER_B_UDP_PORT)) {
-        server_id = 'B';
-    } else {
-        fprintf(stderr, "serverM: accept_UDP_connetion: Received message from an unknown server\n");
+    for (int i = 0; i < n; i++) {
+        handle_UDP_datagram(udp_batch.bufs[i], udp_batch.msgs[i].msg_len, udp_batch.addrs[i]);
+    }
+    return n == RECV_BATCH; // a short batch means the socket is drained
+}
+
+// dispatch one null-terminated datagram received from addr, see accept_UDP_connection()
+void handle_UDP_datagram(const char *data, int len, const struct sockaddr_storage &addr){
+    // Identify the shard from which the message was received
+    int shard_index = find_shard(addr);
+    if (shard_index == -1) {
+        metrics_add(COUNT_DROPPED_UNKNOWN_SENDER);
+        log_printf(LEVEL_ERROR, "serverM: accept_UDP_connetion: Received message from an unknown server");
+        return;
+    }
+    const char *shard_name = shard_table[shard_index].name.c_str();
+
+    struct message_header header;
+    const char *payload;
+    int payload_len;
+    if (!parse_datagram(data, len, &header, &payload, &payload_len)) {
+        metrics_add(COUNT_DROPPED_MALFORMED);
+        log_printf(LEVEL_ERROR, "serverM: accept_UDP_connetion: malformed datagram from server %s", shard_name);
         return;
     }
 
-    if (isalpha(buf[0])) { //if the message is a list of usernames, which means buf[0] is a english letter
-        string received_data(buf);
-        istringstream iss(received_data);
-        string username;
+    if (header.type == MSG_USERNAME_LIST) { //if the message is a chunk of a username list
+        receive_username_chunk(shard_index, header, payload, payload_len);
+        return;
+    }
+
+    if (header.type == MSG_USERNAME_DELTA) { //if the message is a chunk of a username delta after a reload
+        receive_username_delta(shard_index, header, payload, payload_len);
+        return;
+    }
 
-        // Process the received data and add usernames to the serverA_username_list or serverB_username_list
-        if (server_id == 'A'){
-            received_serverA_username_list = true; // set the flag to true
-            while (getline(iss, username, ' ')){
-                serverA_username_list.push_back(username);
+    if (header.type == MSG_BATCH_RESULT) { // one "request_id [t1_start, t1_end] ..." line per query of a batch
+        const char *line = payload, *payload_end = payload + payload_len;
+        while (line < payload_end) {
+            const char *line_end = (const char *)memchr(line, '\n', payload_end - line);
+            if (line_end == NULL) {
+                line_end = payload_end;
             }
-            cout << "Main Server received the username list from server A using UDP over port " << BACKEND_UDP_PORT << "." << endl;
-        }else if (server_id == 'B'){
-            received_serverB_username_list = true; // set the flag to true
-            while (getline(iss, username, ' ')){
-                serverB_username_list.push_back(username);
+            // the id is parsed inside the line only, it is followed by the line's intervals (possibly none)
+            uint32_t request_id = 0;
+            from_chars_result id = from_chars(line, line_end, request_id);
+            if (id.ec != errc() || id.ptr == line_end) { // an empty or malformed line
+                metrics_add(COUNT_DROPPED_MALFORMED);
+                log_printf(LEVEL_ERROR, "serverM: accept_UDP_connetion: malformed batch result line from server %s", shard_name);
+            } else {
+                receive_shard_result(shard_index, request_id, 0, true, id.ptr, line_end - id.ptr);
             }
-            cout << "Main Server received the username list from server B using UDP over port " << BACKEND_UDP_PORT << "." << endl;
-        }
-    } else if (buf[0] == '[') { // if the message is a list of time intervals, which means buf[0] is '['
-    string received_data(buf);
-    regex interval_regex("\\[([0-9]+), ([0-9]+)\\]");
-
-    sregex_iterator it(received_data.begin(), received_data.end(), interval_regex);
-    sregex_iterator end;
-
-    if (server_id == 'A'){
-        received_serverA_time_interval_list = true; // set the flag to true
-        while (it != end) {
-            smatch match = *it;
-            string start_time = match[1].str();
-            string end_time = match[2].str();
-            string time_interval = "[" + start_time + ", " + end_time + "]";
-            serverA_time_interval_list.push_back(time_interval);
-            ++it;
-        }
-        //"Main Server received from server <A or B> the intersection result using UDP over port <port number>: <[[t1_start, t1_end], [t2_start, t2_end], … ]>."
-        cout << "Main Server received from server A the intersection result using UDP over port " << BACKEND_UDP_PORT << ": [";
-                if (!serverA_time_interval_list.empty()){
-                    for (const string &time_interval : serverA_time_interval_list) {
-                        cout << time_interval << ", ";
-                    }
-                    cout << "\b\b]." << endl;
-                } else{
-                    cout << "]." << endl;
-                }
-                
-    } else if (server_id == 'B'){
-        received_serverB_time_interval_list = true; // set the flag to true
-        while (it != end) {
-            smatch match = *it;
-            string start_time = match[1].str();
-            string end_time = match[2].str();
-            string time_interval = "[" + start_time + ", " + end_time + "]";
-            serverB_time_interval_list.push_back(time_interval);
-            ++it;
-        }
-        cout << "Main Server received from server B the intersection result using UDP over port " << BACKEND_UDP_PORT << ": [";
-                if (!serverB_time_interval_list.empty()){
-                    for (const string &time_interval : serverB_time_interval_list) {
-                        cout << time_interval << ", ";
-                    }
-                    cout << "\b\b]." << endl;
-                } else{
-                    cout << "]." << endl;
-                }
-    } else if (buf[0] == '\0'){ // accept no time intersection
-        if (server_id == 'A'){
-            received_serverA_time_interval_list = true; // set the flag to true
-            cout << "Main Server received from server B the intersection result using UDP over port " 
-            << BACKEND_UDP_PORT << ": <>." << endl;
-        } else if (server_id == 'B'){
-            received_serverB_time_interval_list = true; // set the flag to true
-            cout << "Main Server received from server B the intersection result using UDP over port "
-            << BACKEND_UDP_PORT << ": <>." << endl;
-        }
-    }
-
-
-    }
-}   
-
-// use client_username_list to find the username in serverA_username_list and serverB_username_list
-// if the username is found in serverA_username_list store in client_to_serverA list
-// if the username is found in serverB_username_list store in client_to_serverB list
-// if the username is not found in both serverA_username_list and serverB_username_list store in username_not_exist list
-void find_username(){
-    username_to_serverA.clear(); // clear the previous data
-    username_to_serverB.clear();
-    username_not_exist.clear();
-    result_username_list.clear();
-    for (const string &username : client_username_list) {
-        if (find(serverA_username_list.begin(), serverA_username_list.end(), username) != serverA_username_list.end()) {
-            username_to_serverA.push_back(username);
-            result_username_list.push_back(username);
-        } else if (find(serverB_username_list.begin(), serverB_username_list.end(), username) != serverB_username_list.end()) {
-            username_to_serverB.push_back(username);
-            result_username_list.push_back(username);
-        } else {
-            username_not_exist.push_back(username);
+            line = line_end + 1;
         }
+        return;
+    }
+
+    if (header.type != MSG_RESULT && header.type != MSG_COVERAGE_RESULT) {
+        metrics_add(COUNT_DROPPED_MALFORMED);
+        log_printf(LEVEL_ERROR, "serverM: accept_UDP_connetion: unknown message type from server %s", shard_name);
+        return;
     }
+
+    // the message is a chunk of the list of time intervals (possibly empty) for one pending request,
+    // or of the coverage (possibly empty) for a pending quorum request
+    receive_shard_result(shard_index, header.request_id, header.seq, header.flags & MSG_FLAG_LAST_CHUNK, payload, payload_len);
 }
 
-// handle the case when username_not_exist is not empty
-// if username_not_exist is not empty, print error message:"<username1, username2, …> do not exist. Send a reply to the client."
-// and send user_not_exist list back to the client
-// return true if username_not_exist is empty
-void username_not_exist_handler(){
-    if (!username_not_exist.empty()) {
-        // send username_not_exist list back to the client
-        string username_list, not_exist_message;
-        for (const string &username : username_not_exist) {
-            username_list += username + ", ";
+// store chunk seq (last is true for the final one) of the time interval list (possibly empty)
+// a shard sent for the pending request with request_id; once every chunk arrived, the list is
+// parsed in chunk order into the time_interval_list of the request's query for that shard
+// duplicate chunks, ie. from a retransmitted query, are dropped
+void receive_shard_result(int shard_index, uint32_t request_id, int seq, bool last, const char *payload, int payload_len){
+    const char *shard_name = shard_table[shard_index].name.c_str();
+    auto entry = pending_requests.find(request_id);
+    if (entry == pending_requests.end()) {
+        metrics_add(COUNT_DROPPED_LATE);
+        log_printf(LEVEL_WARNING, "serverM: accept_UDP_connetion: result for unknown request %u from server %s", request_id, shard_name);
+        return;
+    }
+    request_context *ctx = entry->second;
+    shard_query *query = NULL;
+    for (shard_query &candidate : ctx->queries) {
+        if (candidate.shard == shard_index) {
+            query = &candidate;
         }
-        if (!username_list.empty()){
-            username_list += "\b\b";
+    }
+    if (query == NULL || query->received) { // not asked or duplicate reply
+        metrics_add(COUNT_DROPPED_DUPLICATE);
+        return;
+    }
+    if ((int)query->chunk_received.size() <= seq) {
+        query->chunk_received.resize(seq + 1, false);
+        query->result_chunks.resize(seq + 1);
+    }
+    if (query->chunk_received[seq]) { // duplicate chunk
+        metrics_add(COUNT_DROPPED_DUPLICATE);
+        return;
+    }
+    query->chunk_received[seq] = true;
+    query->result_chunks[seq] = ctx->arena->copy(payload, payload_len);
+    query->received_chunks++;
+    if (last) {
+        query->total_chunks = seq + 1;
+    }
+    if (query->received_chunks != query->total_chunks) { // more chunks to come
+        return;
+    }
+    metrics_observe_since(STAGE_BACKEND, ctx->sent_ns);
+    trace_span_since(ctx->trace_id, shard_table[shard_index].trace_name.c_str(), request_id, ctx->sent_ns, shard_index + 1);
+    arena_vector<string_view> &time_interval_list = query->time_interval_list;
+
+    // the chunks joined by spaces and null-terminated, in the arena so the intervals can be views of it
+    size_t received_len = 0;
+    for (string_view chunk : query->result_chunks) {
+        received_len += chunk.size() + 1;
+    }
+    char *received_data = (char *)ctx->arena->allocate(received_len + 1, 1);
+    size_t used = 0;
+    for (string_view chunk : query->result_chunks) {
+        memcpy(received_data + used, chunk.data(), chunk.size());
+        used += chunk.size();
+        received_data[used++] = ' ';
+    }
+    received_data[used] = '\0';
+    query->result_chunks.clear();
+    if (ctx->quorum > 0) { // "time:+n time:-n ..." words, see MSG_COVERAGE_RESULT
+        const char *word = received_data;
+        char *rest;
+        while (*word != '\0') {
+            timestamp_t time = strtoll(word, &rest, 10);
+            if (rest == word || *rest != ':') { // the space between two words
+                word++;
+                continue;
+            }
+            int32_t delta = strtol(rest + 1, &rest, 10);
+            query->coverage.push_back(coverage_step{time, delta});
+            word = rest;
         }
-        not_exist_message = username_list + " do not exist.";
-        if ((numbytes = send(new_fd, not_exist_message.c_str(), not_exist_message.length(), 0)) == -1) {
-            perror("serverM: username_not_exit_handler: send");
-            exit(1);
+        query->received = true;
+        log_printf(LEVEL_INFO, "Main Server received from server %s the coverage result using UDP over port %s: %zu changes.",
+                   shard_name, BACKEND_UDP_PORT, query->coverage.size());
+        finish_request_if_ready(ctx);
+        return;
+    }
+    scan_interval_strings(string_view(received_data, used), time_interval_list);
+    query->received = true; // set the flag to true
+    if (ctx->batch != NULL) { // the batch is summed up when its reply is sent
+        finish_request_if_ready(ctx);
+        return;
+    }
+
+    //"Main Server received from server <A or B> the intersection result using UDP over port <port number>: <[[t1_start, t1_end], [t2_start, t2_end], … ]>."
+    if (log_enabled(LEVEL_INFO)) {
+        log_line line(LEVEL_INFO);
+        line.printf("Main Server received from server %s the intersection result using UDP over port %s: [", shard_name, BACKEND_UDP_PORT);
+        for (string_view time_interval : time_interval_list) {
+            line.printf("%.*s, ", (int)time_interval.size(), time_interval.data());
         }
+        line.chop(time_interval_list.empty() ? 0 : 2);
+        line.printf("].");
+    }
+
+    finish_request_if_ready(ctx);
+}
 
-        for (const string &username : username_not_exist) {
-            cout << username << ", ";
+// record shard_index as the owner of username unless a shard earlier in shard_table already owns it
+void add_username(const string &username, int shard_index){
+    auto result = username_directory.emplace(username, shard_index);
+    if (result.second || result.first->second == shard_index) {
+        return;
+    }
+    // stored at more than one shard: remember all of them, the first one owns the username
+    vector<uint16_t> &holders = shared_usernames[username];
+    if (holders.empty()) {
+        holders.push_back(result.first->second);
+    }
+    auto position = lower_bound(holders.begin(), holders.end(), shard_index);
+    if (position == holders.end() || *position != shard_index) {
+        holders.insert(position, shard_index);
+    }
+    result.first->second = holders.front();
+}
+
+// shard_index no longer stores username: the username goes to the next shard that stores it,
+// or is removed from username_directory if there is none
+void remove_username(const string &username, int shard_index){
+    auto entry = username_directory.find(username);
+    if (entry == username_directory.end()) {
+        return;
+    }
+    auto shared = shared_usernames.find(username);
+    if (shared == shared_usernames.end()) {
+        if (entry->second == shard_index) {
+            username_directory.erase(entry);
         }
-        cout << "\b\b do not exist. Send a reply to the client." << endl;
+        return;
+    }
+    vector<uint16_t> &holders = shared->second;
+    holders.erase(remove(holders.begin(), holders.end(), shard_index), holders.end());
+    entry->second = holders.front();
+    if (holders.size() == 1) {
+        shared_usernames.erase(shared);
     }
 }
 
-// send username_to_serverA to serverA
-void send_username_to_serverA() {
-    int list_not_empty_flag = !username_to_serverA.empty();
-    // If username_to_serverA is not empty, send the username list to serverA
-    if (list_not_empty_flag) {
-        // initilize UDP connection to serverA
-        memset(&hints, 0, sizeof hints);
-        hints.ai_family = AF_UNSPEC;
-        hints.ai_socktype = SOCK_DGRAM;
+// add the usernames of one username list chunk to username_directory
+// the shard earlier in shard_table takes precedence if a username is stored at more than one shard
+// duplicates (retransmitted chunks) are ignored, once the chunk flagged MSG_FLAG_LAST_CHUNK and every
+// chunk before it arrived, print the on screen message:
+// "Main Server received the username list from server<A or B> using UDP over port <port number>."
+// and acknowledge the data version of the list
+// a chunk of a newer data version (the backend restarted or serverM asked for its full list again)
+// replaces everything registered for the backend, chunks of an older version are stale and dropped
+void receive_username_chunk(int shard_index, const struct message_header &header, const char *payload, int payload_len){
+    registration_state &registration = shard_table[shard_index].registration;
+    if (version_newer(header.request_id, registration.version)) {
+        reset_registration(shard_index, header.request_id);
+    } else if (header.request_id != registration.version) {
+        return;
+    }
+    if (header.seq >= registration.received.size()) {
+        registration.received.resize(header.seq + 1, false);
+    }
+    if (registration.received[header.seq]) { // duplicate chunk
+        if (registration.complete) {
+            send_delta_ack(shard_index); // the backend may have missed the ack
+        }
+        return;
+    }
+    registration.received[header.seq] = true;
+    registration.received_count++;
+    if (header.flags & MSG_FLAG_LAST_CHUNK) {
+        registration.total_chunks = header.seq + 1;
+    }
 
-        if ((rv = getaddrinfo(LOCAL_HOST, SERVER_A_UDP_PORT, &hints, &servinfo)) != 0) {
-            fprintf(stderr, "serverM: send_username_to_serverA: getaddrinfo: %s\n", gai_strerror(rv));
-            exit(1);
+    // size the directory up front so inserting a large chunk does not rehash repeatedly
+    username_directory.reserve(username_directory.size() + count(payload, payload + payload_len, ' ') + 1);
+
+    string received_data(payload, payload_len);
+    istringstream iss(received_data);
+    string username;
+    while (getline(iss, username, ' ')){
+        if (username.empty()) {
+            continue;
+        }
+        add_username(username, shard_index);
+    }
+
+    if (!registration.complete && registration.received_count == registration.total_chunks) {
+        registration.complete = true; // set the flag to true
+        log_printf(LEVEL_INFO, "Main Server received the username list from server %s using UDP over port %s.",
+                   shard_table[shard_index].name.c_str(), BACKEND_UDP_PORT);
+        send_delta_ack(shard_index);
+    }
+}
+
+// remove every username stored at a shard from username_directory, a username another shard
+// stores as well stays with that shard, and start reassembling the shard's username list of the
+// given data version
+void reset_registration(int shard_index, uint32_t version){
+    registration_state &registration = shard_table[shard_index].registration;
+    if (registration.received_count > 0) {
+        for (auto it = shared_usernames.begin(); it != shared_usernames.end(); ) {
+            vector<uint16_t> &holders = it->second;
+            auto held = find(holders.begin(), holders.end(), shard_index);
+            if (held == holders.end()) {
+                ++it;
+                continue;
+            }
+            holders.erase(held);
+            username_directory[it->first] = holders.front();
+            it = holders.size() == 1 ? shared_usernames.erase(it) : next(it);
         }
-        string username_list;
-        for (const string &username : username_to_serverA) {
-            username_list += username + " ";
+        for (auto it = username_directory.begin(); it != username_directory.end(); ) {
+            if (it->second == shard_index) {
+                it = username_directory.erase(it);
+            } else {
+                ++it;
+            }
         }
-        username_list.pop_back(); // remove the last space
+    }
+    registration = registration_state();
+    registration.version = version;
+}
 
-        if ((numbytes = sendto(sockfd_UDP, username_list.c_str(), username_list.length(), 0, p->ai_addr, p->ai_addrlen)) == -1) {
-            perror("serverM: sendto serverA");
-            exit(1);
+// collect the chunks of a backend's username delta (header request_id is the data version it leads to,
+// the first word of every chunk the version it starts from) and apply it once every chunk arrived:
+// "+username" adds the username with the backend as its owner, "-username" removes it
+// a delta that does not start from the version serverM has cannot be applied, so the backend's
+// usernames are dropped and its full list is requested instead
+// on screen message: "Main Server received the username delta from server<A or B> using UDP over port <port number>: <n> added, <m> removed."
+void receive_username_delta(int shard_index, const struct message_header &header, const char *payload, int payload_len){
+    registration_state &registration = shard_table[shard_index].registration;
+    delta_state &delta = shard_table[shard_index].delta;
+    if (!registration.complete) { // the backend keeps resending until it is acknowledged
+        return;
+    }
+    if (header.request_id == registration.version) { // already applied, the ack was lost
+        send_delta_ack(shard_index);
+        return;
+    }
+    string received_data(payload, payload_len);
+    istringstream iss(received_data);
+    uint32_t base_version = 0;
+    iss >> base_version;
+    if (base_version != registration.version || !version_newer(header.request_id, base_version)) {
+        reset_registration(shard_index, header.request_id);
+        registration.received.assign(1, false);
+        request_missing_chunks(shard_index); // everything from chunk 0
+        return;
+    }
+
+    if (delta.version != header.request_id) { // first chunk of a new delta
+        delta = delta_state();
+        delta.version = header.request_id;
+    }
+    if (header.seq >= delta.chunks.size()) {
+        delta.chunks.resize(header.seq + 1);
+        delta.received.resize(header.seq + 1, false);
+    }
+    if (delta.received[header.seq]) { // duplicate chunk
+        return;
+    }
+    delta.received[header.seq] = true;
+    delta.received_count++;
+    delta.chunks[header.seq] = received_data;
+    if (header.flags & MSG_FLAG_LAST_CHUNK) {
+        delta.total_chunks = header.seq + 1;
+    }
+    if (delta.received_count != delta.total_chunks) {
+        return;
+    }
+
+    int added = 0, removed = 0;
+    for (const string &chunk : delta.chunks) {
+        istringstream chunk_iss(chunk);
+        string word;
+        chunk_iss >> word; // base version
+        while (chunk_iss >> word) {
+            string username = word.substr(1);
+            if (word[0] == '+') {
+                add_username(username, shard_index);
+                added++;
+            } else if (word[0] == '-') {
+                remove_username(username, shard_index);
+                removed++;
+            }
         }
-        // Print on screen message: "Found <username1, username2, …> located at Server A. Send to ServerA."
-        cout << "Found <";
-        for (const string &username : username_to_serverA) {
-            cout << username << ", ";
+    }
+    registration.version = delta.version;
+    delta = delta_state();
+    log_printf(LEVEL_INFO, "Main Server received the username delta from server %s using UDP over port %s: %d added, %d removed.",
+               shard_table[shard_index].name.c_str(), BACKEND_UDP_PORT, added, removed);
+    send_delta_ack(shard_index);
+}
+
+// acknowledge the data version serverM's directory holds for a shard
+void send_delta_ack(int shard_index){
+    queue_datagram(shard_index, make_datagram(MSG_DELTA_ACK, shard_table[shard_index].registration.version, ""));
+}
+
+// send a nack for the username list chunks of a shard that have not arrived yet:
+// the missing chunk numbers below the highest one received, and if the last chunk is still unknown,
+// MSG_FLAG_RESEND_TAIL so the backend also resends everything after the highest one received
+void request_missing_chunks(int shard_index){
+    registration_state &registration = shard_table[shard_index].registration;
+    if (registration.complete) {
+        return;
+    }
+    string missing;
+    int listed = 0;
+    for (size_t seq = 0; seq < registration.received.size() && listed < MAX_NACK_SEQS; seq++) {
+        if (!registration.received[seq]) {
+            missing += to_string(seq) + " ";
+            listed++;
         }
-        cout << "\b\b> located at Server A. Send to ServerA." << endl;
-        // Free the allocated memory for the addrinfo structure
-        freeaddrinfo(servinfo);
     }
+    uint8_t flags = 0;
+    uint16_t tail = 0;
+    if (registration.total_chunks == -1) {
+        flags = MSG_FLAG_RESEND_TAIL;
+        tail = registration.received.size();
+    }
+    queue_datagram(shard_index, make_datagram(MSG_REGISTER_NACK, 0, missing, tail, flags));
 }
 
+// queue a datagram for a shard, every datagram queued while handling a batch of events
+// is sent together by flush_UDP_datagrams()
+void queue_datagram(int shard_index, const string &datagram){
+    const shard &backend = shard_table[shard_index];
+    outgoing_datagram outgoing;
+    outgoing.data = datagram;
+    outgoing.addr = (const struct sockaddr *)&backend.addr;
+    outgoing.addr_len = backend.addr_len;
+    udp_outbox.push_back(outgoing);
+}
 
-// send username_to_serverB to serverB
-// similar to send_username_to_serverA()
-void send_username_to_serverB(){
-    int list_not_empty_flag = !username_to_serverB.empty();
-    if (list_not_empty_flag) {
-        // Initialize the UDP connection to serverB
-        memset(&hints, 0, sizeof hints);
-        hints.ai_family = AF_UNSPEC;
-        hints.ai_socktype = SOCK_DGRAM;
+// queue a datagram for a shard like queue_datagram() without copying it, ie. the query datagram of a
+// request; the bytes must stay valid until flush_UDP_datagrams(), recycle_requests() runs after it
+void queue_datagram_bytes(int shard_index, string_view datagram){
+    const shard &backend = shard_table[shard_index];
+    outgoing_datagram outgoing;
+    outgoing.bytes = datagram;
+    outgoing.addr = (const struct sockaddr *)&backend.addr;
+    outgoing.addr_len = backend.addr_len;
+    udp_outbox.push_back(outgoing);
+}
 
-        if ((rv = getaddrinfo(LOCAL_HOST, SERVER_B_UDP_PORT, &hints, &servinfo)) != 0) {
-            fprintf(stderr, "serverM: send_username_to_serverB: getaddrinfo: %s\n", gai_strerror(rv));
-            exit(1);
+// send every queued datagram, SEND_BATCH per sendmmsg() call
+// a failed send is treated like a lost datagram: queries are retransmitted, nacks and acks are sent again
+void flush_UDP_datagrams(){
+    if (udp_outbox.empty()) {
+        return;
+    }
+    if (flush_datagrams(sockfd_UDP, udp_outbox, &udp_send_batches) == -1) {
+        perror("serverM: flush_UDP_datagrams: sendmmsg");
+    }
+}
+
+// queue the batch query lines collected for every shard while handling the events as one
+// MSG_BATCH_QUERY datagram train per shard, the lines are packed into as few datagrams as fit
+void flush_shard_batches(){
+    vector<string> datagrams;
+    for (size_t i = 0; i < shard_batch_lines.size(); i++) {
+        if (shard_batch_lines[i].empty()) {
+            continue;
         }
-        string username_list;
-        for (const string &username : username_to_serverB) {
-            username_list += username + " ";
+        datagrams.clear();
+        make_chunked_datagrams(MSG_BATCH_QUERY, 0, shard_batch_lines[i], datagrams, "", '\n');
+        for (const string &datagram : datagrams) {
+            queue_datagram(i, datagram);
         }
-        username_list.pop_back(); // remove the last space
-        if ((numbytes = sendto(sockfd_UDP, username_list.c_str(), username_list.length(), 0, p->ai_addr, p->ai_addrlen)) == -1) {
-            perror("serverM: sendto serverB");
-            exit(1);
+        log_printf(LEVEL_INFO, "Main Server sent %zu queries to server %s in %zu datagrams.",
+                   shard_batch_lines[i].size(), shard_table[i].name.c_str(), datagrams.size());
+        shard_batch_lines[i].clear();
+    }
+}
+
+// look up every username of client_username_list in username_directory
+// if the username is owned by a shard store it in the usernames of the request's query for that shard
+// if the username is not in the directory store in username_not_exist list
+// a quorum request counts users, so a username it repeats is looked up and counted once
+void find_username(request_context *ctx){
+    for (auto username_it = ctx->client_username_list.begin(); username_it != ctx->client_username_list.end(); username_it++) {
+        string_view username = *username_it;
+        if (ctx->quorum > 0 && find(ctx->client_username_list.begin(), username_it, username) != username_it) {
+            continue;
+        }
+        lookup_key.assign(username.data(), username.size());
+        auto entry = username_directory.find(lookup_key);
+        if (entry == username_directory.end()) {
+            ctx->username_not_exist.push_back(username);
+            continue;
         }
-        // print on screen message: "Found <username1, username2, …> located at Server B. Send to ServerB."
-        cout << "Found <";
-        for (const string &username : username_to_serverB) {
-            cout << username << ", ";
+        auto query = ctx->queries.begin();
+        while (query != ctx->queries.end() && query->shard < entry->second) {
+            query++;
         }
-        cout << "\b\b> located at Server B. Send to ServerB." << endl;
-        // Free the allocated memory for the addrinfo structure
-        freeaddrinfo(servinfo);
+        if (query == ctx->queries.end() || query->shard != entry->second) {
+            query = ctx->queries.insert(query, shard_query(ctx->arena));
+            query->shard = entry->second;
+        }
+        query->usernames.push_back(username);
+        ctx->result_username_list.push_back(username);
+    }
+}
+
+// handle the case when username_not_exist is not empty
+// if username_not_exist is not empty, print error message:"<username1, username2, …> do not exist. Send a reply to the client."
+// and send user_not_exist list back to the client
+// return true if username_not_exist is empty
+void username_not_exist_handler(request_context *ctx){
+    if (!ctx->username_not_exist.empty()) {
+        // send username_not_exist list back to the client
+        arena_string not_exist_message(arena_allocator<char>(ctx->arena));
+        for (string_view username : ctx->username_not_exist) {
+            not_exist_message += username;
+            not_exist_message += ", ";
+        }
+        not_exist_message += "\b\b do not exist.";
+        metrics_add(COUNT_USERNAMES_NOT_FOUND, ctx->username_not_exist.size());
+        send_to_client(ctx, not_exist_message, ctx->queries.empty()); // the last line if no shard is asked
+        if (ctx->batch != NULL) {
+            return;
+        }
+
+        log_line line(LEVEL_INFO);
+        for (string_view username : ctx->username_not_exist) {
+            line.printf("%.*s, ", (int)username.size(), username.data());
+        }
+        line.chop(2);
+        line.printf(" do not exist. Send a reply to the client.");
     }
 }
-// send request to serverA and serverB and handler the case when username_not_exist is not empty
+
+// send the usernames of one shard_query to its shard (on the next flush_UDP_datagrams())
+// the datagram is kept in the query so retransmit_request() can send it again
+void send_username_to_shard(request_context *ctx, shard_query &query) {
+    const shard &backend = shard_table[query.shard];
+    arena_string username_list(arena_allocator<char>(ctx->arena));
+    for (string_view username : query.usernames) {
+        username_list += username;
+        username_list += ' ';
+    }
+    username_list.pop_back(); // remove the last space
+    metrics_add(COUNT_SHARD_QUERIES);
+    char number[32];
+    if (ctx->batch != NULL) { // sent with the other queries for the shard by flush_shard_batches()
+        snprintf(number, sizeof number, "%u ", ctx->request_id);
+        query.batch_line = number;
+        query.batch_line += username_list;
+        shard_batch_lines[query.shard].push_back(query.batch_line);
+        return;
+    }
+    if (ctx->quorum > 0) {
+        append_datagram(query.datagram, MSG_COVERAGE_QUERY, ctx->request_id, username_list, 0, 0, ctx->trace_id);
+    } else if (ctx->slot_query) {
+        // the shard can clip to the window and drop the short intervals, but if other shards are asked too
+        // its first slots need not be common to all of them, so the limit is only pushed to a lone shard
+        const slot_filter &slots = ctx->slots;
+        uint32_t limit = ctx->queries.size() == 1 ? slots.limit : 0;
+        arena_string parameters(arena_allocator<char>(ctx->arena));
+        char text[128];
+        snprintf(text, sizeof text, "%lld %lld %lld %u ", (long long)slots.min_duration, (long long)slots.window_start,
+                 (long long)slots.window_end, limit);
+        parameters = text;
+        parameters += username_list;
+        append_datagram(query.datagram, MSG_SLOT_QUERY, ctx->request_id, parameters, 0, 0, ctx->trace_id);
+    } else {
+        append_datagram(query.datagram, MSG_QUERY, ctx->request_id, username_list, 0, 0, ctx->trace_id);
+    }
+
+    queue_datagram_bytes(query.shard, query.datagram);
+    // Print on screen message: "Found <username1, username2, …> located at Server <shard>. Send to Server<shard>."
+    log_line line(LEVEL_INFO);
+    line.printf("Found <");
+    for (string_view username : query.usernames) {
+        line.printf("%.*s, ", (int)username.size(), username.data());
+    }
+    line.chop(2);
+    line.printf("> located at Server %s. Send to Server%s.", backend.name.c_str(), backend.name.c_str());
+}
+
+// send request to the shards and handler the case when username_not_exist is not empty
 // first process the received username list by calling find_username()
 // second process the username_not_exist list by calling username_not_exist_handler()
-// if username_not_exist_handler return true, send username_to_serverA to serverA and send username_to_serverB to serverB
-void send_request(){
-    find_username();
-    username_not_exist_handler();
-    send_username_to_serverA();
-    send_username_to_serverB();
-}
-// receive the intersection results from serverA and serverB by calling accept_UDP_connection()
-// and compare the two serverA_time_interval_list and serverB_time_interval_list lists
-// and store the intersection results in result_time_intervals global variable
-// ie. if serverA_time_interval_list = [[1, 3], [5, 10], [12, 16], [17, 18], [21, 23]], 
-// and serverB_time_interval_list = [[0, 4], [8, 11], [15, 17], [18, 24]]
+// answer from the result cache if the same set of usernames was answered before from the current data,
+// otherwise send every query to its shard, shards that store none of the usernames are not contacted,
+// and start the request's retransmission and deadline timer
+// return true if the request is now pending, false if it was answered or there is nothing to send
+bool send_request(request_context *ctx){
+    if (ctx->batch == NULL && trace_sample(trace_sample_one_in)) { // the queries of a batch share datagrams, never traced
+        ctx->trace_id = trace_new_id();
+        log_printf(LEVEL_INFO, "Main Server traces the request with trace id %016llx.", (unsigned long long)ctx->trace_id);
+    }
+    uint64_t find_start = metrics_now_ns();
+    find_username(ctx);
+    username_not_exist_handler(ctx);
+    uint64_t fan_out_start = metrics_now_ns();
+    metrics_observe(STAGE_FIND_USERNAME, fan_out_start - find_start);
+    trace_span(ctx->trace_id, "find_username", ctx->request_id, find_start, fan_out_start);
+    if (ctx->queries.empty()) {
+        if (ctx->username_not_exist.empty()) { // no usernames at all, a framed request still gets its reply
+            send_to_client(ctx, "", true);
+        }
+        return false;
+    }
+    for (const shard_query &query : ctx->queries) {
+        ctx->shard_versions.push_back(make_pair(query.shard, shard_table[query.shard].registration.version));
+    }
+    if (cache_size > 0) {
+        make_cache_key(ctx);
+        char text[128];
+        if (ctx->slot_query) { // a slot query is a different question about the same usernames
+            const slot_filter &slots = ctx->slots;
+            snprintf(text, sizeof text, "/%lld %lld %lld %u", (long long)slots.min_duration, (long long)slots.window_start,
+                     (long long)slots.window_end, slots.limit);
+            ctx->cache_key += text;
+        } else if (ctx->quorum > 0) {
+            snprintf(text, sizeof text, "/quorum %u%s", ctx->quorum, ctx->quorum_counts ? " counts" : "");
+            ctx->cache_key += text;
+        }
+        if (reply_from_cache(ctx)) {
+            return false;
+        }
+    }
+    pending_requests[ctx->request_id] = ctx; // registered before sending, the table owns ctx until the reply
+    for (shard_query &query : ctx->queries) {
+        send_username_to_shard(ctx, query);
+    }
+    ctx->sent_ns = metrics_now_ns();
+    metrics_observe(STAGE_FAN_OUT, ctx->sent_ns - fan_out_start);
+    trace_span(ctx->trace_id, "fan_out", ctx->request_id, fan_out_start, ctx->sent_ns);
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    ctx->deadline = now + chrono::milliseconds(deadline_ms);
+    ctx->rto_ms = rto_ms;
+    ctx->next_retransmit = now + chrono::milliseconds(ctx->rto_ms);
+    schedule_request_timer(ctx);
+    return true;
+}
+
+// the cache key is the sorted, de-duplicated username set, so "b a a" and "a b" share an entry
+void make_cache_key(request_context *ctx){
+    arena_vector<string_view> sorted(ctx->result_username_list.begin(), ctx->result_username_list.end(),
+                                     arena_allocator<string_view>(ctx->arena));
+    sort(sorted.begin(), sorted.end());
+    sorted.erase(unique(sorted.begin(), sorted.end()), sorted.end());
+    ctx->cache_key.clear();
+    for (string_view username : sorted) {
+        ctx->cache_key += username;
+        ctx->cache_key += ' ';
+    }
+}
+
+// look the request up in the result cache; an entry is only used if the usernames are still owned by
+// the same shards and none of them changed its data version since, a stale entry is dropped
+// on a hit reply to the client without contacting any shard and return true
+bool reply_from_cache(request_context *ctx){
+    lookup_key.assign(ctx->cache_key.data(), ctx->cache_key.size());
+    auto entry = result_cache_index.find(lookup_key);
+    if (entry == result_cache_index.end()) {
+        metrics_add(COUNT_CACHE_MISSES);
+        return false;
+    }
+    const vector<pair<int, uint32_t>> &versions = entry->second->shard_versions;
+    if (!equal(versions.begin(), versions.end(), ctx->shard_versions.begin(), ctx->shard_versions.end())) { // a shard reloaded or a username moved
+        result_cache.erase(entry->second);
+        result_cache_index.erase(entry);
+        metrics_add(COUNT_CACHE_MISSES);
+        return false;
+    }
+    metrics_add(COUNT_CACHE_HITS);
+    result_cache.splice(result_cache.begin(), result_cache, entry->second); // most recently used
+    for (const string &interval : entry->second->result_time_intervals) { // copied, the entry may be evicted first
+        ctx->result_time_intervals.push_back(ctx->arena->copy(interval));
+    }
+    if (ctx->batch != NULL) {
+        reply_to_client(ctx);
+        return true;
+    }
+    if (log_enabled(LEVEL_INFO)) {
+        log_line line(LEVEL_INFO);
+        line.printf("Main Server found the intersection result in its cache: [");
+        for (string_view interval : ctx->result_time_intervals) {
+            line.printf("%.*s, ", (int)interval.size(), interval.data());
+        }
+        line.chop(ctx->result_time_intervals.empty() ? 0 : 2);
+        line.printf("].");
+    }
+    reply_to_client(ctx);
+    return true;
+}
+
+// remember the result of a completed request, unless a queried shard changed its data version while
+// the request was in flight; the least recently used entry is evicted once cache_size entries are kept
+void insert_into_cache(request_context *ctx){
+    if (cache_size == 0) {
+        return;
+    }
+    for (const pair<int, uint32_t> &shard_version : ctx->shard_versions) {
+        if (shard_table[shard_version.first].registration.version != shard_version.second) {
+            return;
+        }
+    }
+    lookup_key.assign(ctx->cache_key.data(), ctx->cache_key.size());
+    auto entry = result_cache_index.find(lookup_key);
+    if (entry != result_cache_index.end()) {
+        result_cache.erase(entry->second);
+        result_cache_index.erase(entry);
+    }
+    // the entry outlives the request's arena, so it owns copies of the key and the intervals
+    cache_entry new_entry;
+    new_entry.key = lookup_key;
+    new_entry.result_time_intervals.assign(ctx->result_time_intervals.begin(), ctx->result_time_intervals.end());
+    new_entry.shard_versions.assign(ctx->shard_versions.begin(), ctx->shard_versions.end());
+    result_cache.push_front(new_entry);
+    result_cache_index[lookup_key] = result_cache.begin();
+    if (result_cache.size() > cache_size) {
+        result_cache_index.erase(result_cache.back().key);
+        result_cache.pop_back();
+    }
+}
+// intersect the time interval lists of every shard that replied to the request in one pass
+// and store the intersection results in result_time_intervals of the request
+// ie. if shard A's time_interval_list = [[1, 3], [5, 10], [12, 16], [17, 18], [21, 23]],
+// and shard B's time_interval_list = [[0, 4], [8, 11], [15, 17], [18, 24]]
 // then result_time_intervals = [[1, 3], [8, 10], [15, 16], [21, 23]]
-void receive_result(){
-    serverA_time_interval_list.clear(); // clear the previous time interval list
-    serverB_time_interval_list.clear(); // clear the previous time interval list
-    received_serverA_time_interval_list = false; // reset the flag
-    received_serverB_time_interval_list = false; // reset the flag
-    if (username_to_serverA.empty() && !username_to_serverB.empty()){ // if username_to_serverA is empty, expecting only UDP connection from serverB
-        accept_UDP_connection();
-    }else if (username_to_serverB.empty() && !username_to_serverA.empty()){// if username_to_serverB is empty, expecting only UDP connection from serverA
-        accept_UDP_connection();
-    }else{
-        // wait until both serverA_time_interval_list and serverB_time_interval_list are received
-        while(!received_serverA_time_interval_list || !received_serverB_time_interval_list){
-            accept_UDP_connection();
-            this_thread::sleep_for(chrono::milliseconds(10)); // add a small delay to avoid busy waiting
-        }
-    }
-    result_time_intervals.clear(); // clear the previous result_time_intervals
-    if(username_to_serverA.empty() && serverA_time_interval_list.empty()){
-        result_time_intervals = serverB_time_interval_list;
-    }else if(username_to_serverB.empty() && serverB_time_interval_list.empty()){
-        result_time_intervals = serverA_time_interval_list;
-    }else{
-        // Compare the two time interval lists and store the intersection results in result_time_intervals
-        auto it_a = serverA_time_interval_list.begin(); // iterator for serverA_time_interval_list
-        auto it_b = serverB_time_interval_list.begin(); // iterator for serverB_time_interval_list
-
-    
-        while (it_a != serverA_time_interval_list.end() && it_b != serverB_time_interval_list.end()) {
-            string a_interval = *it_a; // get the current interval from serverA_time_interval_list
-            string b_interval = *it_b; // get the current interval from serverB_time_interval_list
-
-            int start_a = stoi(a_interval.substr(1, a_interval.find(',') - 1)); // get the start time of a_interval
-            // get the end time of a_interval
-            int end_a = stoi(a_interval.substr(a_interval.find(',') + 2, a_interval.size() - a_interval.find(',') - 3)); 
-
-            int start_b = stoi(b_interval.substr(1, b_interval.find(',') - 1));
-            int end_b = stoi(b_interval.substr(b_interval.find(',') + 2, b_interval.size() - b_interval.find(',') - 3));
-
-            int max_start = max(start_a, start_b); 
-            int min_end = min(end_a, end_b);
-
-            if (max_start < min_end) {
-                string result_interval = "[" + to_string(max_start) + ", " + to_string(min_end) + "]";
-                result_time_intervals.push_back(result_interval);
-            }
+// every list is parsed once, two are merged with intersect_intervals() and more are swept
+// together with intersect_k_way(), so no intermediate result is built however many shards replied
+void receive_result(request_context *ctx){
+    uint64_t merge_start = metrics_now_ns();
+    arena_vector<string_view> &result_time_intervals = ctx->result_time_intervals;
+    vector<shard_query *> &replied = merge_replied;
+    replied.clear();
+    for (shard_query &query : ctx->queries) {
+        if (query.received) {
+            replied.push_back(&query);
+        }
+    }
+    result_time_intervals.clear();
+    if (ctx->quorum > 0) {
+        merge_coverage(ctx, replied);
+    } else if (replied.size() == 1) {
+        result_time_intervals = replied.front()->time_interval_list;
+    } else if (replied.size() > 1) {
+        if (merge_shard_intervals.size() < replied.size()) {
+            merge_shard_intervals.resize(replied.size());
+        }
+        merge_lists.clear();
+        for (size_t i = 0; i < replied.size(); i++) {
+            merge_shard_intervals[i].clear();
+            parse_interval_strings(replied[i]->time_interval_list, merge_shard_intervals[i]);
+            merge_lists.push_back(interval_list{merge_shard_intervals[i].data(), merge_shard_intervals[i].size()});
+        }
+        merge_result.clear();
+        if (merge_lists.size() == 2) {
+            intersect_intervals(merge_lists[0].intervals, merge_lists[0].count, merge_lists[1].intervals, merge_lists[1].count,
+                                merge_result);
+        } else {
+            intersect_k_way(merge_lists.data(), merge_lists.size(), merge_heap, merge_result);
+        }
+        format_interval_strings(merge_result, NULL, *ctx->arena, result_time_intervals);
+    }
+    if (ctx->slot_query) {
+        apply_slot_filter(ctx);
+    }
+    metrics_observe_since(STAGE_MERGE, merge_start);
+    trace_span_since(ctx->trace_id, "merge", ctx->request_id, merge_start);
 
-            if (end_a < end_b) {
-                it_a++;
-            } else {
-                it_b++;
-            }
+    if (replied.empty() || ctx->batch != NULL) { // nothing to print, or the request is part of a batch
+        return;
+    }
+    // "Found the intersection between the results from server A and B: [...]."
+    if (!log_enabled(LEVEL_INFO)) {
+        return;
+    }
+    log_line line(LEVEL_INFO);
+    line.printf("Found the %s between the results from server ", ctx->quorum > 0 ? "quorum intervals" : "intersection");
+    for (size_t i = 0; i < replied.size(); i++) {
+        if (i > 0) {
+            line.printf("%s", (i + 1 == replied.size()) ? " and " : ", ");
         }
+        line.printf("%s", shard_table[replied[i]->shard].name.c_str());
+    }
+    line.printf(": [");
+    for (string_view interval : result_time_intervals) {
+        line.printf("%.*s, ", (int)interval.size(), interval.data());
+    }
+    line.chop(result_time_intervals.empty() ? 0 : 2);
+    line.printf("].");
+}
+// keep only the parts of result_time_intervals inside the window of a slot query that are not empty
+// and last at least min_duration, the first limit of them (filter_slots()); the shards dropped what
+// they could already, but only the merged result tells which slots are common to every shard
+void apply_slot_filter(request_context *ctx){
+    merge_common.clear();
+    merge_result.clear();
+    parse_interval_strings(ctx->result_time_intervals, merge_common);
+    filter_slots(merge_common.data(), merge_common.size(), ctx->slots, ctx->slots.limit, merge_result);
+    ctx->result_time_intervals.clear();
+    format_interval_strings(merge_result, NULL, *ctx->arena, ctx->result_time_intervals);
+}
+
+// add up the coverage of every shard that replied to a quorum request and store the intervals in which
+// at least quorum users are free in result_time_intervals, "[start, end]" or, when the counts were asked
+// for, "[start, end] (n free)"; a user of a shard that did not reply counts as busy
+void merge_coverage(request_context *ctx, const vector<shard_query *> &replied){
+    vector<coverage_step> &all = merge_coverage_all, &merged = merge_coverage_steps;
+    all.clear();
+    merged.clear();
+    for (const shard_query *query : replied) {
+        all.insert(all.end(), query->coverage.begin(), query->coverage.end());
     }
-    
-    
-        
-    cout << "Found the intersection between the results from server A and B: [";
-        if (!result_time_intervals.empty()){
-            for (const string &interval : result_time_intervals) {
-                cout << interval << ", ";
+    // the steps at one time are added up, so their order does not matter (and sort, unlike stable_sort, needs no buffer)
+    sort(all.begin(), all.end(), [](const coverage_step &a, const coverage_step &b) { return a.time < b.time; });
+    for (const coverage_step &step : all) {
+        add_coverage_step(merged, step.time, step.delta);
+    }
+    merge_result.clear();
+    merge_counts.clear();
+    quorum_intervals(merged.data(), merged.size(), ctx->quorum, ctx->quorum_counts ? &merge_counts : NULL, merge_result);
+    format_interval_strings(merge_result, ctx->quorum_counts ? &merge_counts : NULL, *ctx->arena, ctx->result_time_intervals);
+}
+
+// append a view of every "[start, end]" (two runs of digits) in a shard's result text to out,
+// skipping whatever else is between them
+void scan_interval_strings(string_view text, arena_vector<string_view> &out){
+    size_t open = 0;
+    while ((open = text.find('[', open)) != string_view::npos) {
+        size_t i = open + 1, digits = i;
+        while (i < text.size() && isdigit((unsigned char)text[i])) {
+            i++;
+        }
+        if (i > digits && text.compare(i, 2, ", ") == 0) {
+            i += 2;
+            digits = i;
+            while (i < text.size() && isdigit((unsigned char)text[i])) {
+                i++;
             }
-            cout << "\b\b]." << endl;
+            if (i > digits && i < text.size() && text[i] == ']') {
+                out.push_back(text.substr(open, i + 1 - open));
+                open = i + 1;
+                continue;
+            }
+        }
+        open++;
+    }
+}
+
+// parse "[start, end]" strings (as stored in a time_interval_list) into intervals appended to out
+// the numbers end at the ',' and ']' inside every string, so the views need not be null-terminated
+void parse_interval_strings(const arena_vector<string_view> &time_intervals, vector<interval> &out){
+    for (string_view time_interval : time_intervals) {
+        const char *text = time_interval.data() + 1; // after the '['
+        char *rest;
+        timestamp_t start = strtoll(text, &rest, 10);
+        timestamp_t end = strtoll(rest + 1, NULL, 10); // after the ','
+        out.push_back(interval{start, end});
+    }
+}
+
+// format intervals as "[start, end]" strings in arena appended to out, the form the replies are built from,
+// with " (n free)" after every one if counts (one per interval) is set
+void format_interval_strings(const vector<interval> &intervals, const vector<uint32_t> *counts, request_arena &arena,
+                             arena_vector<string_view> &out){
+    char text[96];
+    for (size_t i = 0; i < intervals.size(); i++) {
+        int length;
+        if (counts != NULL) {
+            length = snprintf(text, sizeof text, "[%lld, %lld] (%u free)", (long long)intervals[i].start,
+                              (long long)intervals[i].end, (*counts)[i]);
         } else {
-            cout << "]." << endl;
+            length = snprintf(text, sizeof text, "[%lld, %lld]", (long long)intervals[i].start, (long long)intervals[i].end);
         }
+        out.push_back(arena.copy(text, length));
+    }
 }
+
 // send result_time_intervals to the client
-void reply_to_client() {
+// if missing_shards is not empty the deadline passed before those shards replied, and the reply is
+// "Timed out: server <shards> did not reply in time. Time intervals [...] works for <the usernames of the other shards>"
+// or only its first sentence if no shard replied
+void reply_to_client(request_context *ctx, string_view missing_shards) {
+    if (ctx->client_fd == -1 && ctx->batch == NULL) { // the client went away while the backends were working
+        return;
+    }
+    uint64_t reply_start = metrics_now_ns();
     // Convert result_time_intervals list to a single string
-    string result_interval_str, result_username_str, result;
-    result_interval_str = "[";
-    for (const auto& interval : result_time_intervals) {
-        result_interval_str += interval + ", ";
+    arena_string result(arena_allocator<char>(ctx->arena));
+    if (!missing_shards.empty()) {
+        result += "Timed out: server ";
+        result += missing_shards;
+        result += " did not reply in time.";
+    }
+    if (missing_shards.empty() || !ctx->result_username_list.empty()) {
+        result += missing_shards.empty() ? "Time intervals [" : " Time intervals [";
+        for (string_view interval : ctx->result_time_intervals) {
+            result += interval;
+            result += ", ";
+        }
+        result += ctx->result_time_intervals.empty() ? "]" : "\b\b]";
+        result += " works for ";
+        if (ctx->quorum > 0) {
+            char text[64];
+            snprintf(text, sizeof text, "at least %u of ", ctx->quorum);
+            result += text;
+        }
+        for (string_view username : ctx->result_username_list) {
+            result += username;
+            result += ", ";
+        }
+        if (!ctx->result_username_list.empty()) {
+            result += "\b\b ";
+        }
+    }
+    // Send the result to the client
+    trace_span_since(ctx->trace_id, "reply", ctx->request_id, reply_start); // the write is the tail of the request span
+    send_to_client(ctx, result, true);
+    metrics_observe_since(STAGE_REPLY, reply_start);
+    if (ctx->batch != NULL) {
+        return;
+    }
+
+
+    log_printf(LEVEL_INFO, "Main Server sent the result to the client.");
+}
+
+// a request is complete once every shard it was sent to has replied
+void finish_request_if_ready(request_context *ctx){
+    for (const shard_query &query : ctx->queries) {
+        if (!query.received) {
+            return;
+        }
     }
-    if(result_interval_str == "["){
-        result_interval_str = "[]";
-    }else{
-        result_interval_str += "\b\b]";
+    pending_requests.erase(ctx->request_id);
+    receive_result(ctx); // compute the intersection of the results from the shards
+    insert_into_cache(ctx);
+    reply_to_client(ctx); // send the intersection results to the client
+    release_request_context(ctx);
+}
+
+// a request has one timer, at its next retransmission or its deadline, whichever comes first
+void schedule_request_timer(request_context *ctx){
+    request_timer timer;
+    timer.when = min(ctx->next_retransmit, ctx->deadline);
+    timer.request_id = ctx->request_id;
+    request_timers.push(timer);
+}
+
+// resend every query of the request whose shard has not replied and double the retransmission timeout,
+// a shard answers a query it already answered again, serverM drops the duplicate reply
+void retransmit_request(request_context *ctx){
+    for (const shard_query &query : ctx->queries) {
+        if (query.received) {
+            continue;
+        }
+        const shard &backend = shard_table[query.shard];
+        metrics_add(COUNT_RETRANSMISSIONS);
+        if (ctx->batch != NULL) { // goes out with the next batch query to the shard
+            shard_batch_lines[query.shard].push_back(query.batch_line);
+            continue;
+        }
+        queue_datagram_bytes(query.shard, query.datagram);
+        log_printf(LEVEL_INFO, "Main Server sent the request to server %s again after %d ms.", backend.name.c_str(), ctx->rto_ms);
     }
-    
-    for(const auto& username : result_username_list){
-        result_username_str += username + ", ";
+    ctx->rto_ms *= 2;
+    ctx->next_retransmit = chrono::steady_clock::now() + chrono::milliseconds(ctx->rto_ms);
+}
+
+// the deadline of a request passed: merge the results that arrived, reply to the client with the
+// shards that did not reply and only the usernames that were answered for, and free ctx
+void expire_request(request_context *ctx){
+    arena_string missing_shards(arena_allocator<char>(ctx->arena));
+    arena_vector<string_view> answered_usernames(arena_allocator<string_view>(ctx->arena));
+    for (const shard_query &query : ctx->queries) {
+        if (query.received) {
+            answered_usernames.insert(answered_usernames.end(), query.usernames.begin(), query.usernames.end());
+        } else {
+            missing_shards += missing_shards.empty() ? "" : " and ";
+            missing_shards += shard_table[query.shard].name;
+        }
     }
-    if(!result_username_str.empty()){
-        result_username_str += "\b\b ";
+    // keep the client's order of the usernames
+    arena_vector<string_view> &usernames = ctx->result_username_list;
+    usernames.erase(remove_if(usernames.begin(), usernames.end(), [&](string_view username) {
+        return find(answered_usernames.begin(), answered_usernames.end(), username) == answered_usernames.end();
+    }), usernames.end());
+    metrics_add(COUNT_TIMEOUTS);
+    log_printf(LEVEL_INFO, "Server %s did not reply before the deadline of the request.", missing_shards.c_str());
+    pending_requests.erase(ctx->request_id);
+    receive_result(ctx);
+    reply_to_client(ctx, missing_shards);
+    release_request_context(ctx);
+}
+
+// pop every request timer that is due, timers of requests that already finished are skipped
+void run_request_timers(){
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    while (!request_timers.empty() && request_timers.top().when <= now) {
+        request_timer timer = request_timers.top();
+        request_timers.pop();
+        auto entry = pending_requests.find(timer.request_id);
+        if (entry == pending_requests.end()) {
+            continue;
+        }
+        request_context *ctx = entry->second;
+        if (now >= ctx->deadline) {
+            expire_request(ctx);
+            continue;
+        }
+        if (now >= ctx->next_retransmit) {
+            retransmit_request(ctx);
+        }
+        schedule_request_timer(ctx);
     }
-    result = "Time intervals " + result_interval_str + " works for " + result_username_str;
-    // Send the result to the client
-    if (send(new_fd, result.c_str(), result.length(), 0) == -1) {
-        perror("serverM: reply_to_client: send");
+}
+
+// how long epoll_wait may sleep: until the earliest request timer (rounded up so it has expired
+// on wake-up), at most REGISTRATION_RETRY_MS while a shard is registering, otherwise forever
+int next_timeout_ms(){
+    int timeout = registration_complete() ? -1 : REGISTRATION_RETRY_MS;
+    if (!request_timers.empty()) {
+        chrono::steady_clock::duration wait = request_timers.top().when - chrono::steady_clock::now();
+        long long wait_ms = (chrono::duration_cast<chrono::microseconds>(wait).count() + 999) / 1000;
+        if (wait_ms < 0) {
+            wait_ms = 0;
+        }
+        if (timeout == -1 || wait_ms < timeout) {
+            timeout = wait_ms;
+        }
+    }
+    return timeout;
+}
+
+// dispatch epoll events until the process is killed
+// every datagram for the shards queued while handling the events is sent in one batch at the end
+// epoll_wait sleeps until the next request timer at most, due timers are handled after every wake-up
+// while a shard is registering again (restart or failed delta), wake up every REGISTRATION_RETRY_MS
+// without a datagram to ask for its missing username list chunks
+void run_event_loop(){
+    while (1) {
+        int n = epoll_wait(epfd, events, MAXEVENTS, next_timeout_ms());
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("serverM: run_event_loop: epoll_wait");
+            exit(1);
+        }
+        if (n == 0 && !registration_complete()) {
+            for (size_t i = 0; i < shard_table.size(); i++) {
+                request_missing_chunks(i);
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == sockfd_TCP) {
+                accept_TCP_connection(); // new clients
+            } else if (fd == sockfd_UDP) {
+                while (accept_UDP_connection()); // drain every backend reply
+            } else if (fd == signal_fd) {
+                print_batch_counters();
+            } else if (fd == sockfd_metrics) {
+                accept_metrics_connection(); // new scrapes
+            } else if (metrics_connections.count(fd) > 0) {
+                receive_metrics_request(fd); // reads the request, or sends more of the answer once writable
+            } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                close_client(fd);
+            } else {
+                if (events[i].events & EPOLLOUT) {
+                    flush_client_output(fd); // the socket took the last reply bytes, send the rest
+                }
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP)) {
+                    // EPOLLRDHUP is handled by recv() returning 0 once the data before it is read
+                    receive_client_username_list(fd);
+                }
+            }
+        }
+        run_request_timers(); // retransmissions and deadlines that are due
+        flush_shard_batches(); // the batch queries of this iteration, one datagram train per shard
+        flush_UDP_datagrams(); // the queries, retransmissions, nacks and acks of this iteration
+        recycle_requests(); // the arenas of the requests answered in this iteration, now nothing points into them
     }
-    
-    
-    cout << "Main Server sent the result to the client." << endl;
 }
 
 
 
-int main (void){
+// usage: serverM [--shard NAME HOST:PORT]... [--rto MS] [--deadline MS] [--cache-size N] [--metrics-port PORT] [--trace-sample N]
+//               [--log-level LEVEL]
+// --shard NAME HOST:PORT: add a backend shard to the shard table, in order of precedence,
+//                         without any the table is serverA (127.0.0.1:21984) and serverB (127.0.0.1:22984)
+// --rto MS: first retransmission timeout of a query, DEFAULT_RTO_MS by default
+// --deadline MS: time a request may take before the client gets a timeout reply, DEFAULT_DEADLINE_MS by default
+// --cache-size N: results kept in the result cache, DEFAULT_CACHE_SIZE by default, 0 disables the cache
+// --metrics-port PORT: local TCP port of the Prometheus metrics endpoint, METRICS_TCP_PORT by default, 0 disables it
+// --trace-sample N: trace one request in N, see trace.h; the spans are listed at /trace on the metrics port, 0 (the default) traces none
+// --log-level LEVEL: error, warning, info (the default, every on screen message) or debug, see log.h
+int main (int argc, char *argv[]){
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--shard") == 0 && i + 2 < argc) {
+            shard backend;
+            backend.name = argv[++i];
+            string address = argv[++i];
+            size_t colon = address.rfind(':');
+            if (colon == string::npos) {
+                fprintf(stderr, "serverM: --shard expects NAME HOST:PORT\n");
+                exit(1);
+            }
+            backend.host = address.substr(0, colon);
+            backend.port = address.substr(colon + 1);
+            shard_table.push_back(backend);
+        } else if (strcmp(argv[i], "--rto") == 0 && i + 1 < argc) {
+            rto_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--deadline") == 0 && i + 1 < argc) {
+            deadline_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+            cache_size = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--metrics-port") == 0 && i + 1 < argc) {
+            metrics_port = argv[++i];
+        } else if (strcmp(argv[i], "--trace-sample") == 0 && i + 1 < argc) {
+            trace_sample_one_in = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            log_level = log_parse_level(argv[++i]);
+        }
+    }
+    if (log_level == -1) {
+        fprintf(stderr, "serverM: --log-level expects error, warning, info or debug\n");
+        exit(1);
+    }
+    if (rto_ms <= 0 || deadline_ms <= 0) {
+        fprintf(stderr, "serverM: --rto and --deadline must be positive\n");
+        exit(1);
+    }
+    if (shard_table.empty()) {
+        shard_table.resize(2);
+        shard_table[0].name = "A";
+        shard_table[0].host = LOCAL_HOST;
+        shard_table[0].port = SERVER_A_UDP_PORT;
+        shard_table[1].name = "B";
+        shard_table[1].host = LOCAL_HOST;
+        shard_table[1].port = SERVER_B_UDP_PORT;
+    }
+    if (shard_table.size() > UINT16_MAX) {
+        fprintf(stderr, "serverM: too many shards\n");
+        exit(1);
+    }
+    shard_batch_lines.resize(shard_table.size());
+    for (shard &backend : shard_table) {
+        backend.trace_name = "server " + backend.name; // shard_table is never resized again, the names stay put
+    }
+    log_start(log_level);
+    create_signal_fd(); // SIGUSR1 prints the batch counters
     create_TCP_socket(); // create TCP socket w/ port number CLIENT_TCP_PORT & bind
     listen_TCP_socket(); // listen to TCP socket
     create_UDP_socket(); // create UDP socket w/ port number BACKEND_UDP_PORT & bind
-    while(!received_serverA_username_list || !received_serverB_username_list){ // wait for serverA and serverB to send their username list`
-        accept_UDP_connection(); // expect to receive from serverA and serverB
-        this_thread::sleep_for(chrono::milliseconds(10)); // Add a short delay
+    resolve_shard_addresses(); // resolve the UDP address of every shard
+    if (strcmp(metrics_port, "0") != 0) {
+        sockfd_metrics = metrics_listen(LOCAL_HOST, metrics_port); // the event loop serves it, -1 if it is taken
     }
-    printf("The Main server is up and running.\n");
-    accept_TCP_connection(); // accept TCP connection from client
+    // wait for every shard to send every chunk of its username list,
+    // asking again for the missing chunks whenever the socket stays quiet for REGISTRATION_RETRY_MS
+    while(!registration_complete()){
+        struct pollfd pfd;
+        pfd.fd = sockfd_UDP;
+        pfd.events = POLLIN;
+        int ready = poll(&pfd, 1, REGISTRATION_RETRY_MS);
+        if (ready > 0) {
+            accept_UDP_connection(); // expect to receive from every shard
+        } else if (ready == 0) {
+            for (size_t i = 0; i < shard_table.size(); i++) {
+                request_missing_chunks(i);
+            }
+        } else if (errno != EINTR) {
+            perror("serverM: poll");
+            exit(1);
+        }
+        flush_UDP_datagrams();
+    }
+    log_printf(LEVEL_INFO, "The Main server is up and running.");
     /**
      * got from Beej's Guide to Network Programming
     */
-    while(1){
-        receive_client_username_list();
-        send_request(); // send request to serverA and serverB
-        if(!username_to_serverA.empty() || !username_to_serverB.empty()){
-            //receive the intersection results from serverA and serverB
-            receive_result();
-            // send the intersection results to the client
-            reply_to_client();
-
-            
-        }
-
-        this_thread::sleep_for(chrono::milliseconds(10)); // Add a short delay
-    }
+    create_epoll(); // hand every socket to the event loop
+    run_event_loop();
 
 
     // close sockets
-    close(new_fd);
+    close(epfd);
     close(sockfd_TCP);
     close(sockfd_UDP);
+    close(signal_fd);
     return 0;
-}
\ No newline at end of file
+}
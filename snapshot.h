@@ -0,0 +1,221 @@
+/**
+ * snapshot.h - versioned binary snapshot of a backend's availability index for fast restarts
+ *              layout (native byte order, every section 8-byte aligned):
+ *                snapshot_header
+ *                snapshot_user[user_count]      name slice + user_record of every user, sorted by name
+ *                interval[interval_count]       the packed interval pool
+ *                char[names_bytes]              every username back to back
+ *                uint64_t[user_count * bitmap_words]  every user's bitmap, if the domain is small enough
+ *              the sections are laid out the way availability_index reads them, so a backend keeps the
+ *              file mapped and answers queries from it: nothing is copied or rebuilt at startup
+ *              the header records the size and mtime of the text file it was built from and a
+ *              checksum of everything after the header, so a stale or damaged snapshot is ignored
+*/
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include "interval.h"
+
+#define SNAPSHOT_MAGIC 0x50414e53u // "SNAP" read as a little-endian word, catches byte order mismatches
+#define SNAPSHOT_VERSION 3 // bump whenever the layout or interval/user_record changes
+
+struct snapshot_header {
+    uint32_t magic; // SNAPSHOT_MAGIC
+    uint32_t version; // SNAPSHOT_VERSION
+    uint32_t interval_size; // sizeof(interval) of the writer
+    uint32_t user_count;
+    uint64_t interval_count;
+    uint64_t names_bytes;
+    uint64_t bitmap_words; // 64-bit words per user bitmap, 0 if the snapshot has no bitmaps
+    uint32_t max_user_intervals; // most time intervals of one user, checked against --max-intervals
+    uint32_t reserved;
+    uint64_t source_size; // st_size of the text database the snapshot was built from
+    int64_t source_mtime_sec; // st_mtim of the text database
+    int64_t source_mtime_nsec;
+    uint64_t checksum; // snapshot_checksum() of everything after the header
+};
+
+// one user of the user table, in memory and on disk
+struct snapshot_user {
+    uint64_t name_offset; // into the names section
+    uint32_t name_len;
+    user_record record; // slices of the interval and bitmap sections
+};
+
+static_assert(sizeof(snapshot_header) % 8 == 0 && sizeof(snapshot_user) % 8 == 0, "snapshot sections must stay 8-byte aligned");
+
+/**
+ * the sections of an availability index, either built in memory or mapped from a snapshot file
+*/
+struct snapshot_sections {
+    const snapshot_user *users = NULL; // sorted by name
+    uint32_t user_count = 0;
+    const interval *intervals = NULL;
+    uint64_t interval_count = 0;
+    const char *names = NULL;
+    uint64_t names_bytes = 0;
+    const uint64_t *bitmaps = NULL;
+    uint64_t bitmap_words = 0; // per user, 0 for no bitmaps
+    uint32_t max_user_intervals = 0;
+    void *mapping = NULL; // the mapped file, NULL for sections built in memory
+    size_t mapping_size = 0;
+};
+
+// FNV-1a over 64-bit words (the sections are 8-byte aligned), then the tail bytes
+inline uint64_t snapshot_checksum(const char *data, size_t len, uint64_t hash = 1469598103934665603ULL){
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 1099511628211ULL;
+    }
+    for (; i < len; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+inline size_t snapshot_align(size_t n){
+    return (n + 7) & ~(size_t)7;
+}
+
+// write sections to snapshot_file, tagged with the size and mtime of source_file
+// the snapshot is written to a temporary file and renamed into place, so readers never see half of it
+// return false if it could not be written (the backend keeps running from the text file)
+inline bool write_snapshot(const char *snapshot_file, const char *source_file, const snapshot_sections &sections){
+    struct stat st;
+    if (stat(source_file, &st) == -1) {
+        return false;
+    }
+    struct snapshot_header header;
+    memset(&header, 0, sizeof header);
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.interval_size = sizeof(interval);
+    header.user_count = sections.user_count;
+    header.interval_count = sections.interval_count;
+    header.names_bytes = sections.names_bytes;
+    header.bitmap_words = sections.bitmap_words;
+    header.max_user_intervals = sections.max_user_intervals;
+    header.source_size = st.st_size;
+    header.source_mtime_sec = st.st_mtim.tv_sec;
+    header.source_mtime_nsec = st.st_mtim.tv_nsec;
+
+    // the sections and the zero padding that aligns each one, checksummed as they are written
+    static const char padding[8] = {0};
+    struct { const char *data; size_t size; } parts[] = {
+        {(const char *)sections.users, (size_t)sections.user_count * sizeof(snapshot_user)},
+        {(const char *)sections.intervals, (size_t)sections.interval_count * sizeof(interval)},
+        {sections.names, (size_t)sections.names_bytes},
+        {(const char *)sections.bitmaps, (size_t)sections.user_count * sections.bitmap_words * sizeof(uint64_t)},
+    };
+    header.checksum = 1469598103934665603ULL;
+    for (const auto &part : parts) { // a part's tail and its padding make one word, as the reader sees them
+        size_t whole = part.size & ~(size_t)7;
+        header.checksum = snapshot_checksum(part.data, whole, header.checksum);
+        if (whole < part.size) {
+            char tail[8] = {0};
+            memcpy(tail, part.data + whole, part.size - whole);
+            header.checksum = snapshot_checksum(tail, 8, header.checksum);
+        }
+    }
+
+    std::string tmp_file = std::string(snapshot_file) + ".tmp";
+    FILE *out = fopen(tmp_file.c_str(), "wb");
+    if (out == NULL) {
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof header, 1, out) == 1;
+    for (const auto &part : parts) {
+        size_t pad = snapshot_align(part.size) - part.size;
+        ok = ok && fwrite(part.data, 1, part.size, out) == part.size && fwrite(padding, 1, pad, out) == pad;
+    }
+    ok = (fclose(out) == 0) && ok;
+    if (!ok || rename(tmp_file.c_str(), snapshot_file) == -1) {
+        unlink(tmp_file.c_str());
+        return false;
+    }
+    return true;
+}
+
+// mmap snapshot_file and, if it is intact and was built from the current version of source_file,
+// point sections into the mapping, which stays mapped until unmap_snapshot()
+// return false if there is no usable snapshot, sections is then left unchanged
+inline bool load_snapshot(const char *snapshot_file, const char *source_file, snapshot_sections &sections){
+    struct stat source_st, st;
+    if (stat(source_file, &source_st) == -1) {
+        return false;
+    }
+    int fd = open(snapshot_file, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(snapshot_header)) {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    const char *data = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    struct snapshot_header header;
+    memcpy(&header, data, sizeof header);
+    size_t users_bytes = (size_t)header.user_count * sizeof(snapshot_user);
+    size_t intervals_bytes = snapshot_align(header.interval_count * sizeof(interval));
+    size_t names_bytes = snapshot_align(header.names_bytes);
+    size_t bitmaps_bytes = (size_t)header.user_count * header.bitmap_words * sizeof(uint64_t);
+    const char *body = data + sizeof header;
+    size_t body_bytes = size - sizeof header;
+    bool ok = header.magic == SNAPSHOT_MAGIC && header.version == SNAPSHOT_VERSION
+              && header.interval_size == sizeof(interval)
+              && header.source_size == (uint64_t)source_st.st_size
+              && header.source_mtime_sec == source_st.st_mtim.tv_sec
+              && header.source_mtime_nsec == source_st.st_mtim.tv_nsec
+              && body_bytes == users_bytes + intervals_bytes + names_bytes + bitmaps_bytes
+              && snapshot_checksum(body, body_bytes) == header.checksum;
+    const snapshot_user *users = (const snapshot_user *)body;
+    for (uint32_t i = 0; i < header.user_count && ok; i++) { // every slice must stay inside its section
+        const user_record &record = users[i].record;
+        ok = users[i].name_offset + users[i].name_len <= header.names_bytes
+             && (uint64_t)record.offset + record.count <= header.interval_count
+             && (header.bitmap_words == 0 || (uint64_t)record.bitmap_offset + header.bitmap_words <= bitmaps_bytes / sizeof(uint64_t));
+    }
+    if (!ok) {
+        munmap((void *)data, size);
+        return false;
+    }
+    sections.users = users;
+    sections.user_count = header.user_count;
+    sections.intervals = (const interval *)(body + users_bytes);
+    sections.interval_count = header.interval_count;
+    sections.names = body + users_bytes + intervals_bytes;
+    sections.names_bytes = header.names_bytes;
+    sections.bitmaps = (const uint64_t *)(body + users_bytes + intervals_bytes + names_bytes);
+    sections.bitmap_words = header.bitmap_words;
+    sections.max_user_intervals = header.max_user_intervals;
+    sections.mapping = (void *)data;
+    sections.mapping_size = size;
+    return true;
+}
+
+// unmap the file load_snapshot() mapped for sections, if any
+inline void unmap_snapshot(snapshot_sections &sections){
+    if (sections.mapping != NULL) {
+        munmap(sections.mapping, sections.mapping_size);
+        sections.mapping = NULL;
+    }
+}
+
+#endif
@@ -0,0 +1,153 @@
+/**
+ * trace.h - sampled per-request tracing
+ *           serverM picks the requests to trace and gives each a random trace id, which travels in the
+ *           trace_id field of every query and result datagram (0 for a request that is not traced);
+ *           serverM and the backends record the spans of a traced request, name + start and end in
+ *           nanoseconds of CLOCK_MONOTONIC (shared by every process on the host), in a ring buffer of the
+ *           thread that ran them
+ *           every ring is written by its thread only; a slot is guarded by a sequence number that is odd
+ *           while the slot is written, so a reader copies a span without any lock and drops one that was
+ *           overwritten under it; a full ring overwrites its oldest spans
+ *           trace_dump() lists every span still in the rings, one line each:
+ *             "trace_id\tprocess\tthread\tlane\tname\trequest_id\tstart_ns\tend_ns"
+ *           and trace_merge turns the dumps of several processes into Chrome trace-event JSON
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <atomic>
+#include <random>
+#include <string>
+#include "metrics.h"
+
+#define TRACE_RING_SIZE 4096 // spans kept per thread
+#define TRACE_MAX_THREADS 256 // threads beyond this many record nothing
+
+/**
+ * one span slot of a ring, every field is read by trace_dump() while the owner may write it
+*/
+struct trace_slot {
+    std::atomic<uint64_t> sequence{0}; // 2 * position + 1 while written, 2 * position + 2 once complete
+    std::atomic<uint64_t> trace_id{0};
+    std::atomic<uint64_t> start_ns{0};
+    std::atomic<uint64_t> end_ns{0};
+    std::atomic<const char *> name{NULL}; // must outlive the process' spans, ie. a string literal
+    std::atomic<uint32_t> request_id{0};
+    std::atomic<uint32_t> lane{0}; // 0 for work on the thread itself, > 0 for a wait shown on a row of its own
+};
+
+/**
+ * the spans of one thread, written by that thread only
+*/
+struct trace_ring {
+    std::atomic<uint64_t> head{0}; // spans ever written, the next one goes to slots[head % TRACE_RING_SIZE]
+    long thread_id = 0; // kernel thread id, the thread row in the trace
+    trace_slot slots[TRACE_RING_SIZE];
+};
+
+inline std::atomic<trace_ring *> trace_rings[TRACE_MAX_THREADS]; // every thread's ring, in registration order
+inline std::atomic<int> trace_thread_count(0); // threads that registered a ring
+
+// the calling thread's ring, registered on its first span; NULL once TRACE_MAX_THREADS threads have one
+inline trace_ring *trace_local(){
+    static thread_local trace_ring *ring = NULL;
+    static thread_local bool registered = false;
+    if (!registered) {
+        registered = true;
+        int slot = trace_thread_count.fetch_add(1);
+        if (slot < TRACE_MAX_THREADS) {
+            ring = new trace_ring();
+            ring->thread_id = syscall(SYS_gettid);
+            trace_rings[slot].store(ring, std::memory_order_release);
+        }
+    }
+    return ring;
+}
+
+// a random trace id, never 0
+inline uint64_t trace_new_id(){
+    static thread_local std::mt19937_64 generator(std::random_device{}());
+    uint64_t id;
+    while ((id = generator()) == 0);
+    return id;
+}
+
+// true for about one call in one_in, never if one_in is 0
+inline bool trace_sample(unsigned one_in){
+    static thread_local std::minstd_rand generator(std::random_device{}());
+    return one_in > 0 && generator() % one_in == 0;
+}
+
+// record a span of trace_id (nothing if it is 0) from start_ns to end_ns (metrics_now_ns() times)
+inline void trace_span(uint64_t trace_id, const char *name, uint32_t request_id, uint64_t start_ns, uint64_t end_ns, uint32_t lane = 0){
+    if (trace_id == 0) {
+        return;
+    }
+    trace_ring *ring = trace_local();
+    if (ring == NULL) {
+        return;
+    }
+    uint64_t position = ring->head.load(std::memory_order_relaxed);
+    trace_slot &slot = ring->slots[position % TRACE_RING_SIZE];
+    slot.sequence.store(2 * position + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release); // the odd sequence is visible before any field changes
+    slot.trace_id.store(trace_id, std::memory_order_relaxed);
+    slot.start_ns.store(start_ns, std::memory_order_relaxed);
+    slot.end_ns.store(end_ns, std::memory_order_relaxed);
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.request_id.store(request_id, std::memory_order_relaxed);
+    slot.lane.store(lane, std::memory_order_relaxed);
+    slot.sequence.store(2 * position + 2, std::memory_order_release);
+    ring->head.store(position + 1, std::memory_order_release);
+}
+
+// record a span of trace_id from start_ns until now
+inline void trace_span_since(uint64_t trace_id, const char *name, uint32_t request_id, uint64_t start_ns, uint32_t lane = 0){
+    if (trace_id != 0) {
+        trace_span(trace_id, name, request_id, start_ns, metrics_now_ns(), lane);
+    }
+}
+
+// every complete span in the rings of this process, one line each (see the top of this file),
+// process names the process in the merged trace and must not contain a tab
+inline std::string trace_dump(const std::string &process){
+    std::string out;
+    int threads = trace_thread_count.load(std::memory_order_acquire);
+    for (int i = 0; i < threads && i < TRACE_MAX_THREADS; i++) {
+        trace_ring *ring = trace_rings[i].load(std::memory_order_acquire);
+        if (ring == NULL) {
+            continue;
+        }
+        for (trace_slot &slot : ring->slots) {
+            uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence == 0 || sequence % 2 == 1) { // never written or being written
+                continue;
+            }
+            uint64_t trace_id = slot.trace_id.load(std::memory_order_relaxed);
+            uint64_t start_ns = slot.start_ns.load(std::memory_order_relaxed);
+            uint64_t end_ns = slot.end_ns.load(std::memory_order_relaxed);
+            const char *name = slot.name.load(std::memory_order_relaxed);
+            uint32_t request_id = slot.request_id.load(std::memory_order_relaxed);
+            uint32_t lane = slot.lane.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire); // the fields are read before the sequence again
+            if (slot.sequence.load(std::memory_order_relaxed) != sequence) { // overwritten while copied
+                continue;
+            }
+            char line[128];
+            snprintf(line, sizeof line, "%016llx\t", (unsigned long long)trace_id);
+            out += line + process;
+            snprintf(line, sizeof line, "\t%ld\t%u\t", ring->thread_id, lane);
+            out += line + std::string(name);
+            snprintf(line, sizeof line, "\t%u\t%llu\t%llu\n", request_id, (unsigned long long)start_ns, (unsigned long long)end_ns);
+            out += line;
+        }
+    }
+    return out;
+}
+
+#endif
@@ -0,0 +1,193 @@
+/**
+ * trace_merge.cpp - merge the trace span dumps of serverM and the backends into one Chrome trace
+ *                   every input is what /trace on a metrics port returned (see trace.h), one span per line:
+ *                   "trace_id\tprocess\tthread\tlane\tname\trequest_id\tstart_ns\tend_ns"
+ *                   the output is trace-event JSON for chrome://tracing or https://ui.perfetto.dev:
+ *                   one process per server, and inside it one row per traced request and thread, plus one row
+ *                   per wait lane (ie. serverM waiting for server A), so a request's whole fan-out lines up
+ *                   on one timeline; the times of every process come from the same CLOCK_MONOTONIC, so the
+ *                   dumps must come from one host
+ * usage: trace_merge [--trace TRACE_ID] [FILE]...   (no FILE reads standard input)
+ *        ie. curl -s localhost:26984/trace > m.txt; curl -s localhost:27984/trace > a.txt;
+ *            curl -s localhost:28984/trace > b.txt; ./trace_merge m.txt a.txt b.txt > trace.json
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <algorithm>
+
+using namespace std;
+
+/**
+ * one span read from a dump
+*/
+struct span {
+    string trace_id;
+    string process;
+    long thread = 0;
+    unsigned lane = 0;
+    string name;
+    uint32_t request_id = 0;
+    uint64_t start_ns = 0;
+    uint64_t end_ns = 0;
+};
+
+// split one dump line into a span, return false if it is not one
+bool parse_span(const string &line, span &out){
+    vector<string> fields;
+    size_t start = 0;
+    while (true) {
+        size_t tab = line.find('\t', start);
+        fields.push_back(line.substr(start, tab == string::npos ? string::npos : tab - start));
+        if (tab == string::npos) {
+            break;
+        }
+        start = tab + 1;
+    }
+    if (fields.size() != 8) {
+        return false;
+    }
+    out.trace_id = fields[0];
+    out.process = fields[1];
+    out.thread = atol(fields[2].c_str());
+    out.lane = strtoul(fields[3].c_str(), NULL, 10);
+    out.name = fields[4];
+    out.request_id = strtoul(fields[5].c_str(), NULL, 10);
+    out.start_ns = strtoull(fields[6].c_str(), NULL, 10);
+    out.end_ns = strtoull(fields[7].c_str(), NULL, 10);
+    return out.end_ns >= out.start_ns;
+}
+
+// read every span of a dump, the HTTP headers of a raw response are skipped as lines that are not spans
+void read_spans(istream &in, const string &only_trace, vector<span> &spans){
+    string line;
+    while (getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        span s;
+        if (parse_span(line, s) && (only_trace.empty() || s.trace_id == only_trace)) {
+            spans.push_back(s);
+        }
+    }
+}
+
+// quote a string for JSON
+string json_string(const string &text){
+    string out = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char)c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof escaped, "\\u%04x", c);
+            out += escaped;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+// microseconds since base_ns with nanosecond precision, the unit of "ts" and "dur"
+string microseconds(uint64_t ns, uint64_t base_ns){
+    char text[32];
+    snprintf(text, sizeof text, "%.3f", (ns - base_ns) / 1000.0);
+    return text;
+}
+
+int main(int argc, char *argv[]){
+    string only_trace;
+    vector<string> files;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            only_trace = argv[++i];
+        } else {
+            files.push_back(argv[i]);
+        }
+    }
+    vector<span> spans;
+    if (files.empty()) {
+        read_spans(cin, only_trace, spans);
+    }
+    for (const string &file : files) {
+        ifstream in(file);
+        if (!in) {
+            fprintf(stderr, "trace_merge: cannot open %s\n", file.c_str());
+            exit(1);
+        }
+        read_spans(in, only_trace, spans);
+    }
+    if (spans.empty()) {
+        fprintf(stderr, "trace_merge: no spans\n");
+    }
+
+    // number the processes (serverM first) and, inside every process, the rows: one per
+    // (trace, thread) for the work of a thread and one per (trace, lane) for a wait lane
+    map<string, int> pids;
+    uint64_t base_ns = UINT64_MAX;
+    for (const span &s : spans) {
+        pids[s.process] = 0;
+        base_ns = min(base_ns, s.start_ns);
+    }
+    int next_pid = 1;
+    if (pids.count("serverM") > 0) {
+        pids["serverM"] = next_pid++;
+    }
+    for (auto &entry : pids) {
+        if (entry.second == 0) {
+            entry.second = next_pid++;
+        }
+    }
+    map<tuple<string, string, unsigned, long>, int> rows; // (process, trace, lane, thread or 0) -> tid
+    map<tuple<string, string, unsigned, long>, string> row_names;
+    for (const span &s : spans) {
+        tuple<string, string, unsigned, long> key(s.process, s.trace_id, s.lane, s.lane > 0 ? 0 : s.thread);
+        rows[key] = 0;
+        row_names[key] = "trace " + s.trace_id + (s.lane > 0 ? ", " + s.name : ", thread " + to_string(s.thread));
+    }
+    int next_tid = 1;
+    for (auto &entry : rows) { // map order keeps the rows of a trace together
+        entry.second = next_tid++;
+    }
+
+    cout << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+    bool first = true;
+    for (const auto &entry : pids) {
+        cout << (first ? "" : ",\n") << "{\"ph\": \"M\", \"name\": \"process_name\", \"pid\": " << entry.second
+             << ", \"args\": {\"name\": " << json_string(entry.first) << "}},\n"
+             << "{\"ph\": \"M\", \"name\": \"process_sort_index\", \"pid\": " << entry.second
+             << ", \"args\": {\"sort_index\": " << entry.second << "}}";
+        first = false;
+    }
+    for (const auto &entry : rows) {
+        int pid = pids[get<0>(entry.first)];
+        cout << (first ? "" : ",\n") << "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": " << pid << ", \"tid\": " << entry.second
+             << ", \"args\": {\"name\": " << json_string(row_names[entry.first]) << "}},\n"
+             << "{\"ph\": \"M\", \"name\": \"thread_sort_index\", \"pid\": " << pid << ", \"tid\": " << entry.second
+             << ", \"args\": {\"sort_index\": " << entry.second << "}}";
+        first = false;
+    }
+    // complete events, sorted by start so every viewer nests them right
+    sort(spans.begin(), spans.end(), [](const span &a, const span &b) {
+        return a.start_ns != b.start_ns ? a.start_ns < b.start_ns : a.end_ns > b.end_ns;
+    });
+    for (const span &s : spans) {
+        tuple<string, string, unsigned, long> key(s.process, s.trace_id, s.lane, s.lane > 0 ? 0 : s.thread);
+        cout << (first ? "" : ",\n") << "{\"ph\": \"X\", \"name\": " << json_string(s.name) << ", \"cat\": \"request\""
+             << ", \"pid\": " << pids[s.process] << ", \"tid\": " << rows[key]
+             << ", \"ts\": " << microseconds(s.start_ns, base_ns) << ", \"dur\": " << microseconds(s.end_ns, s.start_ns)
+             << ", \"args\": {\"trace_id\": " << json_string(s.trace_id) << ", \"request_id\": " << s.request_id << "}}";
+        first = false;
+    }
+    cout << "\n]}" << endl;
+    return 0;
+}